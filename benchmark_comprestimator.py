@@ -0,0 +1,340 @@
+"""
+Accuracy-versus-time benchmark harness for comprestimator.
+
+Builds reproducible synthetic volumes and directory trees, computes their ground
+truth with a full compression pass of its own (Python zlib, independent of the
+estimator), then runs the estimator under every sampling mode and -p value and
+records the error against wall time and bytes read.
+"""
+import argparse
+import csv
+import json
+import os
+import random
+import shutil
+import subprocess
+import tarfile
+import tempfile
+import time
+import zlib
+
+INBLOCK_SIZE = 2048                 # must match INBLOCK_SIZE in comprestimator.c
+OUTBLOCK_SIZE = 2048                # must match OUTBLOCK_SIZE in comprestimator.c
+CORPUS_VERSION = 2                  # bump when the generators or the ground truth change
+
+DEFAULT_COMPRESTIMATOR_PATH = "./comprestimator"
+DEFAULT_WRAPPER_PATH = "./run_comprestimator.py"
+
+# Column indices of a comprestimator -r results line
+RES_DEV_SIZE_MB = 2
+RES_RUN_TIME = 5
+RES_ZERO_BLOCKS = 6
+RES_NON_ZERO_BLOCKS = 7
+RES_TOTAL_BLOCKS_READ = 8
+RES_AFTER_ZERO_SIZE = 12
+RES_AFTER_ZERO_PERC = 13
+RES_AFTER_RTC_SIZE = 15
+RES_AFTER_RTC_PERC = 16
+
+# Mix of extent kinds (weights) for every volume profile
+VOLUME_PROFILES = {
+    "mixed":          {"zero": 0.30, "random": 0.20, "text": 0.40, "repeat": 0.10},
+    "text":           {"zero": 0.10, "text": 0.90},
+    "incompressible": {"zero": 0.05, "random": 0.95},
+    "sparse":         {"zero": 0.85, "text": 0.10, "random": 0.05},
+}
+
+# Sampling modes of the native tool: name -> extra command line arguments
+VOLUME_MODES = {
+    "random": [],
+    "exhaustive": ["-e"],
+}
+
+DIRECTORY_SAMPLING_PERCENTAGES = ["1%", "10%", "50%"]
+
+WORDS = ("the of and to in is was for on that with as by at from this are be or an it "
+         "block device volume storage sample estimate compression ratio zero extent file "
+         "directory inode offset buffer stream deflate random process child parent").split()
+
+
+class CorpusGenerator():
+    def __init__(self, seed: int):
+        self.rng = random.Random(seed)
+        text = []
+        length = 0
+        while length < (1 << 20):
+            word = self.rng.choice(WORDS)
+            if self.rng.random() < 0.1:
+                word += str(self.rng.randrange(100000))
+            text.append(word)
+            length += len(word) + 1
+        self.text_pool = " ".join(text).encode()
+
+    def extent(self, kind: str, size: int) -> bytes:
+        if kind == "zero":
+            return bytes(size)
+        if kind == "random":
+            return self.rng.randbytes(size)
+        if kind == "repeat":
+            pattern = self.rng.randbytes(self.rng.choice([8, 64, 512]))
+            return (pattern * (size // len(pattern) + 1))[:size]
+        out = bytearray()
+        while len(out) < size:
+            start = self.rng.randrange(len(self.text_pool) - 4096)
+            out += self.text_pool[start:start + self.rng.randrange(512, 4096)]
+        return bytes(out[:size])
+
+    def pick_kind(self, profile: dict) -> str:
+        kinds = list(profile)
+        return self.rng.choices(kinds, weights=[profile[k] for k in kinds])[0]
+
+    def write_volume(self, path: str, profile: dict, size: int):
+        """
+        Writes a volume made of block aligned extents (4 KB - 1 MB) of the profile's kinds
+        """
+        written = 0
+        with open(path, "wb") as f:
+            while written < size:
+                length = min(size - written, self.rng.randrange(1, 256) * 4096)
+                f.write(self.extent(self.pick_kind(profile), length))
+                written += length
+
+    def write_tree(self, root: str, profile: dict, num_files: int):
+        """
+        Writes num_files files with log-uniform sizes (1 KB - 4 MB) into nested directories
+        """
+        for i in range(num_files):
+            depth = self.rng.randrange(4)
+            subdir = os.path.join(root, *[f"d{self.rng.randrange(4)}" for _ in range(depth)])
+            os.makedirs(subdir, exist_ok=True)
+            size = int(2 ** self.rng.uniform(10, 22))
+            with open(os.path.join(subdir, f"f{i}.dat"), "wb") as f:
+                f.write(self.extent(self.pick_kind(profile), size))
+
+
+def read_result_line(res_path: str) -> list[str]:
+    with open(res_path, "r") as f:
+        rows = [row for row in csv.reader(f) if row]
+    if not rows:
+        raise Exception(f"comprestimator wrote no results to {res_path}")
+    return [field.strip() for field in rows[-1]]
+
+
+def run_estimator(comprestimator: str, path: str, args: list[str], workdir: str) -> dict:
+    """
+    Runs comprestimator once and returns its estimate, wall time and bytes read
+    """
+    res_path = os.path.join(workdir, "bench_results.csv")
+    if os.path.exists(res_path):
+        os.unlink(res_path)
+    cmd = [comprestimator, "-d", path, "-r", res_path] + args
+    start = time.monotonic()
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    wall_time = time.monotonic() - start
+    row = read_result_line(res_path)
+    return {
+        "wall_time": wall_time,
+        "bytes_read": int(row[RES_TOTAL_BLOCKS_READ]) * INBLOCK_SIZE,
+        "non_zero_fraction": float(row[RES_AFTER_ZERO_PERC]) / 100,
+        "compressed_fraction": float(row[RES_AFTER_RTC_PERC]) / 100,
+    }
+
+
+def run_wrapper(comprestimator: str, wrapper: str, path: str, args: list[str], workdir: str) -> dict:
+    """
+    Runs the directory mode of run_comprestimator.py from a private working
+    directory (its temporary archive is created there) and reads its estimate
+    from --results-file
+    """
+    rundir = tempfile.mkdtemp(prefix="run_", dir=workdir)
+    try:
+        os.symlink(os.path.abspath(comprestimator), os.path.join(rundir, "comprestimator"))
+        res_path = os.path.join(rundir, "estimate.json")
+        cmd = ["python3", os.path.abspath(wrapper), "--path", os.path.abspath(path),
+               "--results-file", res_path] + args
+        start = time.monotonic()
+        subprocess.run(cmd, check=True, cwd=rundir, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        wall_time = time.monotonic() - start
+        with open(res_path, "r") as f:
+            estimate = json.load(f)
+    finally:
+        shutil.rmtree(rundir)
+    return {
+        "wall_time": wall_time,
+        "bytes_read": estimate["dev_size"] + estimate["blocks_read"] * INBLOCK_SIZE,
+        "non_zero_fraction": estimate["non_zero_frac"],
+        "compressed_fraction": estimate["comp_frac"],
+    }
+
+
+def full_compression(path: str) -> tuple[float, float]:
+    """
+    Ground truth of a file: the fraction of its INBLOCK_SIZE blocks that are not
+    all zero, and the compressed/original size of those blocks at zlib level 1,
+    compressed in order and cut into streams of about OUTBLOCK_SIZE output like
+    the estimator's compression units
+    """
+    zero_block = bytes(INBLOCK_SIZE)
+    blocks = non_zero = total_in = total_out = 0
+    comp, stream_out = zlib.compressobj(1), 0
+    with open(path, "rb") as f:
+        while block := f.read(INBLOCK_SIZE):
+            block = block.ljust(INBLOCK_SIZE, b"\0")
+            blocks += 1
+            if block == zero_block:
+                continue
+            non_zero += 1
+            total_in += len(block)
+            stream_out += len(comp.compress(block)) + len(comp.flush(zlib.Z_SYNC_FLUSH))
+            if stream_out >= OUTBLOCK_SIZE:
+                total_out += stream_out
+                comp, stream_out = zlib.compressobj(1), 0
+    total_out += stream_out
+    return (non_zero / blocks if blocks else 0.0, total_out / total_in if total_in else 0.0)
+
+
+def build_corpora(args, workdir: str) -> list[dict]:
+    """
+    Generates (or reuses) the corpora and their ground truth, recorded in corpus.json
+    """
+    manifest_path = os.path.join(workdir, "corpus.json")
+    params = {"version": CORPUS_VERSION, "seed": args.seed, "volume_size_mb": args.volume_size_mb,
+              "num_files": args.num_files, "profiles": args.profiles, "directories": not args.skip_directories}
+    if os.path.exists(manifest_path):
+        with open(manifest_path, "r") as f:
+            manifest = json.load(f)
+        if manifest["params"] == params:
+            print(f"Reusing corpora from {manifest_path}")
+            return manifest["corpora"]
+
+    corpora = []
+    for i, name in enumerate(args.profiles):
+        profile = VOLUME_PROFILES[name]
+        gen = CorpusGenerator(args.seed + i)
+        path = os.path.join(workdir, f"volume_{name}.img")
+        print(f"Generating volume {path} ...")
+        gen.write_volume(path, profile, args.volume_size_mb << 20)
+        corpora.append({"name": f"volume_{name}", "kind": "volume", "path": path})
+
+        if not args.skip_directories:
+            tree = os.path.join(workdir, f"tree_{name}")
+            shutil.rmtree(tree, ignore_errors=True)
+            print(f"Generating directory tree {tree} ...")
+            gen.write_tree(tree, profile, args.num_files)
+            # Ground truth of a tree is taken over an archive of every file, like the exhaustive wrapper mode
+            archive = os.path.join(workdir, f"tree_{name}.tar")
+            with tarfile.open(archive, mode="w:") as tar:
+                tar.add(tree)
+            corpora.append({"name": f"tree_{name}", "kind": "tree", "path": tree, "archive": archive})
+
+    for corpus in corpora:
+        target = corpus.get("archive", corpus["path"])
+        print(f"Computing ground truth for {corpus['name']} ...")
+        corpus["truth_non_zero_fraction"], corpus["truth_compressed_fraction"] = full_compression(target)
+        # The estimator's own full pass, for reference: what -e is scored against is the zlib pass above
+        exhaustive = run_estimator(args.comprestimator, target, ["-e", "-p", str(os.cpu_count() or 1)], workdir)
+        corpus["exhaustive_non_zero_fraction"] = exhaustive["non_zero_fraction"]
+        corpus["exhaustive_compressed_fraction"] = exhaustive["compressed_fraction"]
+        print(f"  zlib: {corpus['truth_non_zero_fraction']*100:.2f}% non-zero, "
+              f"{corpus['truth_compressed_fraction']*100:.2f}% compressed; "
+              f"-e: {exhaustive['non_zero_fraction']*100:.2f}% non-zero, "
+              f"{exhaustive['compressed_fraction']*100:.2f}% compressed")
+
+    with open(manifest_path, "w") as f:
+        json.dump({"params": params, "corpora": corpora}, f, indent=2)
+    return corpora
+
+
+def run_matrix(args, corpora: list[dict], workdir: str) -> list[dict]:
+    runs = []
+    for corpus in corpora:
+        configs = []
+        if corpus["kind"] == "volume":
+            for mode in args.modes:
+                for procs in args.procs:
+                    for rep in range(args.repeats):
+                        extra = VOLUME_MODES[mode] + ["-p", str(procs), "-s", str(args.seed + rep)]
+                        configs.append((mode, procs, rep, extra))
+        else:
+            for perc in DIRECTORY_SAMPLING_PERCENTAGES:
+                for rep in range(args.repeats):
+                    configs.append((f"dir_{perc}", 1, rep, ["--sampling-percentage", perc]))
+
+        for mode, procs, rep, extra in configs:
+            if corpus["kind"] == "volume":
+                result = run_estimator(args.comprestimator, corpus["path"], extra, workdir)
+            else:
+                result = run_wrapper(args.comprestimator, args.wrapper, corpus["path"], extra, workdir)
+            result.update({
+                "corpus": corpus["name"], "mode": mode, "procs": procs, "repeat": rep,
+                "error": abs(result["compressed_fraction"] - corpus["truth_compressed_fraction"]),
+                "zero_error": abs(result["non_zero_fraction"] - corpus["truth_non_zero_fraction"]),
+            })
+            print(f"{corpus['name']:24} {mode:12} -p {procs:<3} error {result['error']*100:6.2f}% "
+                  f"time {result['wall_time']:7.2f}s read {result['bytes_read']/1048576:9.1f} MB")
+            runs.append(result)
+    return runs
+
+
+def write_report(runs: list[dict], out_dir: str):
+    os.makedirs(out_dir, exist_ok=True)
+    fields = ["corpus", "mode", "procs", "repeat", "wall_time", "bytes_read",
+              "non_zero_fraction", "compressed_fraction", "error", "zero_error"]
+    csv_path = os.path.join(out_dir, "bench_runs.csv")
+    with open(csv_path, "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=fields)
+        writer.writeheader()
+        for run in runs:
+            writer.writerow({k: run[k] for k in fields})
+    print(f"Wrote {len(runs)} runs to {csv_path}")
+
+    try:
+        import matplotlib
+        matplotlib.use("Agg")
+        import matplotlib.pyplot as plt
+    except ImportError:
+        print("matplotlib not installed, skipping plots")
+        return
+
+    for x_key, x_label in (("wall_time", "wall time (s)"), ("bytes_read", "bytes read")):
+        fig, ax = plt.subplots()
+        for mode in sorted({run["mode"] for run in runs}):
+            points = [run for run in runs if run["mode"] == mode]
+            ax.scatter([p[x_key] for p in points], [p["error"] * 100 for p in points], label=mode)
+        ax.set_xscale("log")
+        ax.set_xlabel(x_label)
+        ax.set_ylabel("absolute error (% points)")
+        ax.legend()
+        plot_path = os.path.join(out_dir, f"error_vs_{x_key}.png")
+        fig.savefig(plot_path)
+        plt.close(fig)
+        print(f"Wrote {plot_path}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Measures comprestimator accuracy against run time and I/O on synthetic corpora")
+    parser.add_argument('--workdir', type=str, default="./bench_corpora", help="Directory for generated corpora (reused between runs)")
+    parser.add_argument('--out', type=str, default="./bench_report", help="Directory for the run table and plots")
+    parser.add_argument('--comprestimator', type=str, default=DEFAULT_COMPRESTIMATOR_PATH, help="Path to the comprestimator executable")
+    parser.add_argument('--wrapper', type=str, default=DEFAULT_WRAPPER_PATH, help="Path to run_comprestimator.py (directory mode)")
+    parser.add_argument('--seed', type=int, default=1, help="Seed for corpus generation and estimator runs")
+    parser.add_argument('--volume-size-mb', type=int, default=64, help="Size of every synthetic volume")
+    parser.add_argument('--num-files', type=int, default=200, help="Number of files in every synthetic directory tree")
+    parser.add_argument('--profiles', nargs='+', default=list(VOLUME_PROFILES), choices=list(VOLUME_PROFILES))
+    parser.add_argument('--modes', nargs='+', default=list(VOLUME_MODES), choices=list(VOLUME_MODES))
+    parser.add_argument('--procs', nargs='+', type=int, default=[1, 2, 4, 8], help="-p values to run")
+    parser.add_argument('--repeats', type=int, default=3, help="Runs per configuration (with different seeds)")
+    parser.add_argument('--skip-directories', action="store_true", help="Only benchmark volumes")
+    args = parser.parse_args()
+
+    if not os.path.isfile(args.comprestimator):
+        raise FileNotFoundError(f"Comprestimator executable not found at {args.comprestimator}, build it with 'make'")
+
+    os.makedirs(args.workdir, exist_ok=True)
+    corpora = build_corpora(args, args.workdir)
+    runs = run_matrix(args, corpora, args.workdir)
+    write_report(runs, args.out)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,199 @@
+/* comprestimator-client -- submit estimation requests to comprestimatord
+ *
+ * Sends one request per path (all at once, so the daemon can run them side by
+ * side) and prints the JSON lines the daemon streams back, progress lines only
+ * with -v. Exits nonzero if any request failed.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEFAULT_SOCKET_PATH	"/run/comprestimatord.sock"	//must match comprestimatord.c
+#define MAX_PATHS		1024	//Maximum number of paths per invocation
+#define MAX_LINE_LEN		16384
+
+struct request {
+	int fd;
+	char buf[MAX_LINE_LEN];
+	size_t len;
+};
+
+void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-S <socket> -e -s <seed> -t <percent> -v -h] <path>...\n", prog);
+	fprintf(stderr, "       %s [-S <socket>] -q\n", prog);
+	fprintf(stderr, "       -S: socket of comprestimatord (default %s)\n", DEFAULT_SOCKET_PATH);
+	fprintf(stderr, "       -e: run exhaustive search\n");
+	fprintf(stderr, "       -s: seed to use for PRNG\n");
+	fprintf(stderr, "       -t: target error in percent\n");
+	fprintf(stderr, "       -v: also print progress lines\n");
+	fprintf(stderr, "       -q: print the status of the daemon and exit\n");
+	fprintf(stderr, "       -h: print this help and exit\n");
+	exit(1);
+}
+
+static int connect_daemon(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("connect");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int send_line(int fd, const char *line)
+{
+	size_t len = strlen(line);
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, line, len, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("send");
+			return -1;
+		}
+		line += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Print the complete lines received on req. Returns the number of error lines. */
+static int print_lines(struct request *req, int verbose)
+{
+	char *line = req->buf;
+	char *nl;
+	int errors = 0;
+
+	while ((nl = memchr(line, '\n', req->len - (line - req->buf)))) {
+		*nl = '\0';
+		if (strstr(line, "\"type\": \"error\""))
+			errors++;
+		if (verbose || !strstr(line, "\"type\": \"progress\""))
+			printf("%s\n", line);
+		line = nl + 1;
+	}
+	req->len -= line - req->buf;
+	memmove(req->buf, line, req->len);
+	fflush(stdout);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	char *socket_path = DEFAULT_SOCKET_PATH;
+	static struct request reqs[MAX_PATHS];
+	struct pollfd pfds[MAX_PATHS];
+	char options[128] = "";
+	char line[MAX_LINE_LEN];
+	char path[PATH_MAX];
+	int exhaustive = 0;
+	int verbose = 0;
+	int status = 0;
+	char *seed = NULL;
+	char *target = NULL;
+	int num_reqs, open_reqs;
+	int errors = 0;
+	ssize_t ret;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "S:es:t:vqh")) != -1)
+		switch (c)
+		{
+			case 'S':
+				socket_path = optarg;
+				break;
+			case 'e':
+				exhaustive = 1;
+				break;
+			case 's':
+				seed = optarg;
+				break;
+			case 't':
+				target = optarg;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'q':
+				status = 1;
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+		}
+
+	if (status) {
+		if (optind != argc)
+			usage(argv[0]);
+	} else if (optind == argc || argc - optind > MAX_PATHS) {
+		usage(argv[0]);
+	}
+
+	snprintf(options, sizeof(options), "exhaustive=%d%s%s%s%s", exhaustive, (seed ? " seed=" : ""),
+			(seed ? seed : ""), (target ? " target_error=" : ""), (target ? target : ""));
+
+	num_reqs = status ? 1 : argc - optind;
+	for (i = 0; i < num_reqs; i++) {
+		reqs[i].fd = connect_daemon(socket_path);
+		if (reqs[i].fd == -1)
+			return 1;
+		if (status)
+			snprintf(line, sizeof(line), "status\n");
+		else
+			/* The daemon resolves paths in its own working directory */
+			snprintf(line, sizeof(line), "estimate %s path=%s\n", options,
+					(realpath(argv[optind + i], path) ? path : argv[optind + i]));
+		if (send_line(reqs[i].fd, line))
+			return 1;
+		pfds[i].fd = reqs[i].fd;
+		pfds[i].events = POLLIN;
+	}
+
+	for (open_reqs = num_reqs; open_reqs; ) {
+		if (poll(pfds, num_reqs, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+		for (i = 0; i < num_reqs; i++) {
+			if (pfds[i].fd == -1 || !pfds[i].revents)
+				continue;
+			ret = recv(reqs[i].fd, reqs[i].buf + reqs[i].len, sizeof(reqs[i].buf) - 1 - reqs[i].len, 0);
+			if (ret == -1 && errno == EINTR)
+				continue;
+			if (ret <= 0) {
+				close(reqs[i].fd);
+				pfds[i].fd = -1;
+				open_reqs--;
+				continue;
+			}
+			reqs[i].len += ret;
+			errors += print_lines(&reqs[i], verbose);
+		}
+	}
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,257 @@
+/* comprestimator-top -- live monitor for comprestimator --stats <file>
+ *
+ * Maps the statistics segment read-only and prints snapshots of it, either as
+ * a refreshing screen or as one JSON object per line for scrapers. Reading
+ * never blocks or slows the running estimator (see comprestimator_stats.h).
+ */
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "comprestimator_stats.h"
+
+#define INBLOCK_SIZE		2048	//must match comprestimator.c
+#define MAX_READ_RETRIES	10000	//give up on a consistent copy after this many tries
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-i <interval> -n <count> -j -h] <stats_file>\n", prog);
+	fprintf(stderr, "       -i: seconds between snapshots (default 1)\n");
+	fprintf(stderr, "       -n: number of snapshots to print (default: until the run ends)\n");
+	fprintf(stderr, "       -j: print one JSON object per snapshot instead of a screen\n");
+	fprintf(stderr, "       -h: print this help and exit\n");
+	exit(1);
+}
+
+/* Take a consistent copy of the segment. Returns the number of entries that
+ * could not be copied consistently (a writer died mid-update or kept racing). */
+static int snapshot(struct stats_segment *seg, struct stats_segment *snap)
+{
+	int i, tries;
+	int stale = 0;
+	uint32_t s;
+
+	for (tries = 0; tries < MAX_READ_RETRIES; tries++) {
+		s = stats_read_begin(&seg->seq);
+		memcpy(snap, seg, offsetof(struct stats_segment, workers));
+		if (!stats_read_retry(&seg->seq, s))
+			break;
+	}
+	if (tries == MAX_READ_RETRIES)
+		stale++;
+
+	for (i = 0; i < snap->num_workers && i < STATS_MAX_WORKERS; i++) {
+		for (tries = 0; tries < MAX_READ_RETRIES; tries++) {
+			s = stats_read_begin(&seg->workers[i].seq);
+			memcpy(&snap->workers[i], &seg->workers[i], sizeof(struct stats_worker));
+			if (!stats_read_retry(&seg->workers[i].seq, s))
+				break;
+		}
+		if (tries == MAX_READ_RETRIES) {
+			snap->workers[i].pid = 0;
+			stale++;
+		}
+	}
+	return stale;
+}
+
+/* Totals including the blocks of children that are still running */
+static void live_totals(struct stats_segment *snap, uint64_t *blocks, uint64_t *zero, uint64_t *non_zero)
+{
+	int i;
+
+	*blocks = snap->blocks_read;
+	*zero = snap->zero_blocks;
+	*non_zero = snap->non_zero_blocks;
+	for (i = 0; i < snap->num_workers && i < STATS_MAX_WORKERS; i++) {
+		if (!snap->workers[i].pid)
+			continue;
+		*blocks += snap->workers[i].blocks_read;
+		*zero += snap->workers[i].zero_blocks;
+		*non_zero += snap->workers[i].non_zero_blocks;
+	}
+}
+
+static void print_json(struct stats_segment *snap, double rate, int stale)
+{
+	uint64_t blocks, zero, non_zero;
+	uint64_t now = now_ns();
+	int i, first = 1;
+
+	live_totals(snap, &blocks, &zero, &non_zero);
+	printf("{\"pid\": %d, \"device\": \"%s\", \"dev_size\": %llu, \"elapsed_s\": %.3f, \"finished\": %d, "
+			"\"stale_entries\": %d, \"samples\": %llu, \"zero_blocks\": %llu, \"non_zero_blocks\": %llu, "
+			"\"bytes_read\": %llu, \"bytes_per_sec\": %.0f, \"non_zero_frac\": %.5f, \"conf_zeros\": %.5f, "
+			"\"comp_frac\": %.5f, \"conf_comp\": %.5f, \"read_p50_ns\": %llu, \"read_p90_ns\": %llu, "
+			"\"read_p99_ns\": %llu, \"workers\": [",
+			snap->pid, snap->dev_name, (unsigned long long)snap->dev_size,
+			(double)(now - snap->start_ns) / 1e9, snap->finished, stale,
+			(unsigned long long)(zero + non_zero), (unsigned long long)zero, (unsigned long long)non_zero,
+			(unsigned long long)blocks * INBLOCK_SIZE, rate, snap->non_zero_frac, snap->conf_zeros,
+			snap->comp_frac, snap->conf_comp, (unsigned long long)snap->read_p50_ns,
+			(unsigned long long)snap->read_p90_ns, (unsigned long long)snap->read_p99_ns);
+	for (i = 0; i < snap->num_workers && i < STATS_MAX_WORKERS; i++) {
+		struct stats_worker *w = &snap->workers[i];
+
+		if (!w->pid)
+			continue;
+		printf("%s{\"slot\": %d, \"pid\": %d, \"blocks_read\": %llu, \"bytes_per_sec\": %.0f, "
+				"\"read_p50_ns\": %llu, \"read_p99_ns\": %llu}", (first ? "" : ", "), i, w->pid,
+				(unsigned long long)w->blocks_read, w->bytes_per_sec,
+				(unsigned long long)w->read_p50_ns, (unsigned long long)w->read_p99_ns);
+		first = 0;
+	}
+	printf("]}\n");
+	fflush(stdout);
+}
+
+static void print_screen(struct stats_segment *snap, double rate, int stale, int clear)
+{
+	uint64_t blocks, zero, non_zero;
+	uint64_t now = now_ns();
+	int i;
+
+	live_totals(snap, &blocks, &zero, &non_zero);
+	if (clear)
+		printf("\033[H\033[2J");
+	printf("comprestimator pid %d on %s (%.1f MB)%s%s\n", snap->pid, snap->dev_name,
+			(double)snap->dev_size / 1048576, (snap->exhaustive ? ", exhaustive" : ""),
+			(snap->finished ? ", finished" : ""));
+	printf("Elapsed: %.1f s   Samples: %llu (%llu non-zero)   Read: %.1f MB   Rate: %.1f MB/s\n",
+			(double)(now - snap->start_ns) / 1e9, (unsigned long long)(zero + non_zero),
+			(unsigned long long)non_zero, (double)blocks * INBLOCK_SIZE / 1048576, rate / 1048576);
+	printf("Non-zero: %.2f%% (+- %.2f%%)   Compression rate: %.2f%% (+- %.2f%%)   [%llu children done]\n",
+			snap->non_zero_frac * 100, snap->conf_zeros * 100, snap->comp_frac * 100,
+			snap->conf_comp * 100, (unsigned long long)snap->children_done);
+	printf("pread latency: p50 %.1f us  p90 %.1f us  p99 %.1f us\n", snap->read_p50_ns / 1e3,
+			snap->read_p90_ns / 1e3, snap->read_p99_ns / 1e3);
+	if (stale)
+		printf("(%d entries could not be read consistently)\n", stale);
+	printf("\n%5s %8s %10s %10s %10s %10s %8s\n", "slot", "pid", "blocks", "MB/s", "p50 us", "p99 us", "age s");
+	for (i = 0; i < snap->num_workers && i < STATS_MAX_WORKERS; i++) {
+		struct stats_worker *w = &snap->workers[i];
+
+		if (!w->pid)
+			continue;
+		printf("%5d %8d %10llu %10.1f %10.1f %10.1f %8.1f\n", i, w->pid,
+				(unsigned long long)w->blocks_read, w->bytes_per_sec / 1048576,
+				w->read_p50_ns / 1e3, w->read_p99_ns / 1e3, (double)(now - w->start_ns) / 1e9);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+	int fd;
+	int json = 0;
+	int count = -1;
+	double interval = 1.0;
+	struct stat st;
+	struct stats_segment *seg;
+	struct stats_segment *snap;
+	struct timespec sleep_time;
+	uint64_t prev_blocks = 0, prev_ns = 0;
+	int stale;
+
+	while ((c = getopt(argc, argv, "i:n:jh")) != -1)
+		switch (c)
+		{
+			case 'i':
+				interval = atof(optarg);
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'j':
+				json = 1;
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+		}
+
+	if (optind != argc - 1 || interval <= 0)
+		usage(argv[0]);
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd == -1) {
+		perror("open(stats file)");
+		return 1;
+	}
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct stats_segment)) {
+		fprintf(stderr, "Error: %s is not a comprestimator stats file\n", argv[optind]);
+		return 1;
+	}
+	seg = (struct stats_segment *) mmap(NULL, sizeof(struct stats_segment), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg == (void *)-1) {
+		perror("mmap");
+		return 1;
+	}
+	if (seg->magic != STATS_MAGIC || seg->version != STATS_VERSION ||
+			seg->segment_size != sizeof(struct stats_segment)) {
+		fprintf(stderr, "Error: %s has an unknown stats format\n", argv[optind]);
+		return 1;
+	}
+
+	snap = (struct stats_segment *) malloc(sizeof(struct stats_segment));
+	if (!snap) {
+		fprintf(stderr, "Failed to allocate memory for snapshot\n");
+		return 1;
+	}
+
+	sleep_time.tv_sec = (time_t)interval;
+	sleep_time.tv_nsec = (long)((interval - (double)sleep_time.tv_sec) * 1e9);
+
+	while (count) {
+		uint64_t blocks, zero, non_zero;
+		uint64_t now = now_ns();
+		double rate = 0;
+		int gone;
+
+		memset(snap, 0, sizeof(struct stats_segment));
+		stale = snapshot(seg, snap);
+		live_totals(snap, &blocks, &zero, &non_zero);
+		if (prev_ns && now > prev_ns && blocks >= prev_blocks)
+			rate = (double)(blocks - prev_blocks) * INBLOCK_SIZE * 1e9 / (double)(now - prev_ns);
+		else if (now > snap->start_ns)
+			rate = (double)blocks * INBLOCK_SIZE * 1e9 / (double)(now - snap->start_ns);
+		prev_blocks = blocks;
+		prev_ns = now;
+
+		if (json)
+			print_json(snap, rate, stale);
+		else
+			print_screen(snap, rate, stale, isatty(fileno(stdout)));
+
+		gone = (kill(snap->pid, 0) == -1 && errno == ESRCH);
+		if (snap->finished || gone)
+			break;
+		if (count > 0)
+			count--;
+		if (count)
+			nanosleep(&sleep_time, NULL);
+	}
+
+	free(snap);
+	munmap(seg, sizeof(struct stats_segment));
+	return 0;
+}
@@ -2,6 +2,7 @@
  Authors: Avishay Traeger, Danny Harnik, Dmitry Sotnikov
 */
 
+#define _GNU_SOURCE
 #define _LARGE_FILES
 #include <stdio.h>
 #include <fcntl.h>
@@ -9,17 +10,23 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <getopt.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <assert.h>
+#include <limits.h>
+#include <dirent.h>
 #include <time.h>
 #include <math.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/types.h>
-#include "zlib.h"
+#include <sys/sysmacros.h>
+#include "comprestimator_int.h"
 
 #if defined(MSDOS) || defined(WIN32)
 #include <io.h>
@@ -28,33 +35,31 @@
 #define SET_BINARY_MODE(file)
 #endif
 
-#define MAX_NUM_SAMPLE		2000	//Max number of non-zero samples to take
-#define ZERO_BLOCK_FACTOR	10	    //Ratio of zero blocks to non-zero
-#define INBLOCK_SIZE		2048 	//Input block size in bytes (read from disk)
-#define ZLIB_BLOCK_SIZE		16384 	//Input block size to zlib in bytes 
-#define OUTBLOCK_SIZE		2048	//Output block size in bytes (close gzip)
-#define COMP_UNIT_SIZE		134217728	//Input to streamer in bytes (=128MB)
-#define BLOCKS_PER_PROC		50	//How many blocks each process should handle (random)
 #define MAX_NUM_PROCS		128	//Maximum number of child processes
 #define MAX_STRING_LEN		256	//Maximum length of statically allocated strings
+#define STREAM_READ_SIZE	1048576	//Bytes read from stdin at a time (-d -)
+#define STREAM_STATUS_NS	1000000000ULL	//Time between status lines when streaming
+#define MAX_NUMA_NODES		64
+#define CHECKPOINT_NS		(60 * 1000000000ULL)	//Time between checkpoints (--checkpoint)
+#define CHECKPOINT_MAGIC	0x544b4343
+#define CHECKPOINT_VERSION	1
+#define PARTIAL_MAGIC		0x54504343
+#define PARTIAL_VERSION		1
+#define AUTO_WINDOW_NS		200000000ULL	//Throughput window of the -p auto controller
+#define AUTO_IO_PER_CPU		8	//-p auto: processes per CPU at most, waiting on reads
+#define AUTO_DEFAULT_DEPTH	32	//-p auto: queue depth when sysfs has none
+#define AUTO_ROTATIONAL_DEPTH	4	//-p auto: reads in flight that still help a disk
+#define PLAN_PROBE_READS	32	//Random reads of each --plan prober
+#define PLAN_PROBE_SEQ		(8 * 1048576)	//Sequential bytes read by each --plan prober
+#define PLAN_PROBE_SAMPLES	64	//Samples compressed to measure the CPU cost
+#define PLAN_READ_SIZE		1048576	//Read size of the sequential probe
 
 #define DEBUG	0
 #define debug_print(fmt, ...) \
 	do { if (DEBUG) fprintf(stderr, "%d:%d: " fmt, getpid(), __LINE__, __VA_ARGS__); } while (0)
 
-#define min(x, y) ({                            \
-        typeof(x) _min1 = (x);                  \
-        typeof(y) _min2 = (y);                  \
-        (void) (&_min1 == &_min2);              \
-        _min1 < _min2 ? _min1 : _min2; })
-
-/* Statistics that each child calculates and the parent aggregates */
-struct compression_info {
-	int num_zero_blocks;
-	int num_non_zero_blocks;
-	int total_blocks_read;
-	double compression_ratio;
-    double c_squared;
+static const char *phase_names[NUM_PHASES] = {
+	"open", "pread", "zero_check", "deflate", "aggregate", "fork", "wait"
 };
 
 /* Array of stats in shared memory where each child process stores its stats,
@@ -71,422 +76,895 @@ static pid_t pid_array[MAX_NUM_PROCS];
 /* Number of child processes to run (command line parameter) */
 static int num_procs = 1;
 
+/* Stop sampling once both confidence bounds are within this error (fraction).
+ * The default (0) is the Hoeffding bound after MAX_NUM_SAMPLE samples, i.e.
+ * the guarantee of a full fixed size run. */
+static double target_error = 0;
+
 /* Device to run on */
 static char *dev_name = NULL;
 static off_t dev_size;
 
-/* Time we began to run the program */
-static time_t start_time;
+/* Chooses the blocks every child reads */
+static struct sampler sampler;
+
+/* Directory mode (-d <directory>): the files to estimate, whose indices make
+ * up the patterns, and the result cache (--cache) */
+static int dir_mode = 0;
+static struct dir_scan dir;
+static size_t dir_cached;
+static char *cache_name = NULL;
+
+/* Fingerprints of the samples (--fingerprints): the samples of the last run
+ * (fp_loaded of them) come first and are taken again, fresh samples are
+ * appended. The array is shared so children can record what they find, and
+ * with fingerprints the patterns hold indices into it. */
+static char *fp_name = NULL;
+static struct sample_fingerprint *fp_array = NULL;
+static size_t fp_mem_size;
+static size_t fp_capacity;
+static size_t fp_loaded;
+static size_t fp_count;
+
+/* --capture: keep the data of the samples (recorded in fp_array) in this
+ * file. --replay: estimate from such a file, compressing at replay_level. */
+static char *capture_name = NULL;
+static char *replay_name = NULL;
+static int replay_level = 1;
+
+/* Dedup estimate (--dedup): each child adds the chunks of its pass to the
+ * sketch in its slot, which the parent merges into the last index */
+static struct hll *dedup_array = NULL;
+static size_t dedup_mem_size;
+static uint32_t dedup_chunk_size = 0;
+
+/* --time-budget: sample until the deadline instead of up to MAX_NUM_SAMPLE,
+ * sizing the batches so that they can finish by then. When the deadline
+ * passes the children are told (SIGUSR1) to stop after their current
+ * sample, and the estimate is taken from what they committed. */
+static uint64_t time_budget_ns = 0;
+static uint64_t deadline_ns;
+static volatile sig_atomic_t deadline_hit = 0;
+static volatile sig_atomic_t child_stop = 0;
+
+/* Checkpoints of an exhaustive pass (--checkpoint). For a device they hold
+ * the statistics of the longest run of blocks from the start that the
+ * children have all finished (batches finish out of order, those past it
+ * wait in ckpt_pending), so a resumed pass starts there and counts nothing
+ * twice. For a directory they are a result cache of the files done. */
+struct checkpoint {
+	uint32_t magic;
+	uint32_t version;
+	int64_t dev_size;
+	int64_t done_blocks;		//blocks [0, done_blocks) are counted in stats
+	uint64_t rng;			//sampler state
+	uint32_t dedup_chunk_size;	//0 without --dedup
+	uint32_t pad;
+	struct file_stats stats;
+	struct hll hll;			//chunks of the counted blocks; registers may hold more
+};
+
+struct checkpoint_batch {
+	off_t start;			//first block
+	int blocks;
+	uint64_t chunks;		//dedup chunks
+	struct file_stats stats;
+};
+
+static char *checkpoint_name = NULL;
+static int resume = 0;
+static struct checkpoint ckpt;
+static struct checkpoint_batch *ckpt_pending = NULL;
+static size_t ckpt_num_pending, ckpt_max_pending;
+static struct checkpoint_batch ckpt_batch[MAX_NUM_PROCS];	//running, by slot
+static uint64_t ckpt_last_ns;
+static volatile sig_atomic_t ckpt_ready = 0;	//the pass has started
+static volatile sig_atomic_t ckpt_busy = 0;	//ckpt is being updated
+
+/* Sharding (--shard i/N): a device is cut in N ranges of blocks and a
+ * directory in N sets of files, and every shard samples its part at the
+ * rate the whole would be sampled at, so that the counts and moments of all
+ * the shards (--partial files) add up to those of one run ("merge") */
+struct partial {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t shard;
+	uint32_t num_shards;
+	uint32_t exhaustive;
+	uint32_t dedup_chunk_size;	//0 without --dedup
+	int64_t total_size;		//of all the shards
+	int64_t shard_size;
+	struct file_stats stats;
+	char origin[CAPTURE_ORIGIN_LEN];
+	struct hll hll;
+};
+
+static int shard = 0, num_shards = 0;
+static char *partial_name = NULL;
+static int64_t shard_total_size;
+
+/* --cluster: samples are runs of this many contiguous blocks, 0 if not */
+static uint32_t cluster_blocks = 0;
+
+/* --sniff: files in compressed formats are scored from one sample */
+static int sniff = 0;
+
+/* --shared-extents: data shared between files (reflinks, snapshots) counts once */
+static int shared_extents = 0;
+
+/* -p auto: num_procs is the most processes the device queue and the CPU
+ * quota can use, and a hill climber moves proc_limit, the processes run at
+ * once, to where the samples per second peak */
+static int auto_procs = 0;
+static int proc_limit;
+static struct {
+	uint64_t t0;			//start of the current window
+	int64_t blocks;			//blocks read at t0
+	int batches;			//batches completed in the window
+	double rate;			//blocks/s in the previous window
+	int dir;			//+1 or -1
+} climb;
+
+/* NUMA placement: with CPUs on more than one node, every child is pinned to
+ * the CPUs of one node before it allocates its buffers and zlib state, so
+ * that they are first touched, and placed, on that node. numa_cpus[0] is
+ * the node the device is attached to, which the children fill first. */
+static int numa_nodes = 0;
+static int numa_total_cpus;
+static cpu_set_t numa_cpus[MAX_NUMA_NODES];
+
+/* Time we began to run the program (monotonic) */
+static uint64_t start_ns;
+
+/* Profiling (--profile): each child records into its slot of the shared
+ * profile_array, which the parent merges into worker_profiles when the child
+ * is reaped. cur_profile is where the current process records (NULL when
+ * not profiling). */
+static char *profile_name = NULL;
+static struct worker_profile *profile_array = NULL;
+static size_t profile_mem_size;
+static struct worker_profile worker_profiles[MAX_NUM_PROCS];
+static struct worker_profile parent_profile;
+static struct worker_profile *cur_profile = NULL;
+static uint64_t fork_ns[MAX_NUM_PROCS];
+
+/* Live statistics segment (--stats), see comprestimator_stats.h. In a child,
+ * cur_stats_worker is the entry of its slot. */
+static char *stats_name = NULL;
+static struct stats_segment *stats_seg = NULL;
+static struct stats_worker *cur_stats_worker = NULL;
+static uint64_t children_done = 0;		//published as stats_seg->children_done
+
+/* Seed of the PRNG of the next child */
+static uint64_t child_seed;
 
 /* Output files */
 static FILE *log_file = NULL;
 static FILE *csv_file = NULL;
 static FILE *res_file = NULL;
 
-/* Get the size of the device in bytes */
-static off_t get_dev_size()
+static void write_profile_phases(FILE *f, struct worker_profile *wp, const char *indent)
+{
+	int i, b, first;
+
+	fprintf(f, "{\n");
+	for (i = 0; i < NUM_PHASES; i++) {
+		struct phase_stats *ps = &wp->phase[i];
+
+		fprintf(f, "%s  \"%s\": {\"count\": %llu, \"total_ns\": %llu, \"mean_ns\": %llu, "
+				"\"min_ns\": %llu, \"max_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, "
+				"\"histogram\": [", indent, phase_names[i],
+				(unsigned long long)ps->count, (unsigned long long)ps->total_ns,
+				(unsigned long long)(ps->count ? ps->total_ns / ps->count : 0),
+				(unsigned long long)ps->min_ns, (unsigned long long)ps->max_ns,
+				(unsigned long long)cpe_phase_percentile(ps, 50), (unsigned long long)cpe_phase_percentile(ps, 90),
+				(unsigned long long)cpe_phase_percentile(ps, 99));
+		for (b = 0, first = 1; b < PROFILE_BUCKETS; b++) {
+			if (!ps->hist[b])
+				continue;
+			fprintf(f, "%s{\"lt_ns\": %llu, \"count\": %llu}", (first ? "" : ", "),
+					2ULL << b, (unsigned long long)ps->hist[b]);
+			first = 0;
+		}
+		fprintf(f, "]}%s\n", (i < NUM_PHASES - 1) ? "," : "");
+	}
+	fprintf(f, "%s}", indent);
+}
+
+/* Write the --profile JSON report: totals, the parent's scheduling phases and
+ * every worker slot */
+static void write_profile(uint64_t run_ns)
+{
+	struct worker_profile total;
+	FILE *f;
+	int i;
+
+	f = fopen(profile_name, "w");
+	if (!f) {
+		perror("open(profile file)");
+		return;
+	}
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < num_procs; i++)
+		cpe_profile_merge(&total, &worker_profiles[i]);
+	cpe_profile_merge(&total, &parent_profile);
+
+	fprintf(f, "{\n  \"device\": \"%s\",\n  \"num_procs\": %d,\n  \"run_time_ns\": %llu,\n",
+			dev_name, num_procs, (unsigned long long)run_ns);
+	fprintf(f, "  \"phases\": ");
+	write_profile_phases(f, &total, "  ");
+	fprintf(f, ",\n  \"workers\": [\n");
+	for (i = 0; i < num_procs; i++) {
+		fprintf(f, "    {\"index\": %d, \"runs\": %llu, \"lifetime_ns\": %llu, \"phases\": ", i,
+				(unsigned long long)worker_profiles[i].runs,
+				(unsigned long long)worker_profiles[i].lifetime_ns);
+		write_profile_phases(f, &worker_profiles[i], "    ");
+		fprintf(f, "}%s\n", (i < num_procs - 1) ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+	fclose(f);
+}
+
+/* Create the --stats file and map it shared */
+static int stats_init(int exhaustive)
 {
 	int fd;
-	off_t size;
 
-	fd = open(dev_name, O_RDONLY);
+	fd = open(stats_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
 	if (fd == -1) {
-		perror("open");
-		return -1;
+		perror("open(stats file)");
+		return errno;
 	}
-	size = lseek(fd, -1, SEEK_END);
-	if (size == -1) {
-		perror("lseek");
-		return -1;
+	if (ftruncate(fd, sizeof(struct stats_segment)) == -1) {
+		perror("ftruncate(stats file)");
+		close(fd);
+		return errno;
 	}
+	stats_seg = (struct stats_segment *) mmap(NULL, sizeof(struct stats_segment), PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
 	close(fd);
-	return size;
+	if (stats_seg == (void *)-1) {
+		perror("mmap(stats file)");
+		stats_seg = NULL;
+		return errno;
+	}
+
+	stats_write_begin(&stats_seg->seq);
+	stats_seg->pid = getpid();
+	stats_seg->num_workers = num_procs;
+	stats_seg->exhaustive = exhaustive;
+	strncpy(stats_seg->dev_name, dev_name, STATS_DEV_NAME_LEN - 1);
+	stats_seg->dev_size = dev_size;
+	stats_seg->start_ns = start_ns;
+	stats_seg->update_ns = cpe_now_ns();
+	stats_seg->segment_size = sizeof(struct stats_segment);
+	stats_seg->version = STATS_VERSION;
+	stats_write_end(&stats_seg->seq);
+	/* Readers check the magic last, so a half initialized file is never accepted */
+	__sync_synchronize();
+	stats_seg->magic = STATS_MAGIC;
+	return 0;
 }
 
-/* Is the block all zeroes? */
-static int is_zero_block(char *buf) {
-	/* I assume memcmp is optimized, so use it by checking if first byte is
-	 * zero, and every byte is the same as the previous */
-	return ((buf[0] == 0) && (!memcmp(buf, buf + 1, INBLOCK_SIZE - 1)));
+/* Publish the live counters of the current child (progress callback of its
+ * worker, no-op without --stats) */
+static void stats_publish_worker(struct comp_worker *cw, int zero_blocks, int non_zero_blocks, int blocks_read)
+{
+	struct stats_worker *w = cur_stats_worker;
+	uint64_t now;
+
+	if (!w)
+		return;
+
+	now = cpe_now_ns();
+	stats_write_begin(&w->seq);
+	w->update_ns = now;
+	w->blocks_read = blocks_read;
+	w->zero_blocks = zero_blocks;
+	w->non_zero_blocks = non_zero_blocks;
+	if (now > w->start_ns)
+		w->bytes_per_sec = (double)blocks_read * INBLOCK_SIZE * 1e9 / (double)(now - w->start_ns);
+	if (cw->profile) {
+		w->read_p50_ns = cpe_phase_percentile(&cw->profile->phase[PHASE_READ], 50);
+		w->read_p99_ns = cpe_phase_percentile(&cw->profile->phase[PHASE_READ], 99);
+	}
+	stats_write_end(&w->seq);
 }
 
 void usage(char *prog)
 {
-	fprintf(stderr, "usage: %s -d <dev_name> [-p <num_procs> -l <log_file> -c <csv_file> -r <res_file> -s <seed> -e -h]\n", prog);
-	fprintf(stderr, "       -d: path to device to process\n");
-	fprintf(stderr, "       -p: number of processes (default 1)\n");
+	fprintf(stderr, "usage: %s -d <dev_name> [-p <num_procs>|auto -l <log_file> -c <csv_file> -r <res_file> -s <seed> -e -h]\n", prog);
+	fprintf(stderr, "       [--target-error <percent> --profile <json_file> --stats <stats_file> --pass-through --cache <file>\n");
+	fprintf(stderr, "       --fingerprints <file> --capture <file> --dedup <chunk_kb> --time-budget <seconds> --plan\n");
+	fprintf(stderr, "       --checkpoint <file> --resume --shard <i/N> --partial <file> --cluster <kb>\n");
+	fprintf(stderr, "       --sniff --shared-extents]\n");
+	fprintf(stderr, "       %s merge [-c <csv_file> -r <res_file>] <partial_file>...\n", prog);
+	fprintf(stderr, "       %s --replay <capture_file> [--level <zlib_level> -c <csv_file> -r <res_file>]\n", prog);
+	fprintf(stderr, "       -d: path to device to process, a directory to estimate the files under it,\n");
+	fprintf(stderr, "           or - to estimate the stream on stdin\n");
+	fprintf(stderr, "       -p: number of processes (default 1), or auto to fit them to the device queue and\n");
+	fprintf(stderr, "           CPU quota and tune them while running\n");
 	fprintf(stderr, "       -l: log file for intermediate results, errors, debug messages(text format)\n");
 	fprintf(stderr, "       -c: log file for intermediate results (csv format)\n");
 	fprintf(stderr, "       -r: file for final results (csv format)\n");
 	fprintf(stderr, "       -s: seed to use for PRNG (uses time if not specified - useful for testing)\n");
 	fprintf(stderr, "       -e: run exhaustive search (for testing only)\n");
 	fprintf(stderr, "       -h: print this help and exit\n");
+	fprintf(stderr, "       --target-error: stop sampling once the estimate is within this error (default %.2f%%)\n",
+			cpe_hoeffding_bound(MAX_NUM_SAMPLE) * 100);
+	fprintf(stderr, "       --profile: write per-phase timings and latency histograms (JSON) at exit\n");
+	fprintf(stderr, "       --stats: publish live statistics in this file (read it with comprestimator-top)\n");
+	fprintf(stderr, "       --pass-through: with -d -, copy stdin to stdout while estimating it\n");
+	fprintf(stderr, "       --cache: with a directory, reuse the results of unchanged files kept in this file\n");
+	fprintf(stderr, "       --fingerprints: with a device, take the samples kept in this file again, compressing\n");
+	fprintf(stderr, "           only the ones whose data changed, and keep this run's samples there\n");
+	fprintf(stderr, "       --capture: with a device, keep the data of the samples in this file for --replay\n");
+	fprintf(stderr, "       --time-budget: sample a device for as long as this, then report (ends sooner with --target-error)\n");
+	fprintf(stderr, "       --dedup: with -e, also estimate the dedup ratio of chunks of this size (KB, power of two)\n");
+	fprintf(stderr, "       --plan: measure the read and compression costs, and print the time and I/O the run\n");
+	fprintf(stderr, "           would take for a range of -p, without running it\n");
+	fprintf(stderr, "       --checkpoint: with -e, save the progress of the pass in this file every minute and\n");
+	fprintf(stderr, "           when interrupted (removed once the pass is complete)\n");
+	fprintf(stderr, "       --resume: go on with the pass saved in the --checkpoint file\n");
+	fprintf(stderr, "       --shard: estimate shard i (from 0) of N of the device or directory\n");
+	fprintf(stderr, "       --partial: write the result in this file, for merge\n");
+	fprintf(stderr, "       --cluster: sample runs of this many contiguous KB (power of two) instead of single\n");
+	fprintf(stderr, "           blocks, for disks and tiers that read long runs much faster than random blocks\n");
+	fprintf(stderr, "       --sniff: with a directory, score the files whose first bytes are those of a compressed\n");
+	fprintf(stderr, "           or encrypted format (gzip, zstd, xz, zip, JPEG, PNG, MP4...) from one sample\n");
+	fprintf(stderr, "       --shared-extents: with a directory, count the data files share (reflinks, clones,\n");
+	fprintf(stderr, "           snapshots) once, at the cost of walking the extents of every file first\n");
+	fprintf(stderr, "       merge: the estimate of all the shards of a run, from their --partial files\n");
+	fprintf(stderr, "       --replay: estimate from the samples of a capture file instead of a device\n");
+	fprintf(stderr, "       --level: zlib level to compress at with --replay (default 1, as on devices)\n");
 	exit(1);
 }
 
 /* Computing the confidence levels */
 static double confidence(double *conf_zeros, double *conf_comp) {
 	struct compression_info *info = &comp_info_array[num_procs];
-	int total_samples = info->num_zero_blocks + info->num_non_zero_blocks;
-	double after_zero_perc = (((double)info->num_non_zero_blocks / total_samples) * 100);
-	double after_rtc_perc = (double)info->compression_ratio * 100 / (double)info->num_non_zero_blocks;
-	double estimated_var = (info->c_squared/ (double)info->num_non_zero_blocks) - pow((info->compression_ratio / (double)info->num_non_zero_blocks),2);
-
-	/* Basic confidence from a strightforward Hoeffding bound:
-	The bond is err <= sqrt(ln(2/\delta)/ (2*sample_size))
-	If \delta= 10^{-7} then ln(2/\delta) <= 16.82
-	If \delta= 10^{-6} then ln(2/\delta) <= 14.51
-	*/
-    *conf_zeros = (sqrt(16.82/(2*(double)total_samples)));
-    *conf_comp = (sqrt(16.82/(2*(double)info->num_non_zero_blocks)));
+	double estimated_var = cpe_moments_var(&info->ratio);
+
+	cpe_confidence_bounds(info, conf_zeros, conf_comp);
     
-	/* Take into account the estimated variance */
     printf("Estimated variance %f.1\n", estimated_var);
     
 	return *conf_comp;
 }
 
-static void compress_chunk_random(int fd, off_t read_location, unsigned char
-		*inbuf, unsigned char *outbuf, struct compression_info *info) {
-	int ret;
-	ssize_t bytes_read;		//return value of pread
-	off_t end_of_comp_stream;	//end of compression stream
-	size_t zlib_input_bytes = 0;	//total bytes passed into zlib
-	size_t zlib_output_bytes = 0;	//total bytes output from zlib
-	int buffer_size;
-	z_stream strm;
-	long int random_num;
-	size_t total_read;
-	unsigned char *bufptr, *tmp_ptr;
-	size_t ai,saved_ai,ti,saved_ti;
-
-//	printf("Reading location: %d \n", read_location); 
-
-	bytes_read = pread(fd, inbuf, INBLOCK_SIZE, read_location);
-	if (bytes_read == -1) {
-		perror("pread");
-		exit(1);
-	}
-	info->total_blocks_read++;
+/* Publish the aggregated statistics and estimate (no-op without --stats) */
+static void stats_publish(int finished)
+{
+	struct compression_info *info = &comp_info_array[num_procs];
+	struct worker_profile reads;
+	int total_samples = info->num_zero_blocks + info->num_non_zero_blocks;
+	double conf_zeros = 0, conf_comp = 0;
+	int i;
 
-	if (is_zero_block((char *) inbuf)) {
-		info->num_zero_blocks++;
+	if (!stats_seg)
 		return;
-	}
 
-	info->num_non_zero_blocks++;
+	memset(&reads, 0, sizeof(reads));
+	for (i = 0; i < num_procs; i++)
+		cpe_profile_merge(&reads, &worker_profiles[i]);
+	if (total_samples)
+		cpe_confidence_bounds(info, &conf_zeros, &conf_comp);
+
+	stats_write_begin(&stats_seg->seq);
+	stats_seg->update_ns = cpe_now_ns();
+	stats_seg->finished = finished;
+	stats_seg->children_done = children_done;
+	stats_seg->dev_size = dev_size;
+	stats_seg->blocks_read = info->total_blocks_read;
+	stats_seg->zero_blocks = info->num_zero_blocks;
+	stats_seg->non_zero_blocks = info->num_non_zero_blocks;
+	stats_seg->non_zero_frac = total_samples ? (double)info->num_non_zero_blocks / total_samples : 0;
+	stats_seg->comp_frac = info->ratio.mean;
+	stats_seg->conf_zeros = conf_zeros;
+	stats_seg->conf_comp = conf_comp;
+	stats_seg->read_p50_ns = cpe_phase_percentile(&reads.phase[PHASE_READ], 50);
+	stats_seg->read_p90_ns = cpe_phase_percentile(&reads.phase[PHASE_READ], 90);
+	stats_seg->read_p99_ns = cpe_phase_percentile(&reads.phase[PHASE_READ], 99);
+	stats_write_end(&stats_seg->seq);
+}
 
-	random_num = random() % INBLOCK_SIZE;
-	buffer_size = INBLOCK_SIZE - random_num;
-	end_of_comp_stream = read_location + COMP_UNIT_SIZE + COMP_UNIT_SIZE; //+1 ?????
+/* The number in a sysfs file, or def when it cannot be read */
+static long read_sysfs_long(const char *path, long def)
+{
+	FILE *f = fopen(path, "r");
+	long val;
+
+	if (!f)
+		return def;
+	if (fscanf(f, "%ld", &val) != 1)
+		val = def;
+	fclose(f);
+	return val;
+}
 
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	ret = deflateInit(&strm, 1);
-	if (ret != Z_OK) {
-		fprintf(stderr, "Error: failed to initialize compressor\n");
-		exit(1);
+/* Add the CPUs of a sysfs cpulist ("0-3,8-11") to set */
+static void parse_cpulist(const char *list, cpu_set_t *set)
+{
+	char *end;
+	long lo, hi;
+
+	while (*list) {
+		lo = strtol(list, &end, 10);
+		if (end == list)
+			break;
+		hi = lo;
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		list = (*end == ',') ? end + 1 : end;
 	}
+}
 
-	strm.next_out = outbuf;
-	strm.avail_out = OUTBLOCK_SIZE;
-	strm.next_in = inbuf + random_num;
-	bufptr = inbuf + random_num;
-	strm.avail_in = min((int)buffer_size, ZLIB_BLOCK_SIZE);
-
-	do {
-		saved_ti = strm.total_in;
-		saved_ai = strm.avail_in;
-
-//		printf("before deflate - a_in: %d,  a_out: %d, t_in:  %d, t_out: %d, buffer_size: %d\n",strm.avail_in, strm.avail_out, strm.total_in, strm.total_out, buffer_size );
+/* The NUMA node of the PCI device under a sysfs block device directory (a
+ * partition or a disk), or of the first disk under a device mapper or md
+ * device. Returns -1 when unknown. */
+static int block_numa_node(const char *sysfs, int depth)
+{
+	char path[PATH_MAX], link[PATH_MAX + 16];
+	struct dirent *ent;
+	DIR *slaves;
+	char *slash;
+	long node;
 
-		ret = deflate_cont(&strm, Z_SYNC_FLUSH);
-		if (ret != Z_OK) {
-			fprintf(stderr, "Error: failed to compress (%d)\n", ret);
-			exit(1);
-		}
+	if (!realpath(sysfs, path))
+		return -1;
+	for (slash = path + strlen(path); slash > path; slash = strrchr(path, '/')) {
+		*slash = 0;
+		snprintf(link, sizeof(link), "%s/numa_node", path);
+		node = read_sysfs_long(link, -2);
+		if (node != -2)
+			return node;
+	}
 
-//		ti = ai_saved - strm.avail_in;
-		ti = strm.total_in;
-		
-//		zlib_input_bytes += ti;
-//		zlib_output_bytes += strm.total_out;
-		buffer_size -= (ti-saved_ti);
-        bufptr += (ti-saved_ti);
-//		printf("after deflate - a_in: %d,  a_out: %d, t_in:  %d, t_out: %d, buffer_size: %d\n",strm.avail_in, strm.avail_out, strm.total_in, strm.total_out, buffer_size );
-		
-		/* If we already filled the output buffer, we can stop */
-		if (strm.avail_out == 0)
-			goto done;
-
-		if (buffer_size <= 0) {
-			do {
-				read_location += INBLOCK_SIZE;
-				bytes_read = pread(fd, inbuf, INBLOCK_SIZE, read_location);
-				if (bytes_read == -1) {
-					perror("pread");
-					exit(1);
-				}
-//				strm.next_in = inbuf;
-				bufptr = inbuf;
-				info->total_blocks_read++;
-			} while (is_zero_block((char *) inbuf) && (read_location < end_of_comp_stream));
+	snprintf(link, sizeof(link), "%s/slaves", sysfs);
+	slaves = depth ? NULL : opendir(link);
+	node = -1;
+	while (slaves && (ent = readdir(slaves))) {
+		if (ent->d_name[0] == '.')
+			continue;
+		snprintf(link, sizeof(link), "%s/slaves/%s", sysfs, ent->d_name);
+		node = block_numa_node(link, depth + 1);
+		break;
+	}
+	if (slaves)
+		closedir(slaves);
+	return node;
+}
 
-			if (read_location >= end_of_comp_stream) {
-				goto done;
-			}
+/* Find the nodes with CPUs this process may use, and the node of the device
+ * under path. Placement stays off on one node, e.g. under numactl or taskset
+ * to a single node. */
+static void numa_init(const char *path)
+{
+	char sysfs[PATH_MAX], list[4096];
+	cpu_set_t allowed, node_cpus;
+	struct stat st;
+	dev_t dev;
+	int node, dev_node = -1;
+	FILE *f;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+		return;
+	if (stat(path, &st) == 0) {
+		dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+		snprintf(sysfs, sizeof(sysfs), "/sys/dev/block/%u:%u", major(dev), minor(dev));
+		dev_node = block_numa_node(sysfs, 0);
+	}
 
-			buffer_size = INBLOCK_SIZE;
-		}
+	numa_nodes = 1;		//slot 0 is kept for the device node
+	for (node = 0; node < MAX_NUMA_NODES * 16 && numa_nodes < MAX_NUMA_NODES; node++) {
+		snprintf(sysfs, sizeof(sysfs), "/sys/devices/system/node/node%d/cpulist", node);
+		f = fopen(sysfs, "r");
+		if (!f)
+			continue;
+		list[0] = 0;
+		if (!fgets(list, sizeof(list), f))
+			list[0] = 0;
+		fclose(f);
+		CPU_ZERO(&node_cpus);
+		parse_cpulist(list, &node_cpus);
+		CPU_AND(&node_cpus, &node_cpus, &allowed);
+		if (!CPU_COUNT(&node_cpus))
+			continue;
+		if (node == dev_node)
+			numa_cpus[0] = node_cpus;
+		else
+			numa_cpus[numa_nodes++] = node_cpus;
+	}
+	if (!CPU_COUNT(&numa_cpus[0])) {
+		/* Device node unknown (or without CPUs): take the nodes in order */
+		numa_nodes--;
+		memmove(&numa_cpus[0], &numa_cpus[1], sizeof(cpu_set_t) * numa_nodes);
+		dev_node = -1;
+	}
+	if (numa_nodes < 2) {
+		numa_nodes = 0;
+		return;
+	}
 
-		strm.next_in = bufptr;
-		strm.avail_in = min(buffer_size, ZLIB_BLOCK_SIZE);
-	} while (strm.avail_out);
+	numa_total_cpus = 0;
+	for (node = 0; node < numa_nodes; node++)
+		numa_total_cpus += CPU_COUNT(&numa_cpus[node]);
+	if (dev_node >= 0)
+		fprintf(stderr, "NUMA: %d nodes, %s is on node %d\n", numa_nodes, path, dev_node);
+	else
+		fprintf(stderr, "NUMA: %d nodes\n", numa_nodes);
+}
 
-done:
+/* Pin the child of a slot to its node: the first slots fill the device
+ * node, one per CPU, then the next nodes, and around again */
+static void numa_bind(int index)
+{
+	int cpu = index % numa_total_cpus;
+	int node;
 
-	deflateEnd(&strm);
-	zlib_input_bytes = strm.total_in;
-	zlib_output_bytes = strm.total_out;
-//	printf("total_in: %d   total out: %d ratio: %6.4f\n", zlib_input_bytes, zlib_output_bytes, (double)zlib_input_bytes/(double)zlib_output_bytes); 
-	info->compression_ratio += (double)zlib_output_bytes/(double)zlib_input_bytes;
-	info->c_squared += pow((double)zlib_output_bytes/(double)zlib_input_bytes,2);
+	for (node = 0; cpu >= CPU_COUNT(&numa_cpus[node]); node++)
+		cpu -= CPU_COUNT(&numa_cpus[node]);
+	if (sched_setaffinity(0, sizeof(cpu_set_t), &numa_cpus[node]) == -1)
+		perror("sched_setaffinity");
 }
 
-static void compress_chunks_sequential(int fd, off_t *pattern, int
-		pattern_size, unsigned char *inbuf, unsigned char *outbuf,
-		struct compression_info *info)
+/* The child process opens the device, reads and compresses chunks according
+ * to the pattern, and calculates compression statistics. */
+static void child(off_t *pattern, int pattern_size, int exhaustive, int index)
 {
-	int ret;
-	int index = 0;
-	unsigned char *bufptr;
-	ssize_t bytes_read;		//return value of pread
-	size_t zlib_input_bytes = 0;	//total bytes passed into zlib
-	size_t zlib_output_bytes = 0;	//total bytes output from zlib
-	int buffer_size = 0;		//how much space we have in inbuf
-	z_stream strm;
-	int zero_blocks = 0;
-	int non_zero_blocks = 0;
-	int ai,saved_ai, ti,saved_ti;
-	unsigned char *ni, *no;
-	
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	ret = deflateInit(&strm, 1);
-	if (ret != Z_OK) {
-		fprintf(stderr, "Error: failed to initialize compressor\n");
-		exit(1);
+	int i;
+	int ret = 0;
+	struct compression_info *info = &comp_info_array[index];
+	struct compression_info total, file_info;
+	struct comp_worker w;
+	struct dir_file *f;
+	unsigned char *cluster_buf;
+	struct dir_fetch fetch;
+	int fetching, fetch_start = 0, fetch_end = 0, n;
+	uint64_t t0;
+
+	if (profile_array) {
+		cur_profile = &profile_array[index];
+		memset(cur_profile, 0, sizeof(struct worker_profile));
 	}
 
-	strm.next_out = outbuf;
-	strm.avail_out = OUTBLOCK_SIZE;
+	/* Before anything is allocated, so that it is allocated on the node */
+	if (numa_nodes)
+		numa_bind(index);
 
-//	printf("at proces start - pattern_size: %d \n",pattern_size );
+	ret = cpe_worker_init(&w, child_seed);
+	if (ret) {
+		fprintf(stderr, "Failed to allocate memory for read buffer\n");
+		exit(1);
+	}
+	w.profile = cur_profile;
+	w.progress = stats_publish_worker;
+	if (dedup_array) {
+		memset(&dedup_array[index], 0, sizeof(struct hll));
+		w.dedup.hll = &dedup_array[index];
+		w.dedup.size = dedup_chunk_size;
+	}
 
-	while(1) {
-		/* get more data into inbuf */
-		if (buffer_size <= 0) {
-			while (1) {
-				if (index == pattern_size)
-					goto done;
+	if (stats_seg) {
+		cur_stats_worker = &stats_seg->workers[index];
+		stats_write_begin(&cur_stats_worker->seq);
+		cur_stats_worker->pid = getpid();
+		cur_stats_worker->start_ns = cpe_now_ns();
+		stats_write_end(&cur_stats_worker->seq);
+		stats_publish_worker(&w, 0, 0, 0);
+	}
 
-				bytes_read = pread(fd, inbuf, INBLOCK_SIZE, pattern[index]);
-				if (bytes_read == -1) {
-					perror("pread");
-					exit(1);
+	cpe_info_commit(info, &w.info);
+
+	if (dir_mode) {
+		/* The pattern holds files, publish the totals after each one */
+		w.progress = NULL;
+		memset(&total, 0, sizeof(total));
+		/* Small files are read whole by the exhaustive pass, so they come
+		 * in batches through io_uring when it works */
+		fetching = exhaustive && (cpe_dir_fetch_init(&fetch) == COMPRESTIMATOR_OK);
+		for (i = 0; i < pattern_size && !ret; i++) {
+			f = &dir.files[pattern[i]];
+			if (fetching && i >= fetch_end) {
+				t0 = profile_start(cur_profile);
+				n = cpe_dir_fetch(&fetch, &dir, pattern + i, pattern_size - i);
+				profile_end(cur_profile, PHASE_READ, t0);
+				fetch_start = i;
+				fetch_end = i + (n > 0 ? n : 0);
+				if (n < 0) {
+					cpe_dir_fetch_destroy(&fetch);
+					fetching = 0;
 				}
-//				info->total_blocks_read++;
-				index++;
-
-				if (is_zero_block((char *) inbuf)) {
-//					info->num_zero_blocks++;
-					zero_blocks++;
-				} else {
-					break;
+			}
+			if (fetching && fetch.len[i - fetch_start] < 0 && fetch.len[i - fetch_start] != FETCH_NONE) {
+				f->state = DIR_FILE_FAILED;
+				errno = -fetch.len[i - fetch_start];
+				ret = COMPRESTIMATOR_EIO;
+			} else {
+				if (fetching && fetch.len[i - fetch_start] != FETCH_NONE) {
+					w.mem = fetch.buf + (size_t)(i - fetch_start) * FETCH_FILE_SIZE;
+					w.mem_size = fetch.len[i - fetch_start];
 				}
+				ret = cpe_dir_sample_file(&w, &dir, f, exhaustive);
+				w.mem = NULL;
 			}
-
-//			info->num_non_zero_blocks++;
-			non_zero_blocks++;
-
-			buffer_size = INBLOCK_SIZE;
-			strm.next_in = inbuf;
-			bufptr = inbuf;
-			strm.avail_in = min(buffer_size, ZLIB_BLOCK_SIZE);
-			if (strm.avail_in < 1) {
-				printf("careful, a_in = %d \n", strm.avail_in);
+			if (ret == COMPRESTIMATOR_EIO) {
+				fprintf(stderr, "Warning: skipping %s: %s\n", cpe_dir_file_path(&dir, f), strerror(errno));
+				ret = 0;
+				continue;
 			}
+			cpe_file_stats_to_info(&f->stats, &file_info);
+			cpe_info_merge(&total, &file_info);
+			cpe_info_commit(info, &total);
+			stats_publish_worker(&w, total.num_zero_blocks, total.num_non_zero_blocks, total.total_blocks_read);
 		}
+		if (fetching)
+			cpe_dir_fetch_destroy(&fetch);
+		w.info = total;
+		goto out;
+	}
 
-//		printf("before deflate - a_in: %d,  a_out: %d, t_in:  %d, t_out: %d, buffer_size: %d\n",strm.avail_in, strm.avail_out, strm.total_in, strm.total_out, buffer_size );
-//		strm.total_in  = 0;
-//		strm.total_out = 0;
-//		strm.reserved = 0;
-		
-		saved_ai = strm.avail_in;
-		saved_ti = strm.total_in;
+	ret = cpe_worker_open(&w, dev_name);
+	if (ret) {
+		perror("open");
+		exit(1);
+	}
 
-//		fprintf(stderr, "before ai: %d ao: %d \n", ai, ao);
-		
-		ret = deflate_cont(&strm, Z_SYNC_FLUSH);
-		if (ret != Z_OK) {
-			fprintf(stderr, "Error: failed to compress (%s)\n", strm.msg);
+	if (exhaustive) {
+		ret = cpe_compress_chunks_sequential(&w, pattern, pattern_size);
+		cpe_info_commit(info, &w.info);
+	} else if (fp_array) {
+		for (i = 0; i < pattern_size && !ret && !child_stop; i++) {
+			ret = cpe_compress_chunk_fingerprint(&w, &fp_array[pattern[i]]);
+			cpe_info_commit(info, &w.info);
+		}
+	} else if (cluster_blocks) {
+		cluster_buf = (unsigned char *) malloc((size_t)cluster_blocks * INBLOCK_SIZE);
+		if (!cluster_buf) {
+			fprintf(stderr, "Failed to allocate memory for read buffer\n");
 			exit(1);
 		}
-//		ti = ai - strm.avail_in;
-		ti = strm.total_in;
-
-//		printf("after deflate - a_in: %d a_out: %d, ti: %d, t_out %d \n",strm.avail_in, strm.avail_out, ti, strm.total_out);
-
-//		printf("total_in: %d avail_in: %d\n",  strm.total_in, strm.avail_in); 
-//		printf("after deflate - a_in: %d a_out: %d, t_in: %d, t_out %d \n",strm.avail_in, strm.avail_out, strm.total_in, strm.total_out);
-		
-		if ((ti-saved_ti) > saved_ai) {
-			fprintf(stderr, "reserved not zero\n");
-			fprintf(stderr, "before ai: %d ti: %d \n", saved_ai, saved_ti);
-			fprintf(stderr, "after  ai: %u ao: %u ti: %lu to: %lu res: %lu pointer: %lu\n", strm.avail_in, strm.avail_out, strm.total_in, strm.total_out, strm.reserved, strm.next_in - bufptr);
-		}
-//		if (ti < strm.reserved) {
-//			fprintf(stderr, "warning: deflate returned total_in = %d, buffer_size = %d \n", strm.total_in, buffer_size);
-//			fprintf(stderr, "before ai: %d ao: %d ti: %d to: %d \n", ai, ao,ti, to);
-//			fprintf(stderr, "after  ai: %d ao: %d ti: %d to: %d res: %d pointer: %d\n", strm.avail_in, strm.avail_out, strm.total_in, strm.total_out, strm.reserved, strm.next_in - bufptr);
-//		}
-		buffer_size -= (ti-saved_ti);
-		bufptr += (ti-saved_ti);
-		strm.next_in = bufptr;
-
-		if (strm.avail_in <= 0) {
-			strm.avail_in = min((int)buffer_size, ZLIB_BLOCK_SIZE);
-		}
-
-		if (strm.avail_out <= 0) {
-			zlib_input_bytes += strm.total_in;
-			zlib_output_bytes += strm.total_out;
-//		    printf("before reset - a_in: %d a_out: %d, t_in: %d, t_out %d \n",strm.avail_in, strm.avail_out, strm.total_in, strm.total_out);
-
-			
-			deflateReset(&strm);
-//			deflateEnd(&strm);
-
-//			strm.zalloc = Z_NULL;
-//			strm.zfree = Z_NULL;
-//			strm.opaque = Z_NULL;
-//			ret = deflateInit(&strm, 1);
-//			if (ret != Z_OK) {
-//				fprintf(stderr, "Error: failed to initialize compressor\n");
-//				exit(1);
-//			}
-			
-	
-			strm.next_out = outbuf;
-			strm.next_in = bufptr;
-			strm.avail_out = OUTBLOCK_SIZE;
-			strm.avail_in = min((int)buffer_size, ZLIB_BLOCK_SIZE);
-//		    printf("after reset - a_in: %d a_out: %d, t_in: %d, t_out %d \n",strm.avail_in, strm.avail_out, strm.total_in, strm.total_out);
-
-			}
+		for (i = 0; i < pattern_size && !ret && !child_stop; i++) {
+			ret = cpe_compress_cluster(&w, pattern[i], cluster_buf, cluster_blocks);
+			cpe_info_commit(info, &w.info);
+		}
+		free(cluster_buf);
+	} else {
+		for (i = 0; i < pattern_size && !ret && !child_stop; i++) {
+			ret = cpe_compress_chunk_random(&w, pattern[i]);
+			cpe_info_commit(info, &w.info);
+		}
+	}
 
-//		if (strm.avail_in < 0) {
-//			printf("warning, avail_in = %d \n", strm.avail_in);
-//		}
+out:
+	if (ret == COMPRESTIMATOR_EIO) {
+		perror("pread");
+		exit(1);
+	} else if (ret) {
+		fprintf(stderr, "Error: failed to compress (%s)\n", comprestimator_strerror(ret));
+		exit(1);
 	}
 
-done:
-//	printf("at done ! \n"); 
+	stats_publish_worker(&w, w.info.num_zero_blocks, w.info.num_non_zero_blocks, w.info.total_blocks_read);
+	cpe_worker_destroy(&w);
+	exit(0);
+}
 
-	deflateEnd(&strm);
-//	zlib_input_bytes += strm.total_in;
-//	zlib_output_bytes += strm.total_out;
-//	printf("total_in: %d   total out: %d non_zero: %d \n", zlib_input_bytes, zlib_output_bytes, info->num_non_zero_blocks); 
-//	printf("total_in: %d   total out: %d non_zero: %d  ratio: %6.4f\n", zlib_input_bytes, zlib_output_bytes, info->num_non_zero_blocks, (double)zlib_input_bytes/(double)zlib_output_bytes); 
-	if (zlib_input_bytes) {
-		info->compression_ratio = (double)zlib_output_bytes/(double)zlib_input_bytes;
-		info->compression_ratio *= (double) non_zero_blocks;
+/* Fill pattern with the next fingerprint records to sample: the samples of
+ * the last run, then fresh ones from the sampler */
+static int fp_next(off_t *pattern, int max_blocks, struct compression_info *info)
+{
+	int i, n = 0;
+
+	while (fp_count < fp_loaded && n < max_blocks)
+		pattern[n++] = fp_count++;
+	if (n)
+		return n;
+
+	if ((size_t)max_blocks > fp_capacity - fp_count)
+		max_blocks = fp_capacity - fp_count;
+	n = cpe_sampler_next(&sampler, pattern, max_blocks, info);
+	for (i = 0; i < n; i++) {
+		memset(&fp_array[fp_count], 0, sizeof(struct sample_fingerprint));
+		fp_array[fp_count].offset = pattern[i];
+		pattern[i] = fp_count++;
 	}
-	info->num_non_zero_blocks = non_zero_blocks;		
-	info->num_zero_blocks = zero_blocks;
-	info->total_blocks_read = (zero_blocks + non_zero_blocks);
+	return n;
 }
 
-/* The child process opens the device, reads and compresses chunks according
- * to the pattern, and calculates compression statistics. */
-static void child(off_t *pattern, int pattern_size, int exhaustive, struct compression_info *info)
+/* SIGUSR1 in a child: the deadline passed, stop after the current sample */
+static void child_stop_handler(int signum)
+{
+	child_stop = 1;
+}
+
+/* SIGALRM at the deadline: stop the running children */
+static void deadline_handler(int signum)
 {
 	int i;
-	int fd;
-	int ret;
-	unsigned char *inbuf;
-	unsigned char *outbuf;
 
-	inbuf = (unsigned char *) malloc(INBLOCK_SIZE);
-	if (!inbuf) {
-		fprintf(stderr, "Failed to allocate memory for read buffer\n");
-		exit(1);
+	deadline_hit = 1;
+	for (i = 0; i < num_procs; i++)
+		if (pid_array[i] > 0)
+			kill(pid_array[i], SIGUSR1);
+}
+
+/* Shrink a batch of max_blocks samples to what a child can take before the
+ * deadline, at the rate the children have sampled so far. Returns 0 when
+ * there is no time left for a sample. */
+static int budget_blocks(int max_blocks, struct compression_info *info)
+{
+	uint64_t now = cpe_now_ns();
+	int samples = info->num_zero_blocks + info->num_non_zero_blocks;
+	double fit;
+
+	if (deadline_hit || now >= deadline_ns)
+		return 0;
+	if (!samples || now <= start_ns)
+		return max_blocks;
+	fit = (double)samples / (double)(now - start_ns) / proc_limit * (double)(deadline_ns - now);
+	if (fit < max_blocks)
+		max_blocks = fit;
+	return max_blocks;
+}
+
+/* CPUs this process may use: its affinity, cut down by the cgroup v2 quota
+ * (cpu.max) of its cgroup or of any parent */
+static int auto_cpus(void)
+{
+	char cgroup[PATH_MAX], path[PATH_MAX], max[32];
+	long quota, period;
+	cpu_set_t set;
+	double cpus;
+	char *slash;
+	FILE *f;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		cpus = CPU_COUNT(&set);
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		return cpus;
+	cgroup[0] = 0;
+	while (fgets(path, sizeof(path), f))
+		if (!strncmp(path, "0::", 3)) {
+			snprintf(cgroup, sizeof(cgroup), "%s", path + 3);
+			cgroup[strcspn(cgroup, "\n")] = 0;
+		}
+	fclose(f);
+
+	while (cgroup[0]) {
+		/* A cgroup too deep for a path has no file to read */
+		if (snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cgroup) >= (int)sizeof(path))
+			break;
+		f = fopen(path, "r");
+		if (f) {
+			if (fscanf(f, "%31s %ld", max, &period) == 2 && strcmp(max, "max") && period > 0) {
+				quota = atol(max);
+				if ((double)quota / period < cpus)
+					cpus = (double)quota / period;
+			}
+			fclose(f);
+		}
+		slash = strrchr(cgroup, '/');
+		if (!slash)
+			break;
+		*slash = 0;
 	}
+	return cpus < 1 ? 1 : (int)ceil(cpus);
+}
 
-	outbuf = (unsigned char *) malloc(OUTBLOCK_SIZE);
-	if (!outbuf) {
-		fprintf(stderr, "Failed to allocate memory for compression buffer\n");
-		exit(1);
+/* -p auto: the most processes worth running on path, and the number to start
+ * with. Every process has one read in flight, so past the CPUs the extra
+ * ones only wait on the device: as many as its queue takes (a few for a
+ * disk), up to AUTO_IO_PER_CPU per CPU. */
+static int auto_limit(const char *path, int *start)
+{
+	char sysfs[PATH_MAX];
+	struct stat st;
+	dev_t dev;
+	long depth = 0, rotational = 0;
+	int cpus, limit;
+
+	cpus = auto_cpus();
+	if (stat(path, &st) == 0) {
+		dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+		/* A partition has its queue at its disk */
+		snprintf(sysfs, sizeof(sysfs), "/sys/dev/block/%u:%u/queue/", major(dev), minor(dev));
+		if (access(sysfs, F_OK))
+			snprintf(sysfs, sizeof(sysfs), "/sys/dev/block/%u:%u/../queue/", major(dev), minor(dev));
+		strcat(sysfs, "nr_requests");
+		depth = read_sysfs_long(sysfs, 0);
+		strcpy(sysfs + strlen(sysfs) - strlen("nr_requests"), "rotational");
+		rotational = read_sysfs_long(sysfs, 0);
 	}
+	if (depth <= 0)
+		depth = AUTO_DEFAULT_DEPTH;
+	if (rotational && depth > AUTO_ROTATIONAL_DEPTH)
+		depth = AUTO_ROTATIONAL_DEPTH;
+
+	limit = min(depth, (long)cpus * AUTO_IO_PER_CPU);
+	if (limit < cpus)
+		limit = cpus;
+	if (limit > MAX_NUM_PROCS)
+		limit = MAX_NUM_PROCS;
+	*start = min(cpus, limit);
+	fprintf(stderr, "Auto: %d CPUs, queue depth %ld%s, up to %d processes\n",
+			cpus, depth, rotational ? " (rotational)" : "", limit);
+	return limit;
+}
 
-	memset(info, 0, sizeof(struct compression_info));
+/* -p auto: after a child is reaped, when the window has run long enough,
+ * step proc_limit on in the same direction if the blocks read per second
+ * went up, and turn back if they went down */
+static void auto_tune(struct compression_info *info)
+{
+	uint64_t now = cpe_now_ns();
+	double rate;
+	int step;
 
-	fd = open(dev_name, O_RDONLY);
-	if (fd == -1) {
-		perror("open");
-		exit(1);
-	}
+	climb.batches++;
+	if (now - climb.t0 < AUTO_WINDOW_NS || climb.batches < proc_limit)
+		return;
 
-	if (exhaustive) {
-		compress_chunks_sequential(fd, pattern, pattern_size, inbuf, outbuf, info);
-	} else {
-		for (i = 0; i < pattern_size; i++) {
-			compress_chunk_random(fd, pattern[i], inbuf, outbuf, info);
-		}
+	rate = (double)(info->total_blocks_read - climb.blocks) * 1e9 / (double)(now - climb.t0);
+	if (rate < climb.rate)
+		climb.dir = -climb.dir;
+	climb.rate = rate;
+	step = proc_limit / 4 ? proc_limit / 4 : 1;
+	proc_limit += climb.dir * step;
+	if (proc_limit >= num_procs) {
+		proc_limit = num_procs;
+		climb.dir = -1;
+	} else if (proc_limit <= 1) {
+		proc_limit = 1;
+		climb.dir = 1;
 	}
+	debug_print("auto: %.0f blocks/s, %d processes\n", rate, proc_limit);
 
-	close(fd);
-
-	exit(0);
+	climb.t0 = now;
+	climb.blocks = info->total_blocks_read;
+	climb.batches = 0;
 }
 
 /* Create a pattern of chunks for a child process to read from the device.
  * Returns the number of chunks added to the array. Adjusts the number of
  * chunks returned according to the number of active processes, so that they
  * run in a staggered fashion.*/
-static int get_pattern(off_t *pattern, int exhaustive, int num_chunks, int
-		active_procs, struct compression_info *info)
+static int get_pattern(off_t *pattern, int exhaustive, int active_procs,
+		struct compression_info *info)
 {
-	int i = 0;
 	int max_blocks;
-	static int cur_chunk = 0;
 
-	//Each process gets a consecutive chunk, which may cause seeks - optimize
-	//later so that processes read more in parallel.
 	if (exhaustive) {
 		max_blocks = COMP_UNIT_SIZE / INBLOCK_SIZE;
-		while ((i < max_blocks) && (cur_chunk < num_chunks)) {
-			pattern[i] = (off_t)cur_chunk * INBLOCK_SIZE;
-			cur_chunk++;
-			i++;
-		}
+	} else if (cluster_blocks) {
+		max_blocks = ((double)(active_procs+1)/(double)proc_limit) * CLUSTERS_PER_PROC;
+		if (max_blocks > CLUSTERS_PER_PROC)
+			max_blocks = CLUSTERS_PER_PROC;
+		if (max_blocks < 1)
+			max_blocks = 1;
 	} else {
-		max_blocks = ((double)(active_procs+1)/(double)num_procs) * BLOCKS_PER_PROC;
+		max_blocks = ((double)(active_procs+1)/(double)proc_limit) * BLOCKS_PER_PROC;
 		if (max_blocks > BLOCKS_PER_PROC)
 			max_blocks = BLOCKS_PER_PROC;
-
-		if ((info->num_non_zero_blocks >= MAX_NUM_SAMPLE) || (info->num_zero_blocks >= (MAX_NUM_SAMPLE * ZERO_BLOCK_FACTOR)))
-			return 0;
-		while (i < max_blocks) {
-			pattern[i] = (off_t)(random() % num_chunks) * INBLOCK_SIZE;
-			i++;
+		if (time_budget_ns) {
+			max_blocks = budget_blocks(max_blocks, info);
+			if (!max_blocks)
+				return 0;
 		}
 	}
 
-	return i;
+	if (dir_mode)
+		return cpe_dir_next_batch(&dir, pattern, (exhaustive ? COMP_UNIT_SIZE / INBLOCK_SIZE : BLOCKS_PER_PROC),
+				max_blocks, exhaustive);
+	if (fp_array)
+		return fp_next(pattern, max_blocks, info);
+	return cpe_sampler_next(&sampler, pattern, max_blocks, info);
 }
 
 /* Get an unused slot in the PID array */
@@ -501,16 +979,157 @@ static int get_empty_pid_index()
 	return -1;
 }
 
+/* A child finished the batch of its slot: move the finished run of blocks
+ * on as far as the batches finished so far allow */
+static void checkpoint_batch_done(int index, struct compression_info *info)
+{
+	struct checkpoint_batch *b;
+	struct compression_info done, batch;
+	size_t i;
+
+	if (ckpt_num_pending == ckpt_max_pending) {
+		b = (struct checkpoint_batch *) realloc(ckpt_pending,
+				sizeof(struct checkpoint_batch) * (ckpt_max_pending + MAX_NUM_PROCS));
+		if (!b)
+			return;		//the checkpoint stays behind, which is safe
+		ckpt_pending = b;
+		ckpt_max_pending += MAX_NUM_PROCS;
+	}
+	b = &ckpt_pending[ckpt_num_pending++];
+	*b = ckpt_batch[index];
+	cpe_info_to_file_stats(info, &b->stats);
+	if (dedup_array)
+		b->chunks = dedup_array[index].chunks;
+
+	for (i = 0; i < ckpt_num_pending; ) {
+		b = &ckpt_pending[i];
+		if (b->start != ckpt.done_blocks) {
+			i++;
+			continue;
+		}
+		cpe_file_stats_to_info(&ckpt.stats, &done);
+		cpe_file_stats_to_info(&b->stats, &batch);
+		cpe_info_merge(&done, &batch);
+		cpe_info_to_file_stats(&done, &ckpt.stats);
+		ckpt.hll.chunks += b->chunks;
+		ckpt.done_blocks += b->blocks;
+		*b = ckpt_pending[--ckpt_num_pending];
+		i = 0;
+	}
+}
+
+/* Write the checkpoint (replacing the last one atomically). Only system
+ * calls on the device path, as this also runs from the signal handler. The
+ * directory path writes a cache (malloc, qsort, stdio), so it never does. */
+static int checkpoint_save(void)
+{
+	char tmp_path[PATH_MAX];
+	size_t len = sizeof(struct checkpoint);
+	ssize_t ret;
+	int fd;
+
+	if (dir_mode)
+		return cpe_dir_cache_save(checkpoint_name, &dir, 1);
+
+	ckpt.rng = sampler.rng;
+	if (dedup_array)
+		memcpy(ckpt.hll.reg, dedup_array[num_procs].reg, sizeof(ckpt.hll.reg));
+	if (!dedup_array)
+		len = offsetof(struct checkpoint, hll);
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", checkpoint_name) >= (int)sizeof(tmp_path)) {
+		errno = ENAMETOOLONG;
+		return COMPRESTIMATOR_EINVAL;
+	}
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return COMPRESTIMATOR_EIO;
+	ret = write(fd, &ckpt, len);
+	if (ret != (ssize_t)len || fsync(fd) == -1) {
+		close(fd);
+		unlink(tmp_path);
+		return COMPRESTIMATOR_EIO;
+	}
+	close(fd);
+	if (rename(tmp_path, checkpoint_name) == -1) {
+		unlink(tmp_path);
+		return COMPRESTIMATOR_EIO;
+	}
+	return COMPRESTIMATOR_OK;
+}
+
+/* Every CHECKPOINT_NS, after a child was reaped */
+static void checkpoint_tick(void)
+{
+	uint64_t now = cpe_now_ns();
+
+	if (now - ckpt_last_ns < CHECKPOINT_NS)
+		return;
+	ckpt_busy = 1;
+	if (checkpoint_save())
+		perror(checkpoint_name);
+	ckpt_busy = 0;
+	ckpt_last_ns = now;
+}
+
+/* --resume on a device: take the counted blocks and their statistics from
+ * the checkpoint. A missing checkpoint starts the pass from the beginning. */
+static int checkpoint_load(void)
+{
+	struct compression_info info;
+	struct checkpoint c;
+	size_t len = dedup_array ? sizeof(c) : offsetof(struct checkpoint, hll);
+	ssize_t ret;
+	int fd;
+
+	fd = open(checkpoint_name, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			perror(checkpoint_name);
+			return errno;
+		}
+		fprintf(stderr, "No checkpoint in %s, starting from the beginning\n", checkpoint_name);
+		return 0;
+	}
+	memset(&c, 0, sizeof(c));
+	ret = read(fd, &c, len);
+	close(fd);
+	if (ret != (ssize_t)len || c.magic != CHECKPOINT_MAGIC || c.version != CHECKPOINT_VERSION) {
+		fprintf(stderr, "Error: %s is not a checkpoint\n", checkpoint_name);
+		return EINVAL;
+	}
+	if (c.dev_size != dev_size || c.dedup_chunk_size != dedup_chunk_size ||
+			c.done_blocks < sampler.first_chunk || c.done_blocks > sampler.num_chunks) {
+		fprintf(stderr, "Error: %s is the checkpoint of another device or other options\n", checkpoint_name);
+		return EINVAL;
+	}
+
+	ckpt = c;
+	sampler.cur_chunk = c.done_blocks;
+	sampler.rng = c.rng;
+	cpe_file_stats_to_info(&c.stats, &info);
+	cpe_info_merge(&comp_info_array[num_procs], &info);
+	if (dedup_array)
+		dedup_array[num_procs] = c.hll;
+	fprintf(stderr, "Resuming at %.1f of %.1f MB\n",
+			(double)c.done_blocks * INBLOCK_SIZE / 1048576, (double)dev_size / 1048576);
+	return 0;
+}
+
 /* Wait for a child process to exit, and then aggregate its results */
 static int wait_for_process()
 {
 	int i;
 	pid_t ret;
 	int status;
+	uint64_t t0;
+	struct compression_info child_info;
 
+	t0 = profile_start(cur_profile);
 	do {
 		ret = wait(&status);
 	} while (ret == -1);
+	profile_end(cur_profile, PHASE_WAIT, t0);
 	
 	if (!WIFEXITED(status)) {
 		fprintf(stderr, "process %d exited abnormally !! \n", ret);
@@ -520,11 +1139,28 @@ static int wait_for_process()
 	for (i = 0; i < num_procs; i++) {
 		if (pid_array[i] == ret) {
 			pid_array[i] = 0;
-			comp_info_array[num_procs].num_zero_blocks += comp_info_array[i].num_zero_blocks;
-			comp_info_array[num_procs].num_non_zero_blocks += comp_info_array[i].num_non_zero_blocks;
-			comp_info_array[num_procs].total_blocks_read += comp_info_array[i].total_blocks_read;
-			comp_info_array[num_procs].compression_ratio += comp_info_array[i].compression_ratio;
-			comp_info_array[num_procs].c_squared += comp_info_array[i].c_squared;
+			t0 = profile_start(cur_profile);
+			ckpt_busy = 1;
+			cpe_info_snapshot(&comp_info_array[i], &child_info);
+			cpe_info_merge(&comp_info_array[num_procs], &child_info);
+			if (dedup_array)
+				cpe_hll_merge(&dedup_array[num_procs], &dedup_array[i]);
+			if (checkpoint_name && !dir_mode)
+				checkpoint_batch_done(i, &child_info);
+			ckpt_busy = 0;
+			profile_end(cur_profile, PHASE_AGGREGATE, t0);
+			if (profile_array) {
+				profile_array[i].runs = 1;
+				profile_array[i].lifetime_ns = cpe_now_ns() - fork_ns[i];
+				cpe_profile_merge(&worker_profiles[i], &profile_array[i]);
+			}
+			if (stats_seg) {
+				stats_write_begin(&stats_seg->workers[i].seq);
+				stats_seg->workers[i].pid = 0;
+				stats_write_end(&stats_seg->workers[i].seq);
+				children_done++;
+				stats_publish(0);
+			}
 			return 0;
 		}
 	}
@@ -564,17 +1200,26 @@ static void print_status(int final)
 	int total_samples = info->num_zero_blocks + info->num_non_zero_blocks;
 	double after_zero_size = (((double)info->num_non_zero_blocks / total_samples) * dev_size_mb);
 	double after_zero_perc = (((double)info->num_non_zero_blocks / total_samples) * 100);
-	double after_rtc_size = (info->compression_ratio * after_zero_size) / (double)info->num_non_zero_blocks;
-	double after_rtc_perc = (double)info->compression_ratio * 100 / (double)info->num_non_zero_blocks;
+	double after_rtc_size = info->ratio.mean * after_zero_size;
+	double after_rtc_perc = info->ratio.mean * 100;
 	double conf_zeros;
 	double conf_comp;
+	double deff_zeros, deff_comp;
+	char dedup_col[MAX_STRING_LEN] = "";
+	double unique_chunks = 0, dedup_ratio = 1;
 		
 	double error = (after_zero_size * confidence(&conf_zeros,&conf_comp));
 
+	if (dedup_array && dedup_array[num_procs].chunks) {
+		unique_chunks = cpe_hll_count(&dedup_array[num_procs]);
+		dedup_ratio = (double)dedup_array[num_procs].chunks / unique_chunks;
+		snprintf(dedup_col, sizeof(dedup_col), ", %.3f", dedup_ratio);
+	}
+
 	memset(csv_output, 0, MAX_STRING_LEN);
-	snprintf(csv_output, (MAX_STRING_LEN-1), "%d, %d, %d, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f,%.3f, %.3f\n",
-			info->num_zero_blocks, info->num_non_zero_blocks, info->total_blocks_read, info->compression_ratio, conf_comp,
-			dev_size_mb, after_zero_size, after_zero_perc, conf_zeros, after_rtc_size, after_rtc_perc, error);
+	snprintf(csv_output, (MAX_STRING_LEN-1), "%d, %d, %d, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f, %.3f,%.3f, %.3f%s\n",
+			info->num_zero_blocks, info->num_non_zero_blocks, info->total_blocks_read, info->ratio.mean * info->ratio.n, conf_comp,
+			dev_size_mb, after_zero_size, after_zero_perc, conf_zeros, after_rtc_size, after_rtc_perc, error, dedup_col);
 
 	if (final && res_file) {
 		fprintf(res_file, csv_output);
@@ -585,6 +1230,18 @@ static void print_status(int final)
     fprintf(stderr, "Based on %d samples, %d non-zero\n", total_samples, info->num_non_zero_blocks);
 	fprintf(stderr, "%.2f%% Non-zero percent (+- %.2f%%) - Volume after migration (w/o RTC): %.1f MB\n", after_zero_perc, conf_zeros*100.0, after_zero_size);
 	fprintf(stderr, "%.2f%% Compression rate (+- %.2f%%) - Volume after migration (with RTC): %.1f MB\n", after_rtc_perc, conf_comp*100.0, after_rtc_size);
+	if (info->cluster.clusters) {
+		/* What the contiguous reads cost in randomness */
+		cpe_cluster_design_effect(info, &deff_zeros, &deff_comp);
+		fprintf(stderr, "%llu clusters of %u KB, design effect %.2f (non-zero) %.2f (compression) - worth %.0f and %.0f random samples\n",
+				(unsigned long long)info->cluster.clusters, cluster_blocks * INBLOCK_SIZE / 1024,
+				deff_zeros, deff_comp, total_samples / deff_zeros, info->num_non_zero_blocks / deff_comp);
+	}
+	if (dedup_array && dedup_array[num_procs].chunks)
+		fprintf(stderr, "%.2f:1 Dedup ratio (+- %.1f%%) - %.0f unique of %llu non-zero %u KB chunks, after dedup and RTC: %.1f MB\n",
+				dedup_ratio, 104.0 / sqrt(1 << HLL_BITS), unique_chunks,
+				(unsigned long long)dedup_array[num_procs].chunks, dedup_chunk_size / 1024,
+				after_rtc_size / dedup_ratio);
 	fprintf(stderr, "**************************************************\n");
 	
 	
@@ -607,17 +1264,47 @@ static void cleanup_handler(int signum)
 {
 	int i;
 
-	time_t end_time = time(NULL);
-	time_t tot_time = time(NULL) - start_time;
-	fprintf(stderr, "Total run time: %ld seconds\n", tot_time);
+	uint64_t run_ns = cpe_now_ns() - start_ns;
+	double tot_time = (double)run_ns / 1000000000.0;
+
+	/* Interrupted: keep what is finished for --resume. A directory pass
+	 * resumes from its last periodic checkpoint instead, as saving its cache
+	 * is not async-signal-safe. */
+	if (signum && checkpoint_name && ckpt_ready && !ckpt_busy && !dir_mode) {
+		for (i = 0; i < num_procs; i++)
+			if (pid_array[i])
+				kill(pid_array[i], SIGKILL);
+		if (checkpoint_save() == COMPRESTIMATOR_OK)
+			fprintf(stderr, "Checkpoint saved in %s\n", checkpoint_name);
+	}
+
+	fprintf(stderr, "Total run time: %.3f seconds\n", tot_time);
 
 	if (res_file) {
 		fprintf(res_file, ", %.2f, ", tot_time);
 		print_status(1);
 	}
 
+	if (stats_seg) {
+		stats_publish(1);
+		munmap(stats_seg, sizeof(struct stats_segment));
+		stats_seg = NULL;
+	}
+
+	if (profile_array) {
+		if (profile_name)
+			write_profile(run_ns);
+		munmap(profile_array, profile_mem_size);
+		profile_array = NULL;
+		cur_profile = NULL;
+	}
+
 	if (comp_info_array)
 		munmap(comp_info_array, shared_mem_size);
+	if (dedup_array) {
+		munmap(dedup_array, dedup_mem_size);
+		dedup_array = NULL;
+	}
 
 	for (i = 0; i < num_procs; i++) {
 		if (pid_array[i])
@@ -696,51 +1383,960 @@ int init_log_files(char *log_name, char *csv_name, char *res_name, int exhaustiv
 	return 0;
 }
 
-int main(int argc, char **argv)
+/* Take the estimate of the stream as the aggregated statistics */
+static void stream_update(comprestimator_stream *st)
 {
-	int c;
-	int ret = 0;
-	int index;
-	int num_chunks;
-	int exhaustive = 0;
-	int active_procs = 0;
-	char *log_name = NULL;
-	char *csv_name = NULL;
-	char *res_name = NULL;
-	unsigned int seed;
-	unsigned int seed_set = 0;
-	int pattern_size;
-	off_t *pattern = NULL;
+	struct comprestimator_result res;
+	struct compression_info info;
 
-	signal(SIGINT, cleanup_handler);
-	signal(SIGTERM, cleanup_handler);
-	signal(SIGHUP, cleanup_handler);
+	comprestimator_stream_snapshot(st, &res);
+	cpe_stream_info(st, &info);
+	dev_size = res.dev_size;
+	cpe_info_commit(&comp_info_array[num_procs], &info);
+}
 
-	while ((c = getopt (argc, argv, "d:p:l:c:r:s:eh")) != -1)
-		switch (c)
-		{
-			case 'd':
-				dev_name = optarg;
-				break;
-			case 'p':
-				num_procs = atoi(optarg);
-				break;
-			case 'l':
-				log_name = optarg;
-				break;
-			case 'c':
-				csv_name = optarg;
-				break;
-			case 'r':
-				res_name = optarg;
-				break;
-			case 's':
-				seed = atoi(optarg);
-				seed_set = 1;
-				break;
-			case 'e':
-				exhaustive = 1;
-				break;
+/* Estimate the data coming in on stdin (-d -), copying it to pass_fd unless
+ * it is -1. The data is never stored: only sampled windows of it are copied
+ * and compressed, so the estimate costs little of the stream's throughput. */
+static int run_stream(int exhaustive, uint64_t seed, int pass_fd)
+{
+	struct comprestimator_options opts;
+	comprestimator_stream *st;
+	unsigned char *buf;
+	ssize_t bytes_read, written, off;
+	uint64_t last_status = cpe_now_ns();
+	int ret;
+
+	buf = (unsigned char *) malloc(STREAM_READ_SIZE);
+	if (!buf) {
+		fprintf(stderr, "Failed to allocate memory for read buffer\n");
+		return ENOMEM;
+	}
+
+	comprestimator_default_options(&opts);
+	opts.seed = seed;
+	opts.exhaustive = exhaustive;
+	ret = comprestimator_stream_open(&st, &opts);
+	if (ret) {
+		fprintf(stderr, "Error: %s\n", comprestimator_strerror(ret));
+		free(buf);
+		return ret;
+	}
+	if (profile_array)
+		cpe_stream_worker(st)->profile = &worker_profiles[0];
+
+	while ((bytes_read = read(STDIN_FILENO, buf, STREAM_READ_SIZE)) != 0) {
+		if (bytes_read == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			ret = errno;
+			goto out;
+		}
+
+		ret = comprestimator_stream_push(st, buf, bytes_read);
+		if (ret) {
+			fprintf(stderr, "Error: failed to compress (%s)\n", comprestimator_strerror(ret));
+			goto out;
+		}
+
+		for (off = 0; (pass_fd != -1) && (off < bytes_read); off += written) {
+			written = write(pass_fd, buf + off, bytes_read - off);
+			if (written == -1) {
+				if (errno == EINTR) {
+					written = 0;
+					continue;
+				}
+				perror("write");
+				ret = errno;
+				goto out;
+			}
+		}
+
+		if (cpe_now_ns() - last_status >= STREAM_STATUS_NS) {
+			stream_update(st);
+			if (comp_info_array[num_procs].num_zero_blocks + comp_info_array[num_procs].num_non_zero_blocks)
+				print_status(0);
+			stats_publish(0);
+			last_status = cpe_now_ns();
+		}
+	}
+
+	ret = comprestimator_stream_finish(st);
+	if (ret)
+		fprintf(stderr, "Error: failed to compress (%s)\n", comprestimator_strerror(ret));
+	stream_update(st);
+	print_status(0);
+
+out:
+	comprestimator_stream_close(st);
+	free(buf);
+	return ret;
+}
+
+/* Map the fingerprint array and load the samples of the last run into it (if
+ * --fingerprints). A missing file, or one of another device size, starts
+ * from scratch. */
+static int fp_init(void)
+{
+	struct fingerprint_header hdr;
+	ssize_t len = 0;
+	size_t i;
+	int fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	fd = fp_name ? open(fp_name, O_RDONLY) : -1;
+	if (fd == -1 && fp_name && errno != ENOENT) {
+		perror(fp_name);
+		return errno;
+	}
+	if (fd != -1) {
+		len = read(fd, &hdr, sizeof(hdr));
+		if (len != sizeof(hdr) || hdr.magic != FP_MAGIC || hdr.version != FP_VERSION ||
+				hdr.record_size != sizeof(struct sample_fingerprint)) {
+			fprintf(stderr, "Warning: %s is not a fingerprint file of this version, ignoring it\n", fp_name);
+			hdr.num_records = 0;
+		} else if (hdr.dev_size != (uint64_t)dev_size) {
+			fprintf(stderr, "Warning: the device size changed since %s was written, ignoring it\n", fp_name);
+			hdr.num_records = 0;
+		}
+	}
+
+	/* Room for the samples of a full run on top of the old ones */
+	fp_capacity = hdr.num_records + MAX_NUM_SAMPLE * (1 + ZERO_BLOCK_FACTOR) + MAX_NUM_PROCS * BLOCKS_PER_PROC;
+	fp_mem_size = fp_capacity * sizeof(struct sample_fingerprint);
+	fp_array = (struct sample_fingerprint *) mmap(NULL, fp_mem_size, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+	if (fp_array == (void *)-1) {
+		perror("mmap");
+		fp_array = NULL;
+		if (fd != -1)
+			close(fd);
+		return errno;
+	}
+
+	if (hdr.num_records) {
+		len = hdr.num_records * sizeof(struct sample_fingerprint);
+		if (read(fd, fp_array, len) != len) {
+			fprintf(stderr, "Warning: %s is truncated, ignoring it\n", fp_name);
+			hdr.num_records = 0;
+		}
+	}
+	if (fd != -1)
+		close(fd);
+
+	fp_loaded = hdr.num_records;
+	for (i = 0; i < fp_loaded; i++)
+		fp_array[i].flags = 0;
+	return 0;
+}
+
+/* Write the samples of this run to the fingerprint file, replacing it */
+static int fp_save(void)
+{
+	struct fingerprint_header hdr;
+	char tmp_name[PATH_MAX];
+	size_t i, n = 0;
+	FILE *f;
+	int ret = 0;
+
+	for (i = 0; i < fp_count; i++)
+		if (fp_array[i].blocks)
+			fp_array[n++] = fp_array[i];
+	fp_count = n;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FP_MAGIC;
+	hdr.version = FP_VERSION;
+	hdr.record_size = sizeof(struct sample_fingerprint);
+	hdr.dev_size = dev_size;
+	hdr.num_records = n;
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", fp_name);
+	f = fopen(tmp_name, "w");
+	if (!f) {
+		perror(tmp_name);
+		return errno;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || (n && fwrite(fp_array, sizeof(struct sample_fingerprint), n, f) != n) ||
+			fflush(f) || fsync(fileno(f)))
+		ret = errno;
+	if (fclose(f) && !ret)
+		ret = errno;
+	if (!ret && rename(tmp_name, fp_name) == -1)
+		ret = errno;
+	if (ret) {
+		perror(fp_name);
+		unlink(tmp_name);
+	}
+	return ret;
+}
+
+/* Write the data of this run's samples to the capture file */
+static int capture_save(void)
+{
+	int fd;
+	int ret;
+
+	fd = open(dev_name, O_RDONLY);
+	if (fd == -1) {
+		perror(dev_name);
+		return errno;
+	}
+	ret = cpe_capture_write(capture_name, dev_name, fd, dev_size, fp_array, fp_count);
+	if (ret)
+		perror(capture_name);
+	close(fd);
+	return ret;
+}
+
+/* Write the result of this shard (--partial) */
+static int partial_save(int exhaustive)
+{
+	struct partial *p;
+	char tmp_path[PATH_MAX];
+	FILE *f;
+	int ret = 0;
+
+	p = (struct partial *) calloc(1, sizeof(struct partial));
+	if (!p)
+		return ENOMEM;
+	p->magic = PARTIAL_MAGIC;
+	p->version = PARTIAL_VERSION;
+	p->shard = shard;
+	p->num_shards = num_shards ? num_shards : 1;
+	p->exhaustive = exhaustive;
+	p->dedup_chunk_size = dedup_chunk_size;
+	p->total_size = shard_total_size;
+	p->shard_size = dev_size;
+	cpe_info_to_file_stats(&comp_info_array[num_procs], &p->stats);
+	strncpy(p->origin, dev_name, CAPTURE_ORIGIN_LEN - 1);
+	if (dedup_array)
+		p->hll = dedup_array[num_procs];
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", partial_name);
+	f = fopen(tmp_path, "w");
+	if (!f) {
+		perror(tmp_path);
+		free(p);
+		return errno;
+	}
+	if (fwrite(p, sizeof(struct partial), 1, f) != 1 || fflush(f) || fsync(fileno(f)))
+		ret = errno;
+	if (fclose(f) && !ret)
+		ret = errno;
+	if (!ret && rename(tmp_path, partial_name) == -1)
+		ret = errno;
+	if (ret) {
+		perror(partial_name);
+		unlink(tmp_path);
+	}
+	free(p);
+	return ret;
+}
+
+/* comprestimator merge: the estimate of the shards in the partial files,
+ * which must be all the shards of one run */
+static int run_merge(char **names, int num_names, char *log_name, char *csv_name, char *res_name)
+{
+	static char origin[CAPTURE_ORIGIN_LEN];
+	struct compression_info info;
+	struct partial *p, first;
+	char *seen = NULL;
+	FILE *f;
+	int i, ret = 0;
+
+	p = (struct partial *) malloc(sizeof(struct partial));
+	if (!p)
+		return ENOMEM;
+	dev_size = 0;
+	for (i = 0; i < num_names && !ret; i++) {
+		f = fopen(names[i], "r");
+		if (!f) {
+			perror(names[i]);
+			ret = errno;
+			break;
+		}
+		if (fread(p, sizeof(struct partial), 1, f) != 1 || p->magic != PARTIAL_MAGIC ||
+				p->version != PARTIAL_VERSION || p->shard >= p->num_shards) {
+			fprintf(stderr, "Error: %s is not a partial result of this version\n", names[i]);
+			ret = EINVAL;
+		}
+		fclose(f);
+		if (ret)
+			break;
+
+		if (!i) {
+			first = *p;
+			seen = (char *) calloc(p->num_shards, 1);
+			if (!seen) {
+				ret = ENOMEM;
+				break;
+			}
+			dedup_chunk_size = p->dedup_chunk_size;
+			if (dedup_chunk_size) {
+				dedup_mem_size = sizeof(struct hll) * (num_procs + 1);
+				dedup_array = (struct hll *) mmap(NULL, dedup_mem_size, PROT_READ | PROT_WRITE,
+						MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+				if (dedup_array == (void *)-1) {
+					perror("mmap");
+					dedup_array = NULL;
+					ret = errno;
+					break;
+				}
+				memset(dedup_array, 0, dedup_mem_size);
+			}
+		} else if (p->num_shards != first.num_shards || p->exhaustive != first.exhaustive ||
+				p->dedup_chunk_size != first.dedup_chunk_size || p->total_size != first.total_size) {
+			fprintf(stderr, "Error: %s is a shard of another run than %s\n", names[i], names[0]);
+			ret = EINVAL;
+			break;
+		}
+		if (seen[p->shard]) {
+			fprintf(stderr, "Error: shard %u/%u is given twice\n", p->shard, p->num_shards);
+			ret = EINVAL;
+			break;
+		}
+		seen[p->shard] = 1;
+
+		dev_size += p->shard_size;
+		cpe_file_stats_to_info(&p->stats, &info);
+		cpe_info_merge(&comp_info_array[num_procs], &info);
+		if (dedup_array)
+			cpe_hll_merge(&dedup_array[num_procs], &p->hll);
+	}
+	for (i = 0; !ret && i < (int)first.num_shards; i++) {
+		if (!seen[i]) {
+			fprintf(stderr, "Error: shard %d/%u is missing\n", i, first.num_shards);
+			ret = EINVAL;
+		}
+	}
+	free(seen);
+	free(p);
+	if (ret)
+		return ret;
+
+	memcpy(origin, first.origin, CAPTURE_ORIGIN_LEN - 1);
+	dev_name = origin;
+	ret = init_log_files(log_name, csv_name, res_name, first.exhaustive);
+	if (ret)
+		return ret;
+	start_ns = cpe_now_ns();
+	fprintf(stderr, "Merged %u shards\n", first.num_shards);
+	print_status(0);
+	return 0;
+}
+
+/* Estimate from the samples of a capture file (--replay) */
+static int run_replay(char *log_name, char *csv_name, char *res_name)
+{
+	static char origin[CAPTURE_ORIGIN_LEN];
+	struct capture cap;
+	int ret;
+
+	ret = cpe_capture_open(&cap, replay_name);
+	if (ret) {
+		fprintf(stderr, "Error: %s: %s\n", replay_name,
+				(ret == COMPRESTIMATOR_EIO) ? strerror(errno) : "not a capture file of this version");
+		return ret;
+	}
+	memcpy(origin, cap.hdr->origin, CAPTURE_ORIGIN_LEN - 1);
+	dev_name = origin;
+	dev_size = cap.hdr->dev_size;
+	ret = init_log_files(log_name, csv_name, res_name, 0);
+	if (ret) {
+		cpe_capture_close(&cap);
+		return ret;
+	}
+	start_ns = cpe_now_ns();
+
+	fprintf(stderr, "Replaying %llu samples at level %d\n", (unsigned long long)cap.hdr->num_records, replay_level);
+	ret = cpe_capture_replay(&cap, replay_level, &comp_info_array[num_procs]);
+	if (ret)
+		fprintf(stderr, "Error: failed to compress (%s)\n", comprestimator_strerror(ret));
+	else if (comp_info_array[num_procs].total_blocks_read)
+		print_status(0);
+	cpe_capture_close(&cap);
+	return ret;
+}
+
+/* Cost model of a run, measured by --plan */
+struct plan_cost {
+	double iops[3];			//random reads/s with plan_procs[] probers
+	double seq_bps[3];		//sequential bytes/s with plan_procs[] probers
+	double open_ns;			//opening a file (directories)
+	double sample_cpu_ns;		//compressing a sample, cached
+	double block_cpu_ns;		//exhaustive pass per block, cached
+	double blocks_per_sample;
+	double non_zero_frac;
+	double ratio_var;
+	double fork_ns;
+};
+
+static const int plan_procs[3] = {1, 4, 16};
+
+/* Cumulative file sizes, to pick probe offsets uniformly over the data of a
+ * directory */
+static uint64_t *plan_cum = NULL;
+
+/* Open the source at a random block. For a device fd is opened once and
+ * kept, for a directory a random file is opened every time. */
+static int plan_pick(uint64_t *rng, int *fd, off_t *off)
+{
+	uint64_t pos = (rand_next(rng) % (uint64_t)(dev_size / INBLOCK_SIZE)) * INBLOCK_SIZE;
+	size_t lo = 0, hi, mid;
+
+	if (!dir_mode) {
+		if (*fd == -1)
+			*fd = open(dev_name, O_RDONLY);
+		*off = pos;
+		return *fd;
+	}
+
+	hi = dir.num_files - 1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (plan_cum[mid] <= pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (*fd != -1)
+		close(*fd);
+	*fd = open(cpe_dir_file_path(&dir, &dir.files[lo]), O_RDONLY);
+	*off = ((pos - (lo ? plan_cum[lo - 1] : 0)) / INBLOCK_SIZE) * INBLOCK_SIZE;
+	return *fd;
+}
+
+/* Time procs processes reading at once: PLAN_PROBE_READS random blocks each
+ * (returns reads/s), or PLAN_PROBE_SEQ sequential bytes each (returns
+ * bytes/s) */
+static double plan_probe_reads(int procs, int sequential, uint64_t seed)
+{
+	unsigned char *buf;
+	uint64_t rng, t0;
+	off_t off;
+	int fd, i, n, status;
+	pid_t pid;
+
+	t0 = cpe_now_ns();
+	for (n = 0; n < procs; n++) {
+		pid = fork();
+		if (pid == -1) {
+			perror("fork");
+			break;
+		}
+		if (pid)
+			continue;
+
+		rng = seed + n * 0x9e3779b97f4a7c15ULL;
+		buf = (unsigned char *) malloc(PLAN_READ_SIZE);
+		fd = -1;
+		if (!buf)
+			exit(1);
+		if (sequential) {
+			plan_pick(&rng, &fd, &off);
+			for (i = 0; i < PLAN_PROBE_SEQ / PLAN_READ_SIZE; i++) {
+				if (fd == -1 || pread(fd, buf, PLAN_READ_SIZE, off) <= 0) {
+					/* End of the source (or file): go on elsewhere */
+					if (plan_pick(&rng, &fd, &off) == -1)
+						exit(1);
+					continue;
+				}
+				off += PLAN_READ_SIZE;
+			}
+		} else {
+			for (i = 0; i < PLAN_PROBE_READS; i++)
+				if (plan_pick(&rng, &fd, &off) == -1 || pread(fd, buf, INBLOCK_SIZE, off) == -1)
+					exit(1);
+		}
+		exit(0);
+	}
+	for (i = 0; i < n; i++) {
+		if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+			return 0;
+	}
+	return (double)n * (sequential ? PLAN_PROBE_SEQ : PLAN_PROBE_READS) * 1e9 / (double)(cpe_now_ns() - t0);
+}
+
+/* Measure what a sample costs here: the reads, the CPU, and what the data
+ * looks like */
+static int plan_measure(struct plan_cost *cost, uint64_t seed)
+{
+	struct comp_worker w;
+	off_t offs[PLAN_PROBE_SAMPLES];
+	int fds[PLAN_PROBE_SAMPLES];
+	off_t *pattern;
+	uint64_t rng = seed, w_rng, t0;
+	int fd = -1;
+	int blocks = 0;
+	int i, pass, ret;
+
+	memset(cost, 0, sizeof(struct plan_cost));
+	for (i = 0; i < 3; i++) {
+		cost->iops[i] = plan_probe_reads(plan_procs[i], 0, rand_next(&rng));
+		cost->seq_bps[i] = plan_probe_reads(plan_procs[i], 1, rand_next(&rng));
+		if (!cost->iops[i] || !cost->seq_bps[i]) {
+			fprintf(stderr, "Error: failed to read %s\n", dev_name);
+			return -1;
+		}
+	}
+
+	t0 = cpe_now_ns();
+	if (fork() == 0)
+		exit(0);
+	wait(NULL);
+	cost->fork_ns = cpe_now_ns() - t0;
+
+	if (dir_mode) {
+		t0 = cpe_now_ns();
+		for (i = 0; i < PLAN_PROBE_SAMPLES; i++)
+			plan_pick(&rng, &fd, &offs[0]);
+		cost->open_ns = (double)(cpe_now_ns() - t0) / PLAN_PROBE_SAMPLES;
+		close(fd);
+	}
+
+	/* Each sample keeps its fd for the second pass (a directory sample may
+	 * be in any file) */
+	fd = -1;
+	for (i = 0; i < PLAN_PROBE_SAMPLES; i++) {
+		if (dir_mode)
+			fd = -1;
+		fds[i] = plan_pick(&rng, &fd, &offs[i]);
+		if (fds[i] == -1) {
+			perror("open");
+			while (i-- > 0)
+				if (dir_mode || !i)
+					close(fds[i]);
+			return -1;
+		}
+	}
+
+	ret = cpe_worker_init(&w, rand_next(&rng));
+	if (ret)
+		return ret;
+	/* Compress the same samples twice, the second time from the page cache:
+	 * that is the CPU cost */
+	w_rng = w.rng;
+	for (pass = 0; pass < 2; pass++) {
+		memset(&w.info, 0, sizeof(w.info));
+		w.rng = w_rng;
+		t0 = cpe_now_ns();
+		for (i = 0; i < PLAN_PROBE_SAMPLES && !ret; i++) {
+			w.fd = fds[i];
+			ret = cpe_compress_chunk_random(&w, offs[i]);
+		}
+		cost->sample_cpu_ns = (double)(cpe_now_ns() - t0) / PLAN_PROBE_SAMPLES;
+	}
+	w.fd = -1;
+	for (i = 0; i < PLAN_PROBE_SAMPLES; i++)
+		if (dir_mode || !i)
+			close(fds[i]);
+	if (ret) {
+		cpe_worker_destroy(&w);
+		return ret;
+	}
+	cost->blocks_per_sample = (double)w.info.total_blocks_read / PLAN_PROBE_SAMPLES;
+	cost->non_zero_frac = (double)w.info.num_non_zero_blocks / PLAN_PROBE_SAMPLES;
+	cost->ratio_var = cpe_moments_var(&w.info.ratio);
+
+	/* The exhaustive pass, on a stretch of the device or the largest file */
+	if (dir_mode) {
+		size_t f, largest = 0;
+
+		for (f = 1; f < dir.num_files; f++)
+			if (dir.files[f].size > dir.files[largest].size)
+				largest = f;
+		ret = cpe_worker_open(&w, cpe_dir_file_path(&dir, &dir.files[largest]));
+		blocks = min((off_t)(COMP_UNIT_SIZE / INBLOCK_SIZE) / 64, (off_t)dir.files[largest].size / INBLOCK_SIZE);
+	} else {
+		ret = cpe_worker_open(&w, dev_name);
+		blocks = min((off_t)(COMP_UNIT_SIZE / INBLOCK_SIZE) / 64, dev_size / INBLOCK_SIZE);
+	}
+	pattern = (off_t *) malloc(sizeof(off_t) * (blocks + 1));
+	if (!ret && pattern && blocks) {
+		for (i = 0; i < blocks; i++)
+			pattern[i] = (off_t)i * INBLOCK_SIZE;
+		for (pass = 0; pass < 2 && !ret; pass++) {
+			t0 = cpe_now_ns();
+			ret = cpe_compress_chunks_sequential(&w, pattern, blocks);
+			cost->block_cpu_ns = (double)(cpe_now_ns() - t0) / blocks;
+		}
+	}
+	free(pattern);
+	cpe_worker_destroy(&w);
+	return ret;
+}
+
+/* Reads/s (or bytes/s) with procs processes, interpolated between the probes
+ * and flat beyond the last */
+static double plan_rate(const double *rates, int procs)
+{
+	int i;
+
+	for (i = 1; i < 3; i++) {
+		if (procs <= plan_procs[i])
+			return rates[i - 1] + (rates[i] - rates[i - 1]) *
+				(double)(procs - plan_procs[i - 1]) / (double)(plan_procs[i] - plan_procs[i - 1]);
+	}
+	return rates[2];
+}
+
+/* Samples the sampler will take before its stopping rule holds, given what
+ * the probe saw, and the confidence bounds it stops at */
+static double plan_samples(struct plan_cost *cost, double *conf_zeros, double *conf_comp)
+{
+	struct compression_info info;
+	int non_zero;
+
+	memset(&info, 0, sizeof(info));
+	if (dir_mode) {
+		uint64_t samples = 0;
+		size_t i;
+
+		for (i = 0; i < dir.num_files; i++)
+			if (dir.files[i].state == DIR_FILE_PENDING)
+				samples += dir.files[i].samples;
+		non_zero = samples * cost->non_zero_frac;
+		info.num_non_zero_blocks = comp_info_array[num_procs].num_non_zero_blocks + non_zero;
+		info.num_zero_blocks = comp_info_array[num_procs].num_zero_blocks + (samples - non_zero);
+		info.ratio.n = info.num_non_zero_blocks;
+		info.ratio.m2 = cost->ratio_var * info.ratio.n;
+		cpe_confidence_bounds(&info, conf_zeros, conf_comp);
+		return samples;
+	}
+
+	for (non_zero = MIN_NUM_SAMPLE; ; non_zero += 10) {
+		info.num_non_zero_blocks = non_zero;
+		info.num_zero_blocks = cost->non_zero_frac ?
+			non_zero * (1 - cost->non_zero_frac) / cost->non_zero_frac : (double)MAX_NUM_SAMPLE * ZERO_BLOCK_FACTOR;
+		info.ratio.n = non_zero;
+		info.ratio.m2 = cost->ratio_var * non_zero;
+		cpe_confidence_bounds(&info, conf_zeros, conf_comp);
+		if ((*conf_zeros <= sampler.target_error && *conf_comp <= sampler.target_error) ||
+				non_zero >= sampler.max_samples || info.num_zero_blocks >= (double)sampler.max_samples * ZERO_BLOCK_FACTOR)
+			break;
+	}
+	return info.num_zero_blocks + info.num_non_zero_blocks;
+}
+
+/* --plan: measure the costs and print the predicted time, reads and
+ * confidence of the run for a range of -p */
+static int run_plan(int exhaustive, uint64_t seed)
+{
+	struct plan_cost cost;
+	double samples = 0, bytes, conf_zeros = 0, conf_comp = 0;
+	double per_sample_ns, rate, secs, io_rate, cpu_rate;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t i;
+	int procs, ret;
+
+	if (dir_mode) {
+		plan_cum = (uint64_t *) malloc(sizeof(uint64_t) * (dir.num_files + 1));
+		if (!plan_cum) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			return ENOMEM;
+		}
+		for (i = 0; i < dir.num_files; i++)
+			plan_cum[i] = (i ? plan_cum[i - 1] : 0) + dir.files[i].size;
+	}
+
+	fprintf(stderr, "Probing %s...\n", dev_name);
+	ret = plan_measure(&cost, seed);
+	free(plan_cum);
+	plan_cum = NULL;
+	if (ret) {
+		if (ret > 0)
+			fprintf(stderr, "Error: %s\n", comprestimator_strerror(ret));
+		return ret;
+	}
+
+	printf("Probe: %.0f random reads/s (1 reader), %.0f (4), %.0f (16); %.1f MB/s sequential (1), %.1f (4), %.1f (16)\n",
+			cost.iops[0], cost.iops[1], cost.iops[2],
+			cost.seq_bps[0] / 1048576, cost.seq_bps[1] / 1048576, cost.seq_bps[2] / 1048576);
+	printf("CPU: %.1f us per sample (%.1f blocks read), %.2f us per block exhaustive, %.2f ms per fork, %ld CPUs\n",
+			cost.sample_cpu_ns / 1000, cost.blocks_per_sample, cost.block_cpu_ns / 1000, cost.fork_ns / 1e6, ncpu);
+	if (dir_mode)
+		printf("Files: %zu, %.1f us to open one\n", dir.num_files, cost.open_ns / 1000);
+
+	if (exhaustive) {
+		bytes = dev_size;
+		conf_zeros = conf_comp = 0;
+	} else {
+		samples = plan_samples(&cost, &conf_zeros, &conf_comp);
+		bytes = samples * cost.blocks_per_sample * INBLOCK_SIZE;
+		printf("Samples: %.0f (%.0f%% non-zero in the probe), +- %.2f%% non-zero, +- %.2f%% compression\n",
+				samples, cost.non_zero_frac * 100, conf_zeros * 100, conf_comp * 100);
+	}
+
+	printf("\n%6s %12s %12s\n", "procs", "time (s)", "read (MB)");
+	for (procs = 1; procs <= MAX_NUM_PROCS; procs *= 2) {
+		cpu_rate = (double)min((long)procs, ncpu);
+		if (exhaustive) {
+			/* Bytes/s: the slower of the reads and the compressors */
+			io_rate = plan_rate(cost.seq_bps, procs);
+			rate = min(io_rate, cpu_rate * INBLOCK_SIZE * 1e9 / cost.block_cpu_ns);
+			secs = bytes / rate + (double)dev_size / COMP_UNIT_SIZE * cost.fork_ns / 1e9 / procs;
+			if (dir_mode)
+				secs += (double)dir.num_files * cost.open_ns / 1e9 / cpu_rate;
+		} else {
+			/* Samples/s: each process waits for its reads in turn */
+			per_sample_ns = cost.blocks_per_sample * 1e9 / cost.iops[0] + cost.sample_cpu_ns +
+				cost.fork_ns / BLOCKS_PER_PROC + (dir_mode ? cost.open_ns : 0);
+			rate = procs * 1e9 / per_sample_ns;
+			io_rate = plan_rate(cost.iops, procs) / cost.blocks_per_sample;
+			rate = min(rate, min(io_rate, cpu_rate * 1e9 / cost.sample_cpu_ns));
+			secs = samples / rate;
+		}
+		printf("%6d %12.2f %12.1f\n", procs, secs, bytes / 1048576);
+	}
+	fflush(stdout);
+	return 0;
+}
+
+/* Directory mode: find the files, take what the cache has on them and plan
+ * the samples of the rest */
+static int dir_init(int exhaustive, uint64_t seed)
+{
+	struct dir_cache cache;
+	char *from = cache_name;
+	int ret;
+
+	ret = cpe_dir_scan(&dir, dev_name, shared_extents);
+	if (ret) {
+		fprintf(stderr, "Error: failed to scan %s (%s)\n", dev_name, comprestimator_strerror(ret));
+		return ret;
+	}
+	dir.sniff = sniff;
+	dev_size = dir.total_bytes;
+	if (dev_size / INBLOCK_SIZE < 1) {
+		fprintf(stderr, "Error: directory has too little data\n");
+		return -1;
+	}
+	shard_total_size = dev_size;
+	if (num_shards)
+		dev_size = cpe_dir_shard(&dir, dev_name, shard, num_shards);
+
+	memset(&cache, 0, sizeof(cache));
+	/* A checkpoint is resumed as a cache of the files done */
+	if (resume)
+		from = checkpoint_name;
+	if (from) {
+		ret = cpe_dir_cache_open(&cache, from);
+		if (ret) {
+			perror(from);
+			return ret;
+		}
+	}
+	cpe_sampler_init(&sampler, dev_size, exhaustive, seed, target_error);
+	dir_cached = cpe_dir_plan(&dir, &cache, exhaustive, &sampler.rng, &comp_info_array[num_procs]);
+	cpe_dir_cache_close(&cache);
+
+	ret = cpe_dir_scan_share(&dir);
+	if (ret) {
+		perror("mmap");
+		return ret;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+	int ret = 0;
+	int index;
+	int exhaustive = 0;
+	int active_procs = 0;
+	int forked = 0;
+	char *log_name = NULL;
+	char *csv_name = NULL;
+	char *res_name = NULL;
+	unsigned int seed;
+	unsigned int seed_set = 0;
+	int pass_through = 0;
+	int pass_fd = -1;
+	int plan = 0;
+	int merge = 0;
+	int pattern_size;
+	off_t *pattern = NULL;
+	uint64_t t0;
+	struct stat st;
+	sigset_t alarm_set, old_set;
+
+	/* Options without a short form */
+	enum {
+		OPT_PROFILE = 256,
+		OPT_STATS,
+		OPT_TARGET_ERROR,
+		OPT_PASS_THROUGH,
+		OPT_CACHE,
+		OPT_FINGERPRINTS,
+		OPT_CAPTURE,
+		OPT_REPLAY,
+		OPT_LEVEL,
+		OPT_DEDUP,
+		OPT_TIME_BUDGET,
+		OPT_PLAN,
+		OPT_CHECKPOINT,
+		OPT_RESUME,
+		OPT_SHARD,
+		OPT_PARTIAL,
+		OPT_CLUSTER,
+		OPT_SNIFF,
+		OPT_SHARED_EXTENTS,
+	};
+	static struct option long_options[] = {
+		{"profile", required_argument, NULL, OPT_PROFILE},
+		{"stats", required_argument, NULL, OPT_STATS},
+		{"target-error", required_argument, NULL, OPT_TARGET_ERROR},
+		{"pass-through", no_argument, NULL, OPT_PASS_THROUGH},
+		{"cache", required_argument, NULL, OPT_CACHE},
+		{"fingerprints", required_argument, NULL, OPT_FINGERPRINTS},
+		{"capture", required_argument, NULL, OPT_CAPTURE},
+		{"replay", required_argument, NULL, OPT_REPLAY},
+		{"level", required_argument, NULL, OPT_LEVEL},
+		{"dedup", required_argument, NULL, OPT_DEDUP},
+		{"time-budget", required_argument, NULL, OPT_TIME_BUDGET},
+		{"plan", no_argument, NULL, OPT_PLAN},
+		{"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+		{"resume", no_argument, NULL, OPT_RESUME},
+		{"shard", required_argument, NULL, OPT_SHARD},
+		{"partial", required_argument, NULL, OPT_PARTIAL},
+		{"cluster", required_argument, NULL, OPT_CLUSTER},
+		{"sniff", no_argument, NULL, OPT_SNIFF},
+		{"shared-extents", no_argument, NULL, OPT_SHARED_EXTENTS},
+		{NULL, 0, NULL, 0}
+	};
+
+	start_ns = cpe_now_ns();
+
+	signal(SIGINT, cleanup_handler);
+	signal(SIGTERM, cleanup_handler);
+	signal(SIGHUP, cleanup_handler);
+
+	/* comprestimator merge [options] <partial>... */
+	if (argc > 1 && !strcmp(argv[1], "merge")) {
+		merge = 1;
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+	}
+
+	while ((c = getopt_long(argc, argv, "d:p:l:c:r:s:eh", long_options, NULL)) != -1)
+		switch (c)
+		{
+			case 'd':
+				dev_name = optarg;
+				break;
+			case 'p':
+				if (!strcmp(optarg, "auto"))
+					auto_procs = 1;
+				else
+					num_procs = atoi(optarg);
+				break;
+			case 'l':
+				log_name = optarg;
+				break;
+			case 'c':
+				csv_name = optarg;
+				break;
+			case 'r':
+				res_name = optarg;
+				break;
+			case 's':
+				seed = atoi(optarg);
+				seed_set = 1;
+				break;
+			case 'e':
+				exhaustive = 1;
+				break;
+			case OPT_PROFILE:
+				profile_name = optarg;
+				break;
+			case OPT_STATS:
+				stats_name = optarg;
+				break;
+			case OPT_TARGET_ERROR:
+				target_error = atof(optarg) / 100;
+				if (target_error <= 0) {
+					fprintf(stderr, "Target error should be a positive percentage.\n");
+					usage(argv[0]);
+				}
+				break;
+			case OPT_PASS_THROUGH:
+				pass_through = 1;
+				break;
+			case OPT_CACHE:
+				cache_name = optarg;
+				break;
+			case OPT_FINGERPRINTS:
+				fp_name = optarg;
+				break;
+			case OPT_CAPTURE:
+				capture_name = optarg;
+				break;
+			case OPT_REPLAY:
+				replay_name = optarg;
+				break;
+			case OPT_DEDUP:
+				dedup_chunk_size = atoi(optarg) * 1024;
+				if (dedup_chunk_size < INBLOCK_SIZE || dedup_chunk_size > COMP_UNIT_SIZE ||
+						(dedup_chunk_size & (dedup_chunk_size - 1))) {
+					fprintf(stderr, "Dedup chunk size should be a power of two between %d and %d KB.\n",
+							INBLOCK_SIZE / 1024, COMP_UNIT_SIZE / 1024);
+					usage(argv[0]);
+				}
+				break;
+			case OPT_TIME_BUDGET:
+				time_budget_ns = atof(optarg) * 1e9;
+				if (!time_budget_ns) {
+					fprintf(stderr, "Time budget should be a positive number of seconds.\n");
+					usage(argv[0]);
+				}
+				break;
+			case OPT_PLAN:
+				plan = 1;
+				break;
+			case OPT_CHECKPOINT:
+				checkpoint_name = optarg;
+				if (strlen(optarg) + strlen(".tmp") >= PATH_MAX) {
+					fprintf(stderr, "Checkpoint path is too long.\n");
+					usage(argv[0]);
+				}
+				break;
+			case OPT_RESUME:
+				resume = 1;
+				break;
+			case OPT_SHARD:
+				if (sscanf(optarg, "%d/%d", &shard, &num_shards) != 2 ||
+						num_shards < 1 || shard < 0 || shard >= num_shards) {
+					fprintf(stderr, "Shard should be i/N, with 0 <= i < N.\n");
+					usage(argv[0]);
+				}
+				break;
+			case OPT_PARTIAL:
+				partial_name = optarg;
+				break;
+			case OPT_CLUSTER:
+				cluster_blocks = atoi(optarg) * 1024 / INBLOCK_SIZE;
+				if (atoi(optarg) < INBLOCK_SIZE / 1024 || cluster_blocks & (cluster_blocks - 1)) {
+					fprintf(stderr, "Cluster size should be a power of two of at least %d KB.\n", INBLOCK_SIZE / 1024);
+					usage(argv[0]);
+				}
+				break;
+			case OPT_SNIFF:
+				sniff = 1;
+				break;
+			case OPT_SHARED_EXTENTS:
+				shared_extents = 1;
+				break;
+			case OPT_LEVEL:
+				replay_level = atoi(optarg);
+				if (replay_level < 0 || replay_level > 9) {
+					fprintf(stderr, "Level should be between 0 and 9.\n");
+					usage(argv[0]);
+				}
+				break;
 
 			case 'h':
 				usage(argv[0]);
@@ -752,14 +2348,53 @@ int main(int argc, char **argv)
 				return 1;
 		}
 
-	if (!dev_name)
+	if (merge ? (dev_name || replay_name || optind >= argc) : (!dev_name == !replay_name))
 		usage(argv[0]);
 
+	if (pass_through && (!dev_name || strcmp(dev_name, "-"))) {
+		fprintf(stderr, "--pass-through needs -d - (stdin).\n");
+		usage(argv[0]);
+	}
+
+	if (dedup_chunk_size && (!exhaustive || cache_name || !dev_name || !strcmp(dev_name, "-"))) {
+		fprintf(stderr, "--dedup needs -e on a device or directory, without --cache.\n");
+		usage(argv[0]);
+	}
+
+	if (plan && (!dev_name || !strcmp(dev_name, "-") || fp_name || capture_name || cache_name || time_budget_ns)) {
+		fprintf(stderr, "--plan needs a device or directory, and runs nothing else.\n");
+		usage(argv[0]);
+	}
+
+	if (checkpoint_name && (!exhaustive || !dev_name || !strcmp(dev_name, "-") || plan)) {
+		fprintf(stderr, "--checkpoint needs -e on a device or directory.\n");
+		usage(argv[0]);
+	}
+	if (num_shards && (!dev_name || !strcmp(dev_name, "-") || plan || time_budget_ns || fp_name || capture_name ||
+				(!exhaustive && (target_error || cache_name)))) {
+		fprintf(stderr, "--shard needs a device or directory, and with sampling no --target-error or --cache.\n");
+		usage(argv[0]);
+	}
+	if (cluster_blocks && (exhaustive || !dev_name || !strcmp(dev_name, "-") || plan || time_budget_ns ||
+				fp_name || capture_name || num_shards)) {
+		fprintf(stderr, "--cluster needs a device and sampling, without --plan, --time-budget, --fingerprints,\n"
+				"--capture or --shard.\n");
+		usage(argv[0]);
+	}
+	if (resume && !checkpoint_name) {
+		fprintf(stderr, "--resume needs --checkpoint.\n");
+		usage(argv[0]);
+	}
+
 	if ((num_procs < 0) || (num_procs > MAX_NUM_PROCS)) {
 		fprintf(stderr, "Number of processes should be between 0 and %d.\n", MAX_NUM_PROCS);
 		usage(argv[0]);
 	}
 
+	proc_limit = num_procs;
+	if (auto_procs && dev_name && strcmp(dev_name, "-"))
+		num_procs = auto_limit(dev_name, &proc_limit);
+
 	shared_mem_size = sizeof(struct compression_info) * (num_procs + 1);
 	comp_info_array = (struct compression_info *) mmap(NULL, shared_mem_size, PROT_READ | PROT_WRITE,
 			MAP_ANONYMOUS | MAP_SHARED, -1, 0);
@@ -773,55 +2408,257 @@ int main(int argc, char **argv)
 	memset(comp_info_array, 0, shared_mem_size);
 	memset(pid_array, 0, sizeof(pid_t) * MAX_NUM_PROCS);
 
-	if (seed_set)
-		srandom(seed);
-	else
-		srandom((unsigned int)time(NULL));
+	if (dedup_chunk_size) {
+		dedup_mem_size = sizeof(struct hll) * (num_procs + 1);
+		dedup_array = (struct hll *) mmap(NULL, dedup_mem_size, PROT_READ | PROT_WRITE,
+				MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+		if (dedup_array == (void *)-1) {
+			perror("mmap");
+			dedup_array = NULL;
+			ret = errno;
+			goto out;
+		}
+		memset(dedup_array, 0, dedup_mem_size);
+	}
+
+	/* The live stats need the pread latencies, so they turn on timing too */
+	if (profile_name || stats_name) {
+		profile_mem_size = sizeof(struct worker_profile) * num_procs;
+		profile_array = (struct worker_profile *) mmap(NULL, profile_mem_size, PROT_READ | PROT_WRITE,
+				MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+		if (profile_array == (void *)-1) {
+			perror("mmap");
+			profile_array = NULL;
+			ret = errno;
+			goto out;
+		}
+		memset(profile_array, 0, profile_mem_size);
+		cur_profile = &parent_profile;
+	}
 
 	if (ret)
 		goto out;
+
+	if (replay_name) {
+		ret = run_replay(log_name, csv_name, res_name);
+		goto out;
+	}
+	if (merge) {
+		ret = run_merge(argv + optind, argc - optind, log_name, csv_name, res_name);
+		goto out;
+	}
+
+	if (!strcmp(dev_name, "-")) {
+		SET_BINARY_MODE(stdin);
+		if (pass_through) {
+			SET_BINARY_MODE(stdout);
+			pass_fd = dup(STDOUT_FILENO);
+			if (pass_fd == -1) {
+				perror("dup");
+				ret = errno;
+				goto out;
+			}
+			/* Keep our own output out of the data */
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+		}
+		ret = init_log_files(log_name, csv_name, res_name, exhaustive);
+		start_ns = cpe_now_ns();
+		if (stats_name) {
+			ret = stats_init(exhaustive);
+			if (ret)
+				goto out;
+		}
+		ret = run_stream(exhaustive, (seed_set ? seed : (uint64_t)time(NULL)), pass_fd);
+		if (pass_fd != -1)
+			close(pass_fd);
+		goto out;
+	}
 	
-	dev_size = get_dev_size();
-	num_chunks = (int)(dev_size / INBLOCK_SIZE); //1MB size gives 2PB on 32-bit system
+	dir_mode = (stat(dev_name, &st) == 0) && S_ISDIR(st.st_mode);
+	if (cache_name && !dir_mode) {
+		fprintf(stderr, "--cache needs -d <directory>.\n");
+		usage(argv[0]);
+	}
+	if (checkpoint_name && dir_mode && (cache_name || dedup_chunk_size)) {
+		fprintf(stderr, "--checkpoint of a directory is a cache of its own, without --cache or --dedup.\n");
+		usage(argv[0]);
+	}
+	if (time_budget_ns && (dir_mode || exhaustive)) {
+		fprintf(stderr, "--time-budget needs a device and sampling (no -e).\n");
+		usage(argv[0]);
+	}
+	if ((fp_name || capture_name) && (dir_mode || exhaustive)) {
+		fprintf(stderr, "--fingerprints and --capture need a device and sampling (no -e).\n");
+		usage(argv[0]);
+	}
+	if (cluster_blocks && dir_mode) {
+		fprintf(stderr, "--cluster needs a device.\n");
+		usage(argv[0]);
+	}
+	if ((sniff || shared_extents) && !dir_mode) {
+		fprintf(stderr, "--sniff and --shared-extents need a directory.\n");
+		usage(argv[0]);
+	}
+
+	if (dir_mode) {
+		ret = dir_init(exhaustive, (seed_set ? seed : (uint64_t)time(NULL)));
+		if (ret)
+			goto out;
+	} else {
+		dev_size = cpe_get_dev_size(dev_name);
+		if (dev_size == -1)
+			perror(dev_name);
+
+		if (dev_size / INBLOCK_SIZE < 1) {
+			fprintf(stderr, "Error: device size is too small\n");
+			goto out;
+		}
+
+		cpe_sampler_init(&sampler, dev_size, exhaustive, (seed_set ? seed : (uint64_t)time(NULL)), target_error);
+		shard_total_size = dev_size;
+		if (num_shards) {
+			/* With --dedup the cuts fall between chunks */
+			off_t align = dedup_chunk_size ? dedup_chunk_size / INBLOCK_SIZE : 1;
+			off_t total_chunks = sampler.num_chunks;
+
+			sampler.first_chunk = total_chunks * shard / num_shards / align * align;
+			if (shard < num_shards - 1)
+				sampler.num_chunks = total_chunks * (shard + 1) / num_shards / align * align;
+			if (sampler.num_chunks <= sampler.first_chunk) {
+				fprintf(stderr, "Error: device is too small for %d shards\n", num_shards);
+				ret = -1;
+				goto out;
+			}
+			sampler.cur_chunk = sampler.first_chunk;
+			dev_size = (sampler.num_chunks - sampler.first_chunk) * INBLOCK_SIZE;
+			if (!exhaustive)
+				sampler.fixed_samples = ceil((double)SHARD_NUM_SAMPLE *
+						(sampler.num_chunks - sampler.first_chunk) / total_chunks);
+		}
+		if (cluster_blocks) {
+			if (sampler.num_chunks < cluster_blocks) {
+				fprintf(stderr, "Error: device is smaller than a cluster\n");
+				ret = -1;
+				goto out;
+			}
+			sampler.cluster_blocks = cluster_blocks;
+		}
+		if (time_budget_ns) {
+			/* The deadline ends the run, or an explicit target error */
+			sampler.max_samples = INT_MAX / (ZERO_BLOCK_FACTOR + 1);
+			if (!target_error)
+				sampler.target_error = 0;
+		}
+
+		if (fp_name || capture_name) {
+			ret = fp_init();
+			if (ret)
+				goto out;
+		}
+
+		if (checkpoint_name) {
+			ckpt.magic = CHECKPOINT_MAGIC;
+			ckpt.version = CHECKPOINT_VERSION;
+			ckpt.dev_size = dev_size;
+			ckpt.dedup_chunk_size = dedup_chunk_size;
+			ckpt.done_blocks = sampler.first_chunk;
+			if (resume) {
+				ret = checkpoint_load();
+				if (ret)
+					goto out;
+			}
+		}
+	}
 
-	if (num_chunks < 1) {
-		fprintf(stderr, "Error: device size is too small\n");
+	if (plan) {
+		ret = run_plan(exhaustive, (seed_set ? seed : (uint64_t)time(NULL)));
 		goto out;
 	}
 
+	numa_init(dev_name);
+
 	if (exhaustive)
 		pattern = (off_t *) malloc(sizeof(off_t) * (COMP_UNIT_SIZE / INBLOCK_SIZE));
 	else
 		pattern = (off_t *) malloc(sizeof(off_t) * BLOCKS_PER_PROC);
 
 	ret = init_log_files(log_name, csv_name, res_name, exhaustive);
+	if (dir_mode)
+		fprintf(stderr, "Files: %zu (%zu unchanged in the cache, %zu hard links and %.1f MB of shared extents counted once)\n\n",
+				dir.num_files, dir_cached, dir.num_links, (double)dir.shared_bytes / 1048576);
+
+	start_ns = cpe_now_ns();
+	climb.t0 = start_ns;
+	ckpt_last_ns = start_ns;
+	ckpt_ready = 1;
+	climb.dir = 1;
+
+	if (stats_name) {
+		ret = stats_init(exhaustive);
+		if (ret)
+			goto out;
+	}
 
-	start_time = time(NULL);
+	if (time_budget_ns) {
+		struct itimerval timer;
+
+		deadline_ns = start_ns + time_budget_ns;
+		memset(&timer, 0, sizeof(timer));
+		timer.it_value.tv_sec = time_budget_ns / 1000000000ULL;
+		timer.it_value.tv_usec = (time_budget_ns % 1000000000ULL) / 1000;
+		/* Children inherit the SIGUSR1 handler, so it is there before the
+		 * first signal can reach them */
+		signal(SIGUSR1, child_stop_handler);
+		signal(SIGALRM, deadline_handler);
+		setitimer(ITIMER_REAL, &timer, NULL);
+	}
+	sigemptyset(&alarm_set);
+	sigaddset(&alarm_set, SIGALRM);
 
-	while ((pattern_size = get_pattern(pattern, exhaustive, num_chunks, active_procs, &comp_info_array[num_procs])))
+	while ((pattern_size = get_pattern(pattern, exhaustive, active_procs, &comp_info_array[num_procs])))
 	{
-		debug_print("active: %d, total: %d\n", active_procs, num_procs);
-		if (active_procs >= num_procs) {
+		debug_print("active: %d, total: %d\n", active_procs, proc_limit);
+		/* -p auto may have lowered the limit below what runs */
+		while (active_procs >= proc_limit) {
 			ret = wait_for_process();
 			if (ret == -1)
 				goto out;
 			print_status(0);
 			active_procs--;
+			if (auto_procs)
+				auto_tune(&comp_info_array[num_procs]);
+			if (checkpoint_name)
+				checkpoint_tick();
 		}
 		index = get_empty_pid_index();
 		if (index == -1) {
 			ret = -1;
 			goto out;
 		}
+		t0 = profile_start(cur_profile);
+		fork_ns[index] = cpe_now_ns();
+		child_seed = rand_next(&sampler.rng);
+		if (checkpoint_name && !dir_mode) {
+			ckpt_batch[index].start = pattern[0] / INBLOCK_SIZE;
+			ckpt_batch[index].blocks = pattern_size;
+		}
+		/* The deadline handler signals the children in pid_array: hold
+		 * SIGALRM until the new one is there */
+		sigprocmask(SIG_BLOCK, &alarm_set, &old_set);
 		pid_array[index] = fork();
 		if (pid_array[index] == -1) {
 			perror("fork");
 			ret = errno;
+			sigprocmask(SIG_SETMASK, &old_set, NULL);
 			goto out;
 		} else if (pid_array[index] == 0) {
-			child(pattern, pattern_size, exhaustive, &comp_info_array[index]);
+			sigprocmask(SIG_SETMASK, &old_set, NULL);
+			child(pattern, pattern_size, exhaustive, index);
 		}
+		sigprocmask(SIG_SETMASK, &old_set, NULL);
+		profile_end(cur_profile, PHASE_FORK, t0);
 		active_procs++;
+		forked++;
 	}
 
 	while (active_procs) {
@@ -830,11 +2667,78 @@ int main(int argc, char **argv)
 			goto out;
 		print_status(0);
 		active_procs--;
+		if (checkpoint_name)
+			checkpoint_tick();
+	}
+
+	/* Done: nothing left to resume */
+	ckpt_ready = 0;
+	if (checkpoint_name)
+		unlink(checkpoint_name);
+
+	if (auto_procs && forked) {
+		if (climb.rate)
+			fprintf(stderr, "Auto: ended at %d of %d processes (%.0f blocks/s)\n", proc_limit, num_procs, climb.rate);
+		else
+			fprintf(stderr, "Auto: ended at %d of %d processes (too short to tune)\n", proc_limit, num_procs);
+	}
+
+	if (time_budget_ns) {
+		struct itimerval timer;
+
+		memset(&timer, 0, sizeof(timer));
+		setitimer(ITIMER_REAL, &timer, NULL);
+		fprintf(stderr, "Time budget: %d samples in %.2f of %.2f seconds\n",
+				comp_info_array[num_procs].num_zero_blocks + comp_info_array[num_procs].num_non_zero_blocks,
+				(double)(cpe_now_ns() - start_ns) / 1e9, (double)time_budget_ns / 1e9);
+	}
+
+	/* Everything came from the cache */
+	if (dir_mode && !forked)
+		print_status(0);
+
+	if (fp_name) {
+		size_t reused = 0, i;
+
+		for (i = 0; i < fp_count; i++)
+			if (fp_array[i].flags & FP_REUSED)
+				reused++;
+		fprintf(stderr, "Fingerprints: %zu of %zu samples unchanged since the last run\n", reused, fp_count);
+	}
+
+	if (dir_mode && sniff) {
+		uint64_t sniffed_bytes = 0;
+		size_t sniffed = 0, i;
+
+		for (i = 0; i < dir.num_files; i++)
+			if (dir.files[i].state == DIR_FILE_SNIFFED) {
+				sniffed++;
+				sniffed_bytes += dir.files[i].size;
+			}
+		fprintf(stderr, "Sniffed: %zu files and %.1f MB in compressed formats, scored from one sample each\n",
+				sniffed, (double)sniffed_bytes / 1048576);
+	}
+
+	if (partial_name)
+		ret = partial_save(exhaustive);
+	if (capture_name && !ret)
+		ret = capture_save();
+	if (fp_name && !ret)
+		ret = fp_save();
+
+	if (dir_mode && cache_name) {
+		ret = cpe_dir_cache_save(cache_name, &dir, exhaustive);
+		if (ret)
+			perror(cache_name);
 	}
 
 out:
 	if (pattern)
 		free(pattern);
+	if (dir_mode)
+		cpe_dir_scan_free(&dir);
+	if (fp_array)
+		munmap(fp_array, fp_mem_size);
 	cleanup_handler(0);
 	return ret;
 }
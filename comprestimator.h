@@ -0,0 +1,103 @@
+/* libcomprestimator -- embeddable compression ratio estimator
+ *
+ * An estimation context samples one source (device, file) in the calling
+ * thread. Contexts share no state, so many of them can run concurrently on
+ * different threads; a single context must not be stepped from two threads at
+ * once, but comprestimator_snapshot() may be called from any thread while it
+ * runs. Functions return COMPRESTIMATOR_OK (0) or a negative error code and
+ * never exit the process.
+ */
+#ifndef COMPRESTIMATOR_H
+#define COMPRESTIMATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define COMPRESTIMATOR_API_VERSION	1
+
+enum comprestimator_status {
+	COMPRESTIMATOR_OK = 0,
+	COMPRESTIMATOR_DONE = 1,		//comprestimator_step: estimation finished
+	COMPRESTIMATOR_EINVAL = -1,		//invalid argument
+	COMPRESTIMATOR_ENOMEM = -2,		//out of memory
+	COMPRESTIMATOR_EIO = -3,		//open/read of the source failed (see errno)
+	COMPRESTIMATOR_EZLIB = -4,		//compressor failure
+	COMPRESTIMATOR_ETOOSMALL = -5,		//source smaller than one block
+};
+
+typedef struct comprestimator_ctx comprestimator_ctx;
+
+struct comprestimator_options {
+	uint64_t seed;			//PRNG seed, 0 for a time based seed
+	int exhaustive;			//compress every block instead of sampling
+	double target_error;		//stop once the error bounds are within this fraction, 0 for the default
+};
+
+struct comprestimator_result {
+	uint64_t dev_size;		//bytes
+	uint64_t zero_blocks;
+	uint64_t non_zero_blocks;
+	uint64_t blocks_read;
+	double non_zero_frac;		//fraction of non-zero blocks
+	double conf_zeros;		//+- bound on non_zero_frac
+	double comp_frac;		//compressed/original size of the non-zero data
+	double conf_comp;		//+- bound on comp_frac
+	double variance;		//sample variance of the compression ratio
+	int done;			//the estimation has finished
+};
+
+void comprestimator_default_options(struct comprestimator_options *opts);
+
+/* Create a context for the source at path (opts may be NULL for defaults) */
+int comprestimator_open(comprestimator_ctx **ctx, const char *path, const struct comprestimator_options *opts);
+
+/* The same for a source the caller has open as fd (the context keeps a
+ * duplicate, fd stays the caller's) */
+int comprestimator_open_fd(comprestimator_ctx **ctx, int fd, const struct comprestimator_options *opts);
+
+/* Sample one batch. Returns COMPRESTIMATOR_OK while there is more to do,
+ * COMPRESTIMATOR_DONE once the estimate is final, or an error. */
+int comprestimator_step(comprestimator_ctx *ctx);
+
+/* Step until done */
+int comprestimator_run(comprestimator_ctx *ctx);
+
+/* Current estimate; safe to call concurrently with comprestimator_step() */
+int comprestimator_snapshot(comprestimator_ctx *ctx, struct comprestimator_result *res);
+
+void comprestimator_close(comprestimator_ctx *ctx);
+
+/* Streaming estimation of data that is passed through rather than read from a
+ * seekable source (backup or replication streams, pipes). The caller pushes
+ * buffers as they go by; the stream is cut in 64 KB windows and
+ * only a random subset of them is copied and compressed. The subset is
+ * thinned as the stream grows, so the sampling work is logarithmic in the
+ * stream length and the result memory is bounded. With opts->exhaustive every
+ * window is compressed. opts->target_error does not apply to streams. */
+typedef struct comprestimator_stream comprestimator_stream;
+
+int comprestimator_stream_open(comprestimator_stream **st, const struct comprestimator_options *opts);
+
+/* Account len bytes of the stream */
+int comprestimator_stream_push(comprestimator_stream *st, const void *buf, size_t len);
+
+/* The stream ended: sample the last partial window. No push may follow. */
+int comprestimator_stream_finish(comprestimator_stream *st);
+
+/* Current estimate (dev_size is the number of bytes pushed); safe to call
+ * concurrently with comprestimator_stream_push() */
+int comprestimator_stream_snapshot(comprestimator_stream *st, struct comprestimator_result *res);
+
+void comprestimator_stream_close(comprestimator_stream *st);
+
+const char *comprestimator_strerror(int status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
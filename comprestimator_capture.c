@@ -0,0 +1,214 @@
+/* Capture files: the raw data of the samples of a run, kept so that other
+ * compressor settings can be evaluated on it offline, at memory speed and
+ * without access to the origin.
+ */
+
+#define _LARGE_FILES
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "zlib.h"
+#include "comprestimator_int.h"
+
+#define CAPTURE_ALIGN		4096	//Alignment of the data of the samples
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	const unsigned char *p = (const unsigned char *) buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, p, len, off);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return COMPRESTIMATOR_EIO;
+		}
+		p += ret;
+		off += ret;
+		len -= ret;
+	}
+	return COMPRESTIMATOR_OK;
+}
+
+/* Write the samples (those with blocks) to a capture file at path, reading
+ * their data again from fd. The file is replaced atomically. */
+int cpe_capture_write(const char *path, const char *origin, int fd, off_t dev_size,
+		struct sample_fingerprint *samples, size_t num_samples)
+{
+	struct capture_header hdr;
+	struct capture_record *records;
+	unsigned char block[INBLOCK_SIZE];
+	char tmp_path[PATH_MAX];
+	uint64_t data_size = 0;
+	size_t i, n = 0;
+	uint32_t b;
+	ssize_t bytes_read;
+	int out;
+	int ret = COMPRESTIMATOR_OK;
+
+	records = (struct capture_record *) calloc(num_samples + 1, sizeof(struct capture_record));
+	if (!records)
+		return COMPRESTIMATOR_ENOMEM;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CAPTURE_MAGIC;
+	hdr.version = CAPTURE_VERSION;
+	hdr.record_size = sizeof(struct capture_record);
+	hdr.dev_size = dev_size;
+	strncpy(hdr.origin, origin, CAPTURE_ORIGIN_LEN - 1);
+	for (i = 0; i < num_samples; i++)
+		if (samples[i].blocks)
+			hdr.num_records++;
+	hdr.data_off = (sizeof(hdr) + hdr.num_records * sizeof(struct capture_record) + CAPTURE_ALIGN - 1) &
+			~(uint64_t)(CAPTURE_ALIGN - 1);
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out == -1) {
+		free(records);
+		return COMPRESTIMATOR_EIO;
+	}
+
+	for (i = 0; i < num_samples && !ret; i++) {
+		struct sample_fingerprint *fp = &samples[i];
+		struct capture_record *rec;
+
+		if (!fp->blocks)
+			continue;
+		rec = &records[n++];
+		rec->offset = fp->offset;
+		rec->data = data_size;
+		rec->blocks = fp->blocks;
+		rec->start = fp->start;
+		if (fp->ratio < 0)
+			continue;
+		for (b = 0; b < fp->blocks && !ret; b++) {
+			bytes_read = pread(fd, block, INBLOCK_SIZE, fp->offset + (off_t)b * INBLOCK_SIZE);
+			if (bytes_read == -1) {
+				ret = COMPRESTIMATOR_EIO;
+				break;
+			}
+			if (bytes_read < INBLOCK_SIZE)
+				memset(block + bytes_read, 0, INBLOCK_SIZE - bytes_read);
+			/* The compressor skips the zero blocks after the first */
+			if (b && cpe_is_zero_block((char *) block))
+				continue;
+			ret = pwrite_full(out, block, INBLOCK_SIZE, hdr.data_off + data_size);
+			data_size += INBLOCK_SIZE;
+			rec->data_blocks++;
+		}
+	}
+	hdr.data_size = data_size;
+
+	if (!ret)
+		ret = pwrite_full(out, records, n * sizeof(struct capture_record), sizeof(hdr));
+	if (!ret)
+		ret = pwrite_full(out, &hdr, sizeof(hdr), 0);
+	if (!ret && fsync(out) == -1)
+		ret = COMPRESTIMATOR_EIO;
+	if (close(out) == -1 && !ret)
+		ret = COMPRESTIMATOR_EIO;
+	if (!ret && rename(tmp_path, path) == -1)
+		ret = COMPRESTIMATOR_EIO;
+	if (ret)
+		unlink(tmp_path);
+	free(records);
+	return ret;
+}
+
+int cpe_capture_open(struct capture *cap, const char *path)
+{
+	struct capture_header *hdr;
+	struct stat st;
+	int fd;
+
+	memset(cap, 0, sizeof(struct capture));
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return COMPRESTIMATOR_EIO;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return COMPRESTIMATOR_EIO;
+	}
+	if ((size_t)st.st_size < sizeof(struct capture_header)) {
+		close(fd);
+		return COMPRESTIMATOR_EINVAL;
+	}
+
+	hdr = (struct capture_header *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == (void *)-1)
+		return COMPRESTIMATOR_EIO;
+	if (hdr->magic != CAPTURE_MAGIC || hdr->version != CAPTURE_VERSION ||
+			hdr->record_size != sizeof(struct capture_record) ||
+			sizeof(struct capture_header) + hdr->num_records * sizeof(struct capture_record) > hdr->data_off ||
+			hdr->data_off + hdr->data_size > (uint64_t)st.st_size) {
+		munmap(hdr, st.st_size);
+		return COMPRESTIMATOR_EINVAL;
+	}
+
+	cap->hdr = hdr;
+	cap->records = (struct capture_record *) (hdr + 1);
+	cap->data = (unsigned char *) hdr + hdr->data_off;
+	cap->map_size = st.st_size;
+	return COMPRESTIMATOR_OK;
+}
+
+void cpe_capture_close(struct capture *cap)
+{
+	if (cap->hdr)
+		munmap(cap->hdr, cap->map_size);
+	memset(cap, 0, sizeof(struct capture));
+}
+
+/* Compress the captured samples again at the given zlib level, counting the
+ * results in info */
+int cpe_capture_replay(struct capture *cap, int level, struct compression_info *info)
+{
+	unsigned char outbuf[OUTBLOCK_SIZE];
+	struct capture_record *rec;
+	struct buf_pool pool;
+	z_stream strm;
+	double ratio;
+	uint64_t i;
+	int ret = COMPRESTIMATOR_OK;
+
+	memset(&strm, 0, sizeof(strm));
+	cpe_pool_init(&pool);
+	cpe_pool_zstream(&pool, &strm);
+	if (deflateInit(&strm, level) != Z_OK) {
+		cpe_pool_destroy(&pool);
+		return COMPRESTIMATOR_EZLIB;
+	}
+
+	for (i = 0; i < cap->hdr->num_records && !ret; i++) {
+		rec = &cap->records[i];
+		info->total_blocks_read += rec->blocks;
+		if (!rec->data_blocks) {
+			info->num_zero_blocks++;
+			continue;
+		}
+		if (rec->start >= INBLOCK_SIZE || rec->data + (uint64_t)rec->data_blocks * INBLOCK_SIZE > cap->hdr->data_size) {
+			ret = COMPRESTIMATOR_EINVAL;
+			break;
+		}
+		ret = cpe_compress_blocks_mem(&strm, outbuf, cap->data + rec->data, rec->data_blocks, rec->start, &ratio);
+		if (ret)
+			break;
+		info->num_non_zero_blocks++;
+		cpe_moments_add(&info->ratio, ratio);
+	}
+
+	deflateEnd(&strm);
+	cpe_pool_destroy(&pool);
+	return ret;
+}
@@ -0,0 +1,1181 @@
+/* Directory mode: estimate the regular files under a directory, keeping the
+ * statistics of every file in a cache so that later runs only sample the
+ * files that changed.
+ *
+ * Every file is sampled at the same rate (samples per block), so the
+ * statistics of different files, and of different runs at the same rate, can
+ * simply be added up. The rate is stored in the cache and reused while the
+ * amount of data stays within a factor of DIR_CACHE_RATE_SLACK of the run
+ * that wrote it.
+ */
+
+#define _LARGE_FILES
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/magic.h>
+#include <linux/btrfs.h>
+#include <linux/io_uring.h>
+#include "zlib.h"
+#include "comprestimator_int.h"
+
+#define DIR_INITIAL_FILES	1024
+#define DIR_INITIAL_NAMES	65536
+#define DIR_CACHE_RATE_SLACK	4	//Reuse the rate of the cache up to this factor off
+#define FIEMAP_EXTENTS		32	//Extents asked for per FIEMAP call
+
+static inline uint64_t file_blocks(struct dir_file *f)
+{
+	return (f->size + INBLOCK_SIZE - 1) / INBLOCK_SIZE;
+}
+
+/* Blocks of f not estimated with another file */
+static inline uint64_t file_unique_blocks(struct dir_file *f)
+{
+	return file_blocks(f) - f->shared_blocks;
+}
+
+static inline uint64_t file_unique_size(struct dir_file *f)
+{
+	return f->size - min(f->size, f->shared_blocks * INBLOCK_SIZE);
+}
+
+/* The block of f of the given index among its unique blocks */
+static uint64_t file_unique_block(struct dir_scan *scan, struct dir_file *f, uint64_t index)
+{
+	struct dir_range *r = &scan->shared[f->shared];
+	uint32_t i;
+
+	for (i = 0; i < f->num_shared && r[i].start <= index; i++)
+		index += r[i].end - r[i].start;
+	return index;
+}
+
+static inline int64_t stat_ns(struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static int dir_add_file(struct dir_scan *scan, const char *path, size_t path_len, struct stat *st)
+{
+	struct dir_file *f;
+	void *tmp;
+
+	if (scan->num_files == scan->max_files) {
+		scan->max_files = scan->max_files ? scan->max_files * 2 : DIR_INITIAL_FILES;
+		tmp = realloc(scan->files, scan->max_files * sizeof(struct dir_file));
+		if (!tmp)
+			return COMPRESTIMATOR_ENOMEM;
+		scan->files = (struct dir_file *) tmp;
+	}
+	while (scan->names_len + path_len + 1 > scan->names_size) {
+		scan->names_size = scan->names_size ? scan->names_size * 2 : DIR_INITIAL_NAMES;
+		tmp = realloc(scan->names, scan->names_size);
+		if (!tmp)
+			return COMPRESTIMATOR_ENOMEM;
+		scan->names = (char *) tmp;
+	}
+
+	f = &scan->files[scan->num_files++];
+	memset(f, 0, sizeof(struct dir_file));
+	f->dev = st->st_dev;
+	f->ino = st->st_ino;
+	f->physical = UINT64_MAX;
+	f->size = st->st_size;
+	f->mtime_ns = stat_ns(&st->st_mtim);
+	f->ctime_ns = stat_ns(&st->st_ctim);
+	f->path = scan->names_len;
+	memcpy(scan->names + scan->names_len, path, path_len + 1);
+	scan->names_len += path_len + 1;
+	scan->total_bytes += st->st_size;
+	return COMPRESTIMATOR_OK;
+}
+
+static void statx_to_stat(struct statx *sx, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_mode = sx->stx_mode;
+	st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+	st->st_ino = sx->stx_ino;
+	st->st_size = sx->stx_size;
+	st->st_mtim.tv_sec = sx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = sx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+/* The names of up to STATX_BATCH entries of a directory, and their stats */
+struct walk_batch {
+	char names[STATX_BATCH][NAME_MAX + 1];
+	struct statx stx[STATX_BATCH];
+	int32_t res[STATX_BATCH];
+};
+
+/* statx the n entries of wb in dir at once through ring. Fails only when
+ * the ring does, then the caller tears it down and falls back to lstat. */
+static int walk_statx(struct uring *ring, DIR *dir, struct walk_batch *wb, int n)
+{
+	struct io_uring_sqe *sqe;
+	uint64_t user_data;
+	int32_t res;
+	int i, done = 0;
+
+	for (i = 0; i < n; i++) {
+		sqe = cpe_uring_sqe(ring);
+		if (!sqe)
+			return COMPRESTIMATOR_EIO;
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = dirfd(dir);
+		sqe->addr = (uint64_t)(uintptr_t) wb->names[i];
+		sqe->len = STATX_BASIC_STATS;
+		sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+		sqe->off = (uint64_t)(uintptr_t) &wb->stx[i];
+		sqe->user_data = i;
+	}
+	if (cpe_uring_submit(ring, n))
+		return COMPRESTIMATOR_EIO;
+	while (done < n) {
+		if (!cpe_uring_reap(ring, &user_data, &res)) {
+			if (cpe_uring_submit(ring, 1))
+				return COMPRESTIMATOR_EIO;
+			continue;
+		}
+		wb->res[user_data] = res;
+		done++;
+	}
+	return COMPRESTIMATOR_OK;
+}
+
+/* Add the files under path (of length len, in a PATH_MAX buffer). The
+ * entries are stat'ed in batches through *ring when there is one. When the
+ * ring fails it is exited, so that no late completion lands in a batch, and
+ * *ring is cleared for the rest of the walk. */
+static int dir_walk(struct dir_scan *scan, struct uring **ring, char *path, size_t len)
+{
+	struct walk_batch *wb;
+	struct dirent *de;
+	struct stat st;
+	size_t name_len;
+	DIR *dir;
+	int i, n, err, statted, ret = COMPRESTIMATOR_OK;
+
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "Warning: skipping %s: %s\n", path, strerror(errno));
+		return COMPRESTIMATOR_OK;
+	}
+	wb = (struct walk_batch *) malloc(sizeof(struct walk_batch));
+	if (!wb) {
+		closedir(dir);
+		return COMPRESTIMATOR_ENOMEM;
+	}
+
+	while (!ret) {
+		n = 0;
+		while (n < STATX_BATCH && (de = readdir(dir))) {
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			name_len = strlen(de->d_name);
+			if (len + 1 + name_len >= PATH_MAX) {
+				fprintf(stderr, "Warning: skipping %s/%s: path too long\n", path, de->d_name);
+				continue;
+			}
+			memcpy(wb->names[n++], de->d_name, name_len + 1);
+		}
+		if (!n)
+			break;
+		statted = 0;
+		if (*ring) {
+			if (walk_statx(*ring, dir, wb, n)) {
+				cpe_uring_exit(*ring);
+				*ring = NULL;
+			} else {
+				statted = 1;
+			}
+		}
+
+		for (i = 0; i < n && !ret; i++) {
+			name_len = strlen(wb->names[i]);
+			path[len] = '/';
+			memcpy(path + len + 1, wb->names[i], name_len + 1);
+
+			/* Symbolic links are not followed */
+			err = 0;
+			if (statted && wb->res[i] < 0)
+				err = -wb->res[i];
+			else if (statted)
+				statx_to_stat(&wb->stx[i], &st);
+			else if (lstat(path, &st) == -1)
+				err = errno;
+			if (err) {
+				fprintf(stderr, "Warning: skipping %s: %s\n", path, strerror(err));
+			} else if (S_ISDIR(st.st_mode)) {
+				ret = dir_walk(scan, ring, path, len + 1 + name_len);
+			} else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+				ret = dir_add_file(scan, path, len + 1 + name_len, &st);
+			}
+			path[len] = '\0';
+		}
+	}
+
+	free(wb);
+	closedir(dir);
+	return ret;
+}
+
+/* Orders files by (dev, ino), then path, for dir_links */
+static int link_cmp(const void *a, const void *b, void *arg)
+{
+	struct dir_scan *scan = (struct dir_scan *) arg;
+	struct dir_file *fa = &scan->files[*(const size_t *) a];
+	struct dir_file *fb = &scan->files[*(const size_t *) b];
+
+	if (fa->dev != fb->dev)
+		return (fa->dev < fb->dev) ? -1 : 1;
+	if (fa->ino != fb->ino)
+		return (fa->ino < fb->ino) ? -1 : 1;
+	return strcmp(cpe_dir_file_path(scan, fa), cpe_dir_file_path(scan, fb));
+}
+
+/* Keep one path of every file with hard links, the first in the order of
+ * the paths, so that every node of a sharded run keeps the same one */
+static int dir_links(struct dir_scan *scan)
+{
+	size_t *idx;
+	size_t i;
+
+	idx = (size_t *) malloc((scan->num_files + 1) * sizeof(size_t));
+	if (!idx)
+		return COMPRESTIMATOR_ENOMEM;
+	for (i = 0; i < scan->num_files; i++)
+		idx[i] = i;
+	qsort_r(idx, scan->num_files, sizeof(size_t), link_cmp, scan);
+	for (i = 1; i < scan->num_files; i++) {
+		struct dir_file *f = &scan->files[idx[i]];
+		struct dir_file *prev = &scan->files[idx[i - 1]];
+
+		if (f->dev != prev->dev || f->ino != prev->ino)
+			continue;
+		f->state = DIR_FILE_DUPLICATE;
+		scan->total_bytes -= f->size;
+		scan->num_links++;
+	}
+	free(idx);
+	return COMPRESTIMATOR_OK;
+}
+
+/* A shared extent of a file, or the part of it that dir_extents left out */
+struct shared_extent {
+	uint64_t fs;			//file system of the physical address (file_fs)
+	uint64_t physical;
+	uint64_t logical;
+	uint64_t length;
+	size_t file;
+};
+
+static int shared_physical_cmp(const void *a, const void *b, void *arg)
+{
+	const struct shared_extent *ea = (const struct shared_extent *) a;
+	const struct shared_extent *eb = (const struct shared_extent *) b;
+	struct dir_scan *scan = (struct dir_scan *) arg;
+
+	if (ea->fs != eb->fs)
+		return (ea->fs < eb->fs) ? -1 : 1;
+	if (ea->physical != eb->physical)
+		return (ea->physical < eb->physical) ? -1 : 1;
+	if (ea->file == eb->file)
+		return 0;
+	return strcmp(cpe_dir_file_path(scan, &scan->files[ea->file]), cpe_dir_file_path(scan, &scan->files[eb->file]));
+}
+
+static int shared_logical_cmp(const void *a, const void *b)
+{
+	const struct shared_extent *ea = (const struct shared_extent *) a;
+	const struct shared_extent *eb = (const struct shared_extent *) b;
+
+	if (ea->file != eb->file)
+		return (ea->file < eb->file) ? -1 : 1;
+	if (ea->logical != eb->logical)
+		return (ea->logical < eb->logical) ? -1 : 1;
+	return 0;
+}
+
+/* The device number of the last file and the file system it is on */
+struct fs_cache {
+	uint64_t dev;
+	uint64_t fs;
+};
+
+/* The file system whose physical addresses the extents of the file open as
+ * fd (on device dev) are in. That is dev, except on btrfs, which gives every
+ * subvolume and snapshot a device number of its own while their extents
+ * share one address space: there it is the UUID of the file system. */
+static uint64_t file_fs(int fd, uint64_t dev, struct fs_cache *fc)
+{
+	struct btrfs_ioctl_fs_info_args info;
+	struct statfs sfs;
+	uint64_t a, b;
+
+	if (fc->dev == dev)
+		return fc->fs;
+	fc->dev = dev;
+	fc->fs = dev;
+	memset(&info, 0, sizeof(info));
+	if (fstatfs(fd, &sfs) == 0 && sfs.f_type == BTRFS_SUPER_MAGIC &&
+			ioctl(fd, BTRFS_IOC_FS_INFO, &info) == 0) {
+		memcpy(&a, info.fsid, sizeof(a));
+		memcpy(&b, info.fsid + sizeof(a), sizeof(b));
+		fc->fs = a ^ b;
+	}
+	return fc->fs;
+}
+
+/* Add the extents of f flagged as shared (reflinks, clones, snapshots) to
+ * *ext, and set where its data starts for dir_order. Files whose layout
+ * the file system does not tell are left as they are. */
+static int file_extents(struct dir_scan *scan, size_t file, struct fs_cache *fc,
+		struct shared_extent **ext, size_t *num_ext, size_t *max_ext)
+{
+	struct dir_file *f = &scan->files[file];
+	struct {
+		struct fiemap map;
+		struct fiemap_extent extents[FIEMAP_EXTENTS];
+	} fm;
+	struct fiemap_extent *e;
+	uint64_t start = 0;
+	uint32_t i;
+	void *tmp;
+	int fd, last = 0;
+
+	fd = open(cpe_dir_file_path(scan, f), O_RDONLY);
+	if (fd == -1)
+		return COMPRESTIMATOR_OK;
+	while (!last && start < f->size) {
+		memset(&fm, 0, sizeof(fm));
+		fm.map.fm_start = start;
+		fm.map.fm_length = FIEMAP_MAX_OFFSET - start;
+		fm.map.fm_extent_count = FIEMAP_EXTENTS;
+		if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == -1 || !fm.map.fm_mapped_extents)
+			break;
+		for (i = 0; i < fm.map.fm_mapped_extents; i++) {
+			e = &fm.extents[i];
+			last = e->fe_flags & FIEMAP_EXTENT_LAST;
+			start = e->fe_logical + e->fe_length;
+			/* Without a physical address of its own, an extent can
+			 * neither be placed nor matched */
+			if (e->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_ENCODED |
+						FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED))
+				continue;
+			if (f->physical == UINT64_MAX)
+				f->physical = e->fe_physical;
+			if (!(e->fe_flags & FIEMAP_EXTENT_SHARED))
+				continue;
+			if (*num_ext == *max_ext) {
+				*max_ext = *max_ext ? *max_ext * 2 : DIR_INITIAL_FILES;
+				tmp = realloc(*ext, *max_ext * sizeof(struct shared_extent));
+				if (!tmp) {
+					close(fd);
+					return COMPRESTIMATOR_ENOMEM;
+				}
+				*ext = (struct shared_extent *) tmp;
+			}
+			(*ext)[*num_ext].fs = file_fs(fd, f->dev, fc);
+			(*ext)[*num_ext].physical = e->fe_physical;
+			(*ext)[*num_ext].logical = e->fe_logical;
+			(*ext)[*num_ext].length = e->fe_length;
+			(*ext)[*num_ext].file = file;
+			(*num_ext)++;
+		}
+	}
+	close(fd);
+	return COMPRESTIMATOR_OK;
+}
+
+/* Walk the extents of every file (FIEMAP). Data shared by several files is
+ * estimated once: each physical range goes to the first file that has it,
+ * by path, and the other files leave the blocks of that range out. A file
+ * left with no blocks of its own becomes a duplicate, like a hard link. */
+static int dir_extents(struct dir_scan *scan)
+{
+	struct shared_extent *ext = NULL;
+	struct fs_cache fc = { UINT64_MAX, UINT64_MAX };
+	uint64_t fs = 0, claimed = 0, end, lo, hi;
+	size_t i, n = 0, num_ext = 0, max_ext = 0;
+	struct dir_file *f;
+	void *tmp;
+	int ret = COMPRESTIMATOR_OK;
+
+	for (i = 0; i < scan->num_files && !ret; i++)
+		if (scan->files[i].state != DIR_FILE_DUPLICATE)
+			ret = file_extents(scan, i, &fc, &ext, &num_ext, &max_ext);
+	if (ret || !num_ext)
+		goto out;
+
+	/* Keep, in place, the parts of extents already claimed by another */
+	qsort_r(ext, num_ext, sizeof(struct shared_extent), shared_physical_cmp, scan);
+	for (i = 0; i < num_ext; i++) {
+		if (!i || ext[i].fs != fs) {
+			fs = ext[i].fs;
+			claimed = 0;
+		}
+		end = ext[i].physical + ext[i].length;
+		if (ext[i].physical < claimed)
+			ext[n++] = (struct shared_extent) { ext[i].fs, ext[i].physical, ext[i].logical,
+					min(end, claimed) - ext[i].physical, ext[i].file };
+		if (end > claimed)
+			claimed = end;
+	}
+	if (!n)
+		goto out;
+
+	/* Into ranges of blocks of each file: the blocks that start in them */
+	qsort(ext, n, sizeof(struct shared_extent), shared_logical_cmp);
+	tmp = malloc(n * sizeof(struct dir_range));
+	if (!tmp) {
+		ret = COMPRESTIMATOR_ENOMEM;
+		goto out;
+	}
+	scan->shared = (struct dir_range *) tmp;
+	for (i = 0; i < n; i++) {
+		f = &scan->files[ext[i].file];
+		lo = (ext[i].logical + INBLOCK_SIZE - 1) / INBLOCK_SIZE;
+		hi = min((ext[i].logical + ext[i].length + INBLOCK_SIZE - 1) / INBLOCK_SIZE, file_blocks(f));
+		if (lo >= hi)
+			continue;
+		if (!f->num_shared) {
+			f->shared = scan->num_ranges;
+		} else if (lo <= scan->shared[scan->num_ranges - 1].end) {
+			/* Overlapping or adjacent to the last range of the file */
+			if (hi > scan->shared[scan->num_ranges - 1].end) {
+				f->shared_blocks += hi - scan->shared[scan->num_ranges - 1].end;
+				scan->shared[scan->num_ranges - 1].end = hi;
+			}
+			continue;
+		}
+		scan->shared[scan->num_ranges].start = lo;
+		scan->shared[scan->num_ranges].end = hi;
+		scan->num_ranges++;
+		f->num_shared++;
+		f->shared_blocks += hi - lo;
+	}
+
+	for (i = 0; i < scan->num_files; i++) {
+		f = &scan->files[i];
+		if (!f->num_shared)
+			continue;
+		scan->shared_bytes += f->size - file_unique_size(f);
+		scan->total_bytes -= f->size - file_unique_size(f);
+		if (!file_unique_blocks(f))
+			f->state = DIR_FILE_DUPLICATE;
+	}
+
+out:
+	free(ext);
+	return ret;
+}
+
+/* Find the non-empty regular files under root. With shared_extents, also
+ * walk the extents of every file to count the data they share once. */
+int cpe_dir_scan(struct dir_scan *scan, const char *root, int shared_extents)
+{
+	char path[PATH_MAX];
+	size_t len = strlen(root);
+	struct uring ring, *ringp = NULL;
+	int ret;
+
+	memset(scan, 0, sizeof(struct dir_scan));
+	scan->shared_extents = shared_extents;
+	if (len >= PATH_MAX)
+		return COMPRESTIMATOR_EINVAL;
+	memcpy(path, root, len + 1);
+	while (len > 1 && path[len - 1] == '/')
+		path[--len] = '\0';
+	if (cpe_uring_init(&ring, STATX_BATCH) == COMPRESTIMATOR_OK)
+		ringp = &ring;
+	ret = dir_walk(scan, &ringp, path, len);
+	if (ringp)
+		cpe_uring_exit(ringp);
+	if (!ret)
+		ret = dir_links(scan);
+	if (!ret && shared_extents)
+		ret = dir_extents(scan);
+	return ret;
+}
+
+/* Move the file array to shared memory, so that child processes can store
+ * the statistics of the files they sample */
+int cpe_dir_scan_share(struct dir_scan *scan)
+{
+	size_t size = scan->num_files * sizeof(struct dir_file);
+	struct dir_file *files;
+
+	if (!size)
+		return COMPRESTIMATOR_OK;
+	files = (struct dir_file *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+	if (files == (void *)-1)
+		return COMPRESTIMATOR_ENOMEM;
+	memcpy(files, scan->files, size);
+	free(scan->files);
+	scan->files = files;
+	scan->files_map_size = size;
+	return COMPRESTIMATOR_OK;
+}
+
+void cpe_dir_scan_free(struct dir_scan *scan)
+{
+	if (scan->files_map_size)
+		munmap(scan->files, scan->files_map_size);
+	else
+		free(scan->files);
+	free(scan->names);
+	free(scan->order);
+	free(scan->shared);
+	memset(scan, 0, sizeof(struct dir_scan));
+}
+
+const char *cpe_dir_file_path(struct dir_scan *scan, struct dir_file *f)
+{
+	return scan->names + f->path;
+}
+
+void cpe_file_stats_to_info(struct file_stats *fs, struct compression_info *info)
+{
+	memset(info, 0, sizeof(struct compression_info));
+	info->num_zero_blocks = fs->num_zero_blocks;
+	info->num_non_zero_blocks = fs->num_non_zero_blocks;
+	info->total_blocks_read = fs->total_blocks_read;
+	info->num_repeated_blocks = fs->num_repeated_blocks;
+	info->ratio = fs->ratio;
+}
+
+void cpe_info_to_file_stats(struct compression_info *info, struct file_stats *fs)
+{
+	memset(fs, 0, sizeof(struct file_stats));
+	fs->num_zero_blocks = info->num_zero_blocks;
+	fs->num_non_zero_blocks = info->num_non_zero_blocks;
+	fs->total_blocks_read = info->total_blocks_read;
+	fs->num_repeated_blocks = info->num_repeated_blocks;
+	fs->ratio = info->ratio;
+}
+
+static int cache_record_cmp(const void *a, const void *b)
+{
+	const struct dir_cache_record *ra = (const struct dir_cache_record *) a;
+	const struct dir_cache_record *rb = (const struct dir_cache_record *) b;
+
+	if (ra->dev != rb->dev)
+		return (ra->dev < rb->dev) ? -1 : 1;
+	if (ra->ino != rb->ino)
+		return (ra->ino < rb->ino) ? -1 : 1;
+	return 0;
+}
+
+/* The cached statistics of f, or NULL if f is not cached or has changed */
+static struct dir_cache_record *dir_cache_lookup(struct dir_cache *cache, struct dir_file *f)
+{
+	struct dir_cache_record key, *rec;
+
+	key.dev = f->dev;
+	key.ino = f->ino;
+	rec = (struct dir_cache_record *) bsearch(&key, cache->records, cache->hdr->num_records,
+			sizeof(struct dir_cache_record), cache_record_cmp);
+	if (!rec || rec->size != f->size || rec->mtime_ns != f->mtime_ns || rec->ctime_ns != f->ctime_ns)
+		return NULL;
+	return rec;
+}
+
+/* Leave the files of the other shards out, choosing by a hash of the path
+ * under root so that every node, wherever it mounts root, makes the same
+ * choice. Returns the bytes of the files of this shard. */
+uint64_t cpe_dir_shard(struct dir_scan *scan, const char *root, int shard, int num_shards)
+{
+	uint64_t bytes = 0;
+	const char *rel;
+	size_t i;
+
+	for (i = 0; i < scan->num_files; i++) {
+		struct dir_file *f = &scan->files[i];
+
+		if (f->state == DIR_FILE_DUPLICATE)
+			continue;
+		rel = cpe_dir_file_path(scan, f) + strlen(root);
+		while (*rel == '/')
+			rel++;
+		if (cpe_hash64(rel, strlen(rel), 0) % num_shards != (uint64_t)shard) {
+			f->state = DIR_FILE_OTHER_SHARD;
+			continue;
+		}
+		bytes += file_unique_size(f);
+	}
+	return bytes;
+}
+
+/* Where the data of the file at path starts on its device, from the first
+ * extent FIEMAP returns, or UINT64_MAX when the file system does not tell
+ * (no FIEMAP, or data inline, encoded or not allocated yet) */
+static uint64_t file_physical(const char *path)
+{
+	struct {
+		struct fiemap map;
+		struct fiemap_extent extent;
+	} fm;
+	uint64_t physical = UINT64_MAX;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return physical;
+	memset(&fm, 0, sizeof(fm));
+	fm.map.fm_length = FIEMAP_MAX_OFFSET;
+	fm.map.fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0 && fm.map.fm_mapped_extents &&
+			!(fm.extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_ENCODED |
+					FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED)))
+		physical = fm.extent.fe_physical;
+	close(fd);
+	return physical;
+}
+
+struct order_key {
+	uint64_t dev;
+	uint64_t physical;
+	uint64_t ino;
+	size_t file;
+};
+
+static int order_key_cmp(const void *a, const void *b)
+{
+	const struct order_key *ka = (const struct order_key *) a;
+	const struct order_key *kb = (const struct order_key *) b;
+
+	if (ka->dev != kb->dev)
+		return (ka->dev < kb->dev) ? -1 : 1;
+	if (ka->physical != kb->physical)
+		return (ka->physical < kb->physical) ? -1 : 1;
+	if (ka->ino != kb->ino)
+		return (ka->ino < kb->ino) ? -1 : 1;
+	return 0;
+}
+
+/* Schedule the files to read by where their data lies on disk (as found by
+ * dir_extents, or else asked here of only the files to read), so that the
+ * batches sweep each device instead of seeking back and forth. Files whose
+ * layout is unknown follow, by inode, which most file systems allocate near
+ * the data. Without memory for the schedule, files go in scan order. */
+static void dir_order(struct dir_scan *scan, int exhaustive)
+{
+	struct order_key *keys;
+	size_t i, n = 0;
+
+	free(scan->order);
+	scan->order = NULL;
+	scan->num_order = 0;
+	keys = (struct order_key *) malloc(scan->num_files * sizeof(struct order_key));
+	if (!keys)
+		return;
+	for (i = 0; i < scan->num_files; i++) {
+		struct dir_file *f = &scan->files[i];
+
+		if (f->state != DIR_FILE_PENDING || (!exhaustive && !f->samples))
+			continue;
+		if (!scan->shared_extents)
+			f->physical = file_physical(cpe_dir_file_path(scan, f));
+		keys[n].dev = f->dev;
+		keys[n].physical = f->physical;
+		keys[n].ino = f->ino;
+		keys[n].file = i;
+		n++;
+	}
+	qsort(keys, n, sizeof(struct order_key), order_key_cmp);
+
+	scan->order = (size_t *) malloc((n ? n : 1) * sizeof(size_t));
+	if (scan->order) {
+		for (i = 0; i < n; i++)
+			scan->order[i] = keys[i].file;
+		scan->num_order = n;
+	}
+	free(keys);
+}
+
+/* Choose the sampling rate and the number of samples of every file, taking
+ * the statistics of unchanged files from the cache (if any) into info.
+ * Returns the number of files found in the cache. */
+size_t cpe_dir_plan(struct dir_scan *scan, struct dir_cache *cache, int exhaustive, uint64_t *rng,
+		struct compression_info *info)
+{
+	struct dir_cache_record *rec;
+	struct compression_info file_info;
+	uint64_t total_blocks = 0;
+	size_t i, num_cached = 0;
+	double rate, samples;
+	int use_cache = (cache && cache->hdr);
+
+	for (i = 0; i < scan->num_files; i++)
+		if (scan->files[i].state != DIR_FILE_DUPLICATE)
+			total_blocks += file_unique_blocks(&scan->files[i]);
+
+	rate = 1;
+	if (!exhaustive && total_blocks > DIR_NUM_SAMPLE)
+		rate = (double)DIR_NUM_SAMPLE / (double)total_blocks;
+
+	if (use_cache) {
+		if (cache->hdr->exhaustive != (uint32_t)exhaustive) {
+			fprintf(stderr, "Warning: the cache is of a%s run, ignoring it\n",
+					(cache->hdr->exhaustive ? "n exhaustive" : " sampled"));
+			use_cache = 0;
+		} else if (cache->hdr->sniff != (uint32_t)scan->sniff) {
+			fprintf(stderr, "Warning: the cache is of a run %s --sniff, ignoring it\n",
+					(cache->hdr->sniff ? "with" : "without"));
+			use_cache = 0;
+		} else if (cache->hdr->rate > rate * DIR_CACHE_RATE_SLACK || cache->hdr->rate * DIR_CACHE_RATE_SLACK < rate) {
+			fprintf(stderr, "Warning: the data changed too much since the cache was written, ignoring it\n");
+			use_cache = 0;
+		} else {
+			rate = cache->hdr->rate;
+		}
+	}
+	scan->rate = rate;
+	scan->next_file = 0;
+
+	for (i = 0; i < scan->num_files; i++) {
+		struct dir_file *f = &scan->files[i];
+
+		if (f->state == DIR_FILE_OTHER_SHARD || f->state == DIR_FILE_DUPLICATE)
+			continue;
+		/* What a file shares depends on other files, keep it out of the cache */
+		if (use_cache && !f->num_shared && (rec = dir_cache_lookup(cache, f))) {
+			f->stats = rec->stats;
+			f->state = DIR_FILE_CACHED;
+			cpe_file_stats_to_info(&f->stats, &file_info);
+			cpe_info_merge(info, &file_info);
+			num_cached++;
+			continue;
+		}
+		f->state = DIR_FILE_PENDING;
+		if (exhaustive)
+			continue;
+		/* Randomized rounding keeps the expected rate exact for small files */
+		samples = rate * (double)file_unique_blocks(f);
+		f->samples = (uint32_t)samples;
+		if ((double)(rand_next(rng) >> 11) / (double)(1ULL << 53) < samples - f->samples)
+			f->samples++;
+	}
+	dir_order(scan, exhaustive);
+	return num_cached;
+}
+
+/* Fill pattern with the indices of the next files to sample: up to
+ * max_blocks samples worth of files (random), or up to COMP_UNIT_SIZE bytes
+ * of them (exhaustive), and at most max_entries files. Returns the number of
+ * files, 0 when all have been handed out. */
+int cpe_dir_next_batch(struct dir_scan *scan, off_t *pattern, int max_entries, int max_blocks, int exhaustive)
+{
+	size_t num = scan->order ? scan->num_order : scan->num_files;
+	uint64_t amount = 0;
+	size_t file;
+	int i = 0;
+
+	while (i < max_entries && scan->next_file < num) {
+		struct dir_file *f;
+
+		file = scan->order ? scan->order[scan->next_file] : scan->next_file;
+		f = &scan->files[file];
+		if (f->state != DIR_FILE_PENDING || (!exhaustive && !f->samples)) {
+			scan->next_file++;
+			continue;
+		}
+		if (i && amount + (exhaustive ? f->size : f->samples) > (exhaustive ? COMP_UNIT_SIZE : (uint64_t)max_blocks))
+			break;
+		amount += exhaustive ? f->size : f->samples;
+		pattern[i++] = file;
+		scan->next_file++;
+	}
+	return i;
+}
+
+static int off_cmp(const void *a, const void *b)
+{
+	off_t oa = *(const off_t *) a, ob = *(const off_t *) b;
+
+	return (oa < ob) ? -1 : (oa > ob);
+}
+
+/* Leading bytes of the formats whose data is compressed or encrypted already */
+struct sniff_magic {
+	uint32_t offset;
+	uint32_t len;
+	const char *magic;
+};
+
+static const struct sniff_magic sniff_magics[] = {
+	{0, 2, "\x1f\x8b"},			//gzip
+	{0, 3, "BZh"},				//bzip2
+	{0, 6, "\xfd" "7zXZ\0"},		//xz
+	{0, 4, "\x28\xb5\x2f\xfd"},		//zstd
+	{0, 4, "PK\3\4"},			//zip, and the OOXML, ODF and jar formats in it
+	{0, 6, "7z\xbc\xaf\x27\x1c"},		//7-Zip
+	{0, 6, "Rar!\x1a\x07"},			//RAR
+	{0, 3, "\xff\xd8\xff"},			//JPEG
+	{0, 8, "\x89PNG\r\n\x1a\n"},		//PNG
+	{0, 4, "GIF8"},				//GIF
+	{4, 4, "ftyp"},				//MP4, MOV, HEIC
+	{0, 4, "\x1a\x45\xdf\xa3"},		//Matroska, WebM
+	{0, 8, "Salted__"},			//openssl enc
+	{0, 6, "LUKS\xba\xbe"},			//LUKS
+	{0, 21, "age-encryption.org/v1"},	//age
+};
+
+/* Whether the file open in w starts like one of sniff_magics */
+static int file_sniff(struct comp_worker *w)
+{
+	unsigned char head[SNIFF_LEN];
+	ssize_t len;
+	size_t i;
+	uint64_t t0;
+
+	t0 = profile_start(w->profile);
+	len = cpe_worker_pread(w, head, SNIFF_LEN, 0);
+	profile_end(w->profile, PHASE_READ, t0);
+	for (i = 0; i < sizeof(sniff_magics) / sizeof(sniff_magics[0]); i++)
+		if (len >= (ssize_t)(sniff_magics[i].offset + sniff_magics[i].len) &&
+				!memcmp(head + sniff_magics[i].offset, sniff_magics[i].magic, sniff_magics[i].len))
+			return 1;
+	return 0;
+}
+
+/* Sample (or compress all of, when exhaustive) the file f and store its
+ * statistics in f */
+int cpe_dir_sample_file(struct comp_worker *w, struct dir_scan *scan, struct dir_file *f, int exhaustive)
+{
+	struct compression_info total;
+	uint64_t unique = file_unique_blocks(f);
+	uint64_t b, n;
+	off_t *pattern = NULL;
+	uint32_t i;
+	int sniffed = 0;
+	int ret;
+
+	memset(&w->info, 0, sizeof(struct compression_info));
+	/* Unless the caller read it already (cpe_dir_fetch) */
+	if (!w->mem) {
+		ret = cpe_worker_open(w, cpe_dir_file_path(scan, f));
+		if (ret) {
+			f->state = DIR_FILE_FAILED;
+			return ret;
+		}
+	}
+
+	/* A compressed format: when one sample does not compress either, it
+	 * stands for all the blocks the file would have had read. It keeps
+	 * their weight in the mean, but counts as one read and one observation. */
+	if (scan->sniff && (exhaustive ? file_unique_size(f) >= SNIFF_MIN_SIZE : f->samples > 1) &&
+			file_sniff(w)) {
+		ret = cpe_compress_chunk_random(w, file_unique_block(scan, f, rand_next(&w->rng) % unique) * INBLOCK_SIZE);
+		if (ret)
+			goto out;
+		if (w->info.ratio.n && w->info.ratio.mean >= SNIFF_MIN_RATIO) {
+			n = exhaustive ? unique : f->samples;
+			w->info.num_zero_blocks = 0;
+			w->info.num_non_zero_blocks = n;
+			w->info.total_blocks_read = 1;
+			w->info.num_repeated_blocks = n - 1;
+			w->info.ratio.n = n;
+			w->info.ratio.m2 = 0;
+			sniffed = 1;
+			goto out;
+		}
+		memset(&w->info, 0, sizeof(struct compression_info));
+	}
+
+	if (exhaustive) {
+		memset(&total, 0, sizeof(struct compression_info));
+		n = min(unique, (uint64_t)(COMP_UNIT_SIZE / INBLOCK_SIZE));
+		pattern = (off_t *) malloc(n * sizeof(off_t));
+		if (!pattern) {
+			ret = COMPRESTIMATOR_ENOMEM;
+			goto out;
+		}
+		for (b = 0; b < unique && !ret; b += n) {
+			for (i = 0; i < n && b + i < unique; i++)
+				pattern[i] = file_unique_block(scan, f, b + i) * INBLOCK_SIZE;
+			memset(&w->info, 0, sizeof(struct compression_info));
+			ret = cpe_compress_chunks_sequential(w, pattern, i);
+			cpe_info_merge(&total, &w->info);
+		}
+		/* Too little data to fill an output block: take the ratio of one
+		 * sample running to the end of the file instead */
+		if (!ret && total.num_non_zero_blocks && !total.ratio.n) {
+			memset(&w->info, 0, sizeof(struct compression_info));
+			ret = cpe_compress_chunk_random(w, file_unique_block(scan, f, 0) * INBLOCK_SIZE);
+			if (w->info.ratio.n) {
+				total.ratio.n = total.num_non_zero_blocks;
+				total.ratio.mean = w->info.ratio.mean;
+			}
+		}
+		w->info = total;
+	} else {
+		/* Ascending, the samples of a file are read in one sweep */
+		pattern = (off_t *) malloc(f->samples * sizeof(off_t));
+		if (!pattern) {
+			ret = COMPRESTIMATOR_ENOMEM;
+			goto out;
+		}
+		for (i = 0; i < f->samples; i++)
+			pattern[i] = file_unique_block(scan, f, rand_next(&w->rng) % unique) * INBLOCK_SIZE;
+		qsort(pattern, f->samples, sizeof(off_t), off_cmp);
+		for (i = 0; i < f->samples && !ret; i++)
+			ret = cpe_compress_chunk_random(w, pattern[i]);
+	}
+
+out:
+	free(pattern);
+	if (w->fd != -1)
+		close(w->fd);
+	w->fd = -1;
+	if (ret) {
+		f->state = DIR_FILE_FAILED;
+		return ret;
+	}
+	cpe_info_to_file_stats(&w->info, &f->stats);
+	f->state = sniffed ? DIR_FILE_SNIFFED : DIR_FILE_SAMPLED;
+	return COMPRESTIMATOR_OK;
+}
+
+/* Set up the ring, its fixed buffer and its table of FETCH_FILES direct
+ * descriptors. Fails when the kernel cannot, and files are then read
+ * with the system calls. */
+int cpe_dir_fetch_init(struct dir_fetch *df)
+{
+	struct iovec iov;
+	int fds[FETCH_FILES];
+	int i, ret;
+
+	memset(df, 0, sizeof(struct dir_fetch));
+	ret = cpe_uring_init(&df->ring, 4 * FETCH_FILES);
+	if (ret)
+		return ret;
+	df->buf = (unsigned char *) mmap(NULL, (size_t)FETCH_FILES * FETCH_FILE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (df->buf == (void *)-1) {
+		df->buf = NULL;
+		cpe_dir_fetch_destroy(df);
+		return COMPRESTIMATOR_ENOMEM;
+	}
+	iov.iov_base = df->buf;
+	iov.iov_len = (size_t)FETCH_FILES * FETCH_FILE_SIZE;
+	for (i = 0; i < FETCH_FILES; i++)
+		fds[i] = -1;
+	if (cpe_uring_register(&df->ring, IORING_REGISTER_BUFFERS, &iov, 1) ||
+			cpe_uring_register(&df->ring, IORING_REGISTER_FILES, fds, FETCH_FILES)) {
+		cpe_dir_fetch_destroy(df);
+		return COMPRESTIMATOR_EIO;
+	}
+	return COMPRESTIMATOR_OK;
+}
+
+void cpe_dir_fetch_destroy(struct dir_fetch *df)
+{
+	cpe_uring_exit(&df->ring);
+	if (df->buf)
+		munmap(df->buf, (size_t)FETCH_FILES * FETCH_FILE_SIZE);
+	df->buf = NULL;
+}
+
+/* Read the small files among the next num_files (at most FETCH_FILES) of
+ * files, each with an openat into a direct descriptor, a read into its slot
+ * of the fixed buffer and a close, linked, all submitted at once. df->len
+ * tells, for every one of them, how much was read, the error, or FETCH_NONE
+ * when it is to be read the usual way (too large, or grown too large).
+ * Returns the number of files covered, or a negative status when the ring
+ * fails. */
+int cpe_dir_fetch(struct dir_fetch *df, struct dir_scan *scan, off_t *files, int num_files)
+{
+	struct io_uring_sqe *sqe;
+	int32_t open_res[FETCH_FILES];
+	uint64_t user_data;
+	int32_t res;
+	int i, n = 0, pending = 0;
+
+	num_files = min(num_files, FETCH_FILES);
+	for (i = 0; i < num_files; i++) {
+		struct dir_file *f = &scan->files[files[i]];
+
+		df->len[i] = FETCH_NONE;
+		if (f->size >= FETCH_FILE_SIZE)
+			continue;
+		/* openat, linked so that the read only runs on the file */
+		sqe = cpe_uring_sqe(&df->ring);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uint64_t)(uintptr_t) cpe_dir_file_path(scan, f);
+		sqe->open_flags = O_RDONLY;
+		sqe->file_index = i + 1;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = (uint64_t)i * 3;
+		/* read the file whole, hard linked so that the close runs even
+		 * after a short read */
+		sqe = cpe_uring_sqe(&df->ring);
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->fd = i;
+		sqe->addr = (uint64_t)(uintptr_t) (df->buf + (size_t)i * FETCH_FILE_SIZE);
+		sqe->len = FETCH_FILE_SIZE;
+		sqe->buf_index = 0;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+		sqe->user_data = (uint64_t)i * 3 + 1;
+		sqe = cpe_uring_sqe(&df->ring);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->file_index = i + 1;
+		sqe->user_data = (uint64_t)i * 3 + 2;
+		pending += 3;
+		n++;
+	}
+	if (!n)
+		return num_files;
+
+	if (cpe_uring_submit(&df->ring, pending))
+		return -COMPRESTIMATOR_EIO;
+	while (pending) {
+		if (!cpe_uring_reap(&df->ring, &user_data, &res)) {
+			if (cpe_uring_submit(&df->ring, 1))
+				return -COMPRESTIMATOR_EIO;
+			continue;
+		}
+		pending--;
+		if (user_data % 3 == 0)
+			open_res[user_data / 3] = res;
+		else if (user_data % 3 == 1)
+			df->len[user_data / 3] = res;
+	}
+
+	for (i = 0; i < num_files; i++) {
+		if (df->len[i] == FETCH_NONE)
+			continue;
+		/* A failed open cancels the read, keep its error. A file that
+		 * grew to fill its slot is read again the usual way. */
+		if (open_res[i] < 0)
+			df->len[i] = open_res[i];
+		else if (df->len[i] >= FETCH_FILE_SIZE)
+			df->len[i] = FETCH_NONE;
+	}
+	return num_files;
+}
+
+/* Map the cache at path. A missing or unusable cache is empty (cache->hdr is
+ * NULL), only other errors fail. */
+int cpe_dir_cache_open(struct dir_cache *cache, const char *path)
+{
+	struct dir_cache_header *hdr;
+	struct stat st;
+	int fd;
+
+	memset(cache, 0, sizeof(struct dir_cache));
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return (errno == ENOENT) ? COMPRESTIMATOR_OK : COMPRESTIMATOR_EIO;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return COMPRESTIMATOR_EIO;
+	}
+	if ((size_t)st.st_size < sizeof(struct dir_cache_header)) {
+		close(fd);
+		fprintf(stderr, "Warning: %s is not a cache, ignoring it\n", path);
+		return COMPRESTIMATOR_OK;
+	}
+
+	hdr = (struct dir_cache_header *) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == (void *)-1)
+		return COMPRESTIMATOR_EIO;
+	if (hdr->magic != DIR_CACHE_MAGIC || hdr->version != DIR_CACHE_VERSION ||
+			hdr->record_size != sizeof(struct dir_cache_record) ||
+			(uint64_t)st.st_size != sizeof(struct dir_cache_header) + hdr->num_records * sizeof(struct dir_cache_record)) {
+		fprintf(stderr, "Warning: %s is not a cache of this version, ignoring it\n", path);
+		munmap(hdr, st.st_size);
+		return COMPRESTIMATOR_OK;
+	}
+
+	cache->hdr = hdr;
+	cache->records = (struct dir_cache_record *) (hdr + 1);
+	cache->map_size = st.st_size;
+	return COMPRESTIMATOR_OK;
+}
+
+void cpe_dir_cache_close(struct dir_cache *cache)
+{
+	if (cache->hdr)
+		munmap(cache->hdr, cache->map_size);
+	memset(cache, 0, sizeof(struct dir_cache));
+}
+
+/* Write the statistics of the sampled and cached files of scan to the cache
+ * at path, replacing it atomically */
+int cpe_dir_cache_save(const char *path, struct dir_scan *scan, int exhaustive)
+{
+	struct dir_cache_header hdr;
+	struct dir_cache_record *records;
+	char tmp_path[PATH_MAX];
+	size_t i, n = 0;
+	FILE *f;
+	int ret = COMPRESTIMATOR_OK;
+
+	records = (struct dir_cache_record *) malloc((scan->num_files + 1) * sizeof(struct dir_cache_record));
+	if (!records)
+		return COMPRESTIMATOR_ENOMEM;
+	for (i = 0; i < scan->num_files; i++) {
+		struct dir_file *file = &scan->files[i];
+
+		if (file->state != DIR_FILE_CACHED && file->state != DIR_FILE_SAMPLED &&
+				file->state != DIR_FILE_SNIFFED)
+			continue;
+		records[n].dev = file->dev;
+		records[n].ino = file->ino;
+		records[n].size = file->size;
+		records[n].mtime_ns = file->mtime_ns;
+		records[n].ctime_ns = file->ctime_ns;
+		records[n].stats = file->stats;
+		n++;
+	}
+	qsort(records, n, sizeof(struct dir_cache_record), cache_record_cmp);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = DIR_CACHE_MAGIC;
+	hdr.version = DIR_CACHE_VERSION;
+	hdr.record_size = sizeof(struct dir_cache_record);
+	hdr.exhaustive = exhaustive;
+	hdr.sniff = scan->sniff;
+	hdr.num_records = n;
+	hdr.rate = scan->rate;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	f = fopen(tmp_path, "w");
+	if (!f) {
+		free(records);
+		return COMPRESTIMATOR_EIO;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || (n && fwrite(records, sizeof(struct dir_cache_record), n, f) != n) ||
+			fflush(f) || fsync(fileno(f)))
+		ret = COMPRESTIMATOR_EIO;
+	if (fclose(f))
+		ret = COMPRESTIMATOR_EIO;
+	if (!ret && rename(tmp_path, path) == -1)
+		ret = COMPRESTIMATOR_EIO;
+	if (ret)
+		unlink(tmp_path);
+	free(records);
+	return ret;
+}
@@ -0,0 +1,469 @@
+/* Internal interface of the estimation engine in libcomprestimator, shared by
+ * the library API and the comprestimator command line tool. Not installed.
+ * Its functions are global in libcomprestimator.a, so they all carry the cpe_
+ * prefix to stay out of the way of the programs linking it.
+ */
+#ifndef COMPRESTIMATOR_INT_H
+#define COMPRESTIMATOR_INT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "comprestimator.h"
+#include "comprestimator_stats.h"
+
+#define MAX_NUM_SAMPLE		2000	//Max number of non-zero samples to take
+#define MIN_NUM_SAMPLE		100	//Non-zero samples before the confidence can stop sampling
+#define MIN_NUM_CLUSTERS	30	//Clusters before cluster sampling can stop (--cluster)
+#define ZERO_BLOCK_FACTOR	10	    //Ratio of zero blocks to non-zero
+#define INBLOCK_SIZE		2048 	//Input block size in bytes (read from disk)
+#define ZLIB_BLOCK_SIZE		16384 	//Input block size to zlib in bytes
+#define OUTBLOCK_SIZE		2048	//Output block size in bytes (close gzip)
+#define COMP_UNIT_SIZE		134217728	//Input to streamer in bytes (=128MB)
+#define BLOCKS_PER_PROC		50	//How many blocks each process should handle (random)
+#define CLUSTERS_PER_PROC	4	//How many clusters each process should handle (--cluster)
+#define STATS_PUBLISH_BLOCKS	256	//Blocks between progress callbacks (exhaustive)
+#define STREAM_WINDOW_SIZE	65536	//Streams are sampled in windows of this size
+#define STREAM_MAX_SAMPLES	4096	//Sample results kept by a stream before thinning
+#define CACHE_LINE_SIZE		64
+#define DIR_NUM_SAMPLE		(2 * MAX_NUM_SAMPLE)	//Expected samples of a directory run (random)
+#define SHARD_NUM_SAMPLE	(2 * MAX_NUM_SAMPLE)	//Samples of all the shards of a device (random)
+#define DIR_CACHE_MAGIC		0x43524443	//"CDRC"
+#define DIR_CACHE_VERSION	2
+#define FP_MAGIC		0x43465043	//"CPFC"
+#define FP_VERSION		1
+#define CAPTURE_MAGIC		0x43504143	//"CAPC"
+#define CAPTURE_VERSION		1
+#define CAPTURE_ORIGIN_LEN	256
+#define HLL_BITS		14	//HyperLogLog of 2^14 registers, about 0.8% standard error
+#define DEDUP_CHUNK_SIZE	8192	//Default dedup granularity (--dedup)
+#define POOL_SIZE		2097152	//Buffer pool of a worker (one huge page)
+#define STATX_BATCH		256	//Directory entries stat'ed per io_uring batch
+#define FETCH_FILES		64	//Small files read per io_uring batch
+#define FETCH_FILE_SIZE		65536	//Files smaller than this are read whole through io_uring
+#define SNIFF_LEN		24	//Leading bytes of a file matched against known formats (--sniff)
+#define SNIFF_MIN_SIZE		65536	//Smaller files are compressed whole rather than sniffed (-e --sniff)
+#define SNIFF_MIN_RATIO		0.95	//A sniffed file whose sample compresses better is sampled as usual
+
+#define EXPORT __attribute__((visibility("default")))
+
+#define min(x, y) ({                            \
+        typeof(x) _min1 = (x);                  \
+        typeof(y) _min2 = (y);                  \
+        (void) (&_min1 == &_min2);              \
+        _min1 < _min2 ? _min1 : _min2; })
+
+/* Running mean and sum of squared deviations of a sample (Welford), which
+ * can be merged with another one (Chan et al.) without losing precision */
+struct moments {
+	uint64_t n;
+	double mean;
+	double m2;
+};
+
+/* Sums over the clusters of cluster sampling, of the samples n, non-zero
+ * samples a and sum of the ratios s of each, for the variance of the
+ * estimates between clusters (these are sums, so they merge by adding) */
+struct cluster_sums {
+	uint64_t clusters;
+	double n, n2;
+	double a, a2, an;
+	double s, s2, sa;
+};
+
+/* Statistics that each worker calculates and the caller aggregates. Every
+ * instance has its own cache line, and is written under seq so that it can be
+ * snapshotted at any time without locks (see cpe_info_commit/cpe_info_snapshot). */
+struct compression_info {
+	volatile uint32_t seq;
+	int num_zero_blocks;
+	int num_non_zero_blocks;
+	int total_blocks_read;
+	int num_repeated_blocks;	//non-zero samples that repeat a sniffed one rather than were read
+	struct moments ratio;		//compressed/uncompressed size of non-zero samples
+	struct cluster_sums cluster;	//cluster sampling only
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Hot path phases timed when profiling */
+enum phase {
+	PHASE_OPEN,
+	PHASE_READ,
+	PHASE_ZERO_CHECK,
+	PHASE_DEFLATE,
+	PHASE_AGGREGATE,
+	PHASE_FORK,		//parent: forking a child
+	PHASE_WAIT,		//parent: blocked waiting for a child
+	NUM_PHASES
+};
+
+#define PROFILE_BUCKETS		48	//log2(ns) latency histogram buckets
+
+/* Latency statistics of one phase */
+struct phase_stats {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t hist[PROFILE_BUCKETS];	//hist[i] counts latencies in [2^i, 2^(i+1)) ns
+};
+
+/* Phase timings of one worker */
+struct worker_profile {
+	struct phase_stats phase[NUM_PHASES];
+	uint64_t runs;			//child processes that ran in this slot
+	uint64_t lifetime_ns;		//fork to reap, summed over runs
+};
+
+/* HyperLogLog sketch of the distinct non-zero chunks seen, for the dedup
+ * estimate. Sketches merge by taking the register maxima. */
+struct hll {
+	uint64_t chunks;		//non-zero chunks added
+	uint8_t reg[1 << HLL_BITS];
+};
+
+/* Chunk being fingerprinted for the dedup sketch */
+struct dedup_chunk {
+	struct hll *hll;		//NULL when not estimating dedup
+	uint32_t size;			//bytes, a power of two multiple of INBLOCK_SIZE
+	int pending;
+	int zero;			//all the blocks so far were zero
+	uint64_t hash;
+};
+
+/* Memory of a worker: its buffers, then the state of its deflate streams,
+ * in one huge page when possible (MAP_HUGETLB, else transparent huge pages)
+ * so that the window and hash tables deflate walks take one TLB entry. The
+ * deflate allocations are carved in order and all given back when the last
+ * is freed; what does not fit comes from malloc. */
+struct buf_pool {
+	unsigned char *base;		//NULL when the pool could not be mapped
+	size_t size;
+	size_t reserved;		//kept for the life of the pool (buffers)
+	size_t used;
+	int live;			//deflate allocations not freed yet
+	int huge;			//1 MAP_HUGETLB, 2 transparent huge pages
+};
+
+/* State of one worker: the open source, its buffers and PRNG, and where it
+ * accumulates statistics. Workers share nothing, so each can run on its own
+ * thread or process. */
+struct comp_worker {
+	int fd;
+	unsigned char *inbuf;
+	unsigned char *outbuf;
+	uint64_t rng;
+	struct compression_info info;
+	struct worker_profile *profile;	//NULL when not profiling
+	/* Called after every sample (every STATS_PUBLISH_BLOCKS blocks in
+	 * exhaustive mode) with the counters so far, may be NULL */
+	void (*progress)(struct comp_worker *w, int zero_blocks, int non_zero_blocks, int blocks_read);
+	void *priv;
+	struct dedup_chunk dedup;	//fed by cpe_compress_chunks_sequential
+	struct buf_pool pool;
+	void *zstream;			//deflate state kept across samples (worker_zstream)
+	const unsigned char *mem;	//the source already read (cpe_dir_fetch), instead of fd
+	size_t mem_size;
+};
+
+/* Chooses the blocks to sample and decides when to stop */
+struct sampler {
+	int exhaustive;
+	off_t first_chunk;		//blocks [first_chunk, num_chunks) are sampled
+	off_t num_chunks;		//INBLOCK_SIZE blocks in the source
+	off_t cur_chunk;		//next block of the exhaustive pass
+	uint64_t rng;
+	double target_error;		//stop once both confidence bounds are within this
+	int max_samples;		//non-zero samples to stop at (MAX_NUM_SAMPLE)
+	int fixed_samples;		//take exactly this many samples instead (shards), 0 if not
+	int drawn;			//samples handed out
+	uint32_t cluster_blocks;	//cluster sampling: blocks of a cluster, 0 if not
+};
+
+/* Monotonic time in nanoseconds */
+uint64_t cpe_now_ns(void);
+
+/* Start timing a phase (returns 0 when not profiling) */
+static inline uint64_t profile_start(struct worker_profile *p)
+{
+	return p ? cpe_now_ns() : 0;
+}
+
+void cpe_phase_add(struct phase_stats *ps, uint64_t ns);
+
+/* Record a phase that began at start (from profile_start) */
+static inline void profile_end(struct worker_profile *p, enum phase ph, uint64_t start)
+{
+	if (p)
+		cpe_phase_add(&p->phase[ph], cpe_now_ns() - start);
+}
+
+void cpe_profile_merge(struct worker_profile *dst, struct worker_profile *src);
+uint64_t cpe_phase_percentile(struct phase_stats *ps, double perc);
+
+/* splitmix64 */
+static inline uint64_t rand_next(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+void cpe_moments_add(struct moments *m, double x);
+void cpe_moments_merge(struct moments *dst, struct moments *src);
+double cpe_moments_var(struct moments *m);
+
+void cpe_info_commit(struct compression_info *dst, struct compression_info *src);
+void cpe_info_snapshot(struct compression_info *src, struct compression_info *dst);
+void cpe_info_merge(struct compression_info *dst, struct compression_info *src);
+
+double cpe_hoeffding_bound(double n);
+double cpe_bernstein_bound(double var, double n);
+void cpe_cluster_design_effect(struct compression_info *info, double *deff_zeros, double *deff_comp);
+void cpe_confidence_bounds(struct compression_info *info, double *conf_zeros, double *conf_comp);
+
+off_t cpe_get_dev_size(const char *path);
+off_t cpe_get_fd_size(int fd);
+int cpe_is_zero_block(char *buf);
+
+/* A sample of a device with the fingerprint of the blocks it read
+ * (--fingerprints), so that a later run can tell if they changed */
+struct sample_fingerprint {
+	uint64_t offset;
+	uint64_t hash;			//of the blocks read, 0 blocks: not sampled yet
+	float ratio;			//compressed/original size, < 0 for a zero block
+	uint32_t blocks;		//blocks read (the first and the ones continued into)
+	uint16_t start;			//offset of the compression start in the first block
+	uint16_t flags;
+	uint32_t pad;
+};
+
+#define FP_REUSED	1		//unchanged, taken without compressing (this run)
+
+/* Header of a fingerprint file, followed by num_records records */
+struct fingerprint_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t pad;
+	uint64_t dev_size;
+	uint64_t num_records;
+};
+
+uint64_t cpe_hash64(const void *buf, size_t len, uint64_t seed);
+void cpe_hll_add(struct hll *h, uint64_t hash);
+void cpe_hll_merge(struct hll *dst, struct hll *src);
+double cpe_hll_count(struct hll *h);
+
+/* Capture file (--capture): the raw data of the samples of a run, to replay
+ * them offline with other compressor settings (--replay). The records follow
+ * the header, the data of the samples starts at data_off. */
+struct capture_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t pad;
+	uint64_t dev_size;
+	uint64_t num_records;
+	uint64_t data_off;
+	uint64_t data_size;
+	char origin[CAPTURE_ORIGIN_LEN];	//device the samples were taken from
+};
+
+/* A captured sample. Only its non-zero blocks are kept, as those are all the
+ * compressor sees. */
+struct capture_record {
+	uint64_t offset;		//in the origin
+	uint64_t data;			//offset of the blocks from data_off
+	uint32_t blocks;		//blocks the sample read
+	uint32_t data_blocks;		//non-zero blocks kept, 0 for a zero sample
+	uint32_t start;			//compression start in the first block
+	uint32_t pad;
+};
+
+struct capture {
+	struct capture_header *hdr;
+	struct capture_record *records;
+	unsigned char *data;
+	size_t map_size;
+};
+
+int cpe_capture_write(const char *path, const char *origin, int fd, off_t dev_size,
+		struct sample_fingerprint *samples, size_t num_samples);
+int cpe_capture_open(struct capture *cap, const char *path);
+void cpe_capture_close(struct capture *cap);
+int cpe_capture_replay(struct capture *cap, int level, struct compression_info *info);
+#ifdef ZLIB_H
+int cpe_compress_blocks_mem(z_stream *strm, unsigned char *outbuf, const unsigned char *data, uint32_t blocks,
+		uint32_t start, double *ratio);
+#endif
+
+void cpe_pool_init(struct buf_pool *p);
+void *cpe_pool_alloc(struct buf_pool *p, size_t size);
+void cpe_pool_free(struct buf_pool *p, void *ptr);
+void cpe_pool_destroy(struct buf_pool *p);
+#ifdef ZLIB_H
+/* Make strm allocate from p (before deflateInit) */
+void cpe_pool_zstream(struct buf_pool *p, z_stream *strm);
+#endif
+int cpe_worker_init(struct comp_worker *w, uint64_t seed);
+int cpe_worker_open(struct comp_worker *w, const char *path);
+ssize_t cpe_worker_pread(struct comp_worker *w, void *buf, size_t len, off_t off);
+void cpe_worker_destroy(struct comp_worker *w);
+int cpe_compress_chunk_random(struct comp_worker *w, off_t read_location);
+int cpe_compress_cluster(struct comp_worker *w, off_t loc, unsigned char *buf, uint32_t blocks);
+int cpe_compress_chunk_fingerprint(struct comp_worker *w, struct sample_fingerprint *fp);
+int cpe_compress_chunks_sequential(struct comp_worker *w, off_t *pattern, int pattern_size);
+
+/* Sample statistics of one file of a directory run, as kept in the cache */
+struct file_stats {
+	int32_t num_zero_blocks;
+	int32_t num_non_zero_blocks;
+	int32_t total_blocks_read;
+	int32_t num_repeated_blocks;
+	struct moments ratio;
+};
+
+/* State of a dir_file */
+enum {
+	DIR_FILE_PENDING,		//to be sampled
+	DIR_FILE_CACHED,		//stats taken from the cache
+	DIR_FILE_SAMPLED,
+	DIR_FILE_FAILED,		//could not be read, left out of the estimate
+	DIR_FILE_OTHER_SHARD,		//estimated by another shard (--shard)
+	DIR_FILE_DUPLICATE,		//a hard link, or all shared extents, of data estimated with another file
+	DIR_FILE_SNIFFED,		//a compressed format by its first bytes, scored from one sample (--sniff)
+};
+
+/* Blocks [start, end) of a file whose data is estimated with another file */
+struct dir_range {
+	uint64_t start;
+	uint64_t end;
+};
+
+/* A regular file found by cpe_dir_scan */
+struct dir_file {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	uint64_t path;			//offset of the path in dir_scan.names
+	uint32_t samples;		//blocks to sample (random mode)
+	uint32_t state;
+	uint64_t physical;		//address of its first extent on dev (FIEMAP), UINT64_MAX if unknown
+	uint64_t shared;		//index of its ranges in dir_scan.shared
+	uint32_t num_shared;		//ranges of extents shared with a file estimated before it
+	uint64_t shared_blocks;		//blocks in these ranges
+	struct file_stats stats;
+};
+
+/* The files of a directory run */
+struct dir_scan {
+	struct dir_file *files;
+	size_t num_files;
+	size_t max_files;
+	size_t files_map_size;		//files is a shared mapping of this size (cpe_dir_scan_share)
+	char *names;
+	size_t names_len;
+	size_t names_size;
+	uint64_t total_bytes;		//each hard link and shared extent once
+	size_t num_links;		//files left out as hard links of others
+	uint64_t shared_bytes;		//bytes left out as extents shared with other files
+	int shared_extents;		//the extents of every file were walked (--shared-extents)
+	struct dir_range *shared;
+	size_t num_ranges;
+	size_t next_file;		//next file to hand out (cpe_dir_next_batch)
+	size_t *order;			//files to read, by physical address (cpe_dir_plan)
+	size_t num_order;
+	double rate;			//samples per block (random mode)
+	int sniff;			//score files in compressed formats from one sample (--sniff)
+};
+
+/* Result index of earlier directory runs: records of file_stats sorted by
+ * (dev, ino), mapped read-only */
+struct dir_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t exhaustive;
+	uint32_t sniff;			//whether files in compressed formats were scored from one sample
+	uint32_t pad;
+	uint64_t num_records;
+	double rate;
+};
+
+struct dir_cache_record {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+	struct file_stats stats;
+};
+
+struct dir_cache {
+	struct dir_cache_header *hdr;	//NULL when there is no usable cache
+	struct dir_cache_record *records;
+	size_t map_size;
+};
+
+/* A minimal io_uring (comprestimator_uring.c) */
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct uring {
+	int fd;
+	unsigned entries;
+	unsigned queued;		//entries taken since the last submit
+	void *ring;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+int cpe_uring_init(struct uring *r, unsigned entries);
+void cpe_uring_exit(struct uring *r);
+int cpe_uring_register(struct uring *r, unsigned opcode, void *arg, unsigned nr_args);
+struct io_uring_sqe *cpe_uring_sqe(struct uring *r);
+int cpe_uring_submit(struct uring *r, unsigned wait_nr);
+int cpe_uring_reap(struct uring *r, uint64_t *user_data, int32_t *res);
+
+/* Small files of a batch read whole, each open, read and close chained
+ * through io_uring into a slot of a registered buffer (cpe_dir_fetch) */
+struct dir_fetch {
+	struct uring ring;
+	unsigned char *buf;		//FETCH_FILES slots of FETCH_FILE_SIZE
+	int32_t len[FETCH_FILES];	//bytes read, -errno, or FETCH_NONE when not fetched
+};
+#define FETCH_NONE		INT32_MIN
+
+int cpe_dir_scan(struct dir_scan *scan, const char *root, int shared_extents);
+int cpe_dir_scan_share(struct dir_scan *scan);
+void cpe_dir_scan_free(struct dir_scan *scan);
+const char *cpe_dir_file_path(struct dir_scan *scan, struct dir_file *f);
+uint64_t cpe_dir_shard(struct dir_scan *scan, const char *root, int shard, int num_shards);
+size_t cpe_dir_plan(struct dir_scan *scan, struct dir_cache *cache, int exhaustive, uint64_t *rng,
+		struct compression_info *info);
+int cpe_dir_next_batch(struct dir_scan *scan, off_t *pattern, int max_entries, int max_blocks, int exhaustive);
+int cpe_dir_sample_file(struct comp_worker *w, struct dir_scan *scan, struct dir_file *f, int exhaustive);
+int cpe_dir_fetch_init(struct dir_fetch *df);
+int cpe_dir_fetch(struct dir_fetch *df, struct dir_scan *scan, off_t *files, int num_files);
+void cpe_dir_fetch_destroy(struct dir_fetch *df);
+void cpe_file_stats_to_info(struct file_stats *fs, struct compression_info *info);
+void cpe_info_to_file_stats(struct compression_info *info, struct file_stats *fs);
+int cpe_dir_cache_open(struct dir_cache *cache, const char *path);
+void cpe_dir_cache_close(struct dir_cache *cache);
+int cpe_dir_cache_save(const char *path, struct dir_scan *scan, int exhaustive);
+
+/* Counters of a stream in the form of the aggregate of a sampling run, and its
+ * worker (to attach a profile) */
+void cpe_stream_info(comprestimator_stream *st, struct compression_info *info);
+struct comp_worker *cpe_stream_worker(comprestimator_stream *st);
+
+void cpe_sampler_init(struct sampler *s, off_t dev_size, int exhaustive, uint64_t seed, double target_error);
+int cpe_sampler_next(struct sampler *s, off_t *pattern, int max_blocks, struct compression_info *info);
+
+#endif
@@ -0,0 +1,96 @@
+/* Live statistics segment published by comprestimator --stats <file>
+ *
+ * The segment is a file mapped MAP_SHARED by the running estimator and
+ * read-only by monitors such as comprestimator-top. There are no locks: the
+ * header is written only by the parent process and every worker entry only by
+ * the child currently running in that slot, each under its own sequence
+ * counter. A reader retries its copy until it sees the same even sequence
+ * number before and after, so it never blocks or slows the writers.
+ */
+#ifndef COMPRESTIMATOR_STATS_H
+#define COMPRESTIMATOR_STATS_H
+
+#include <stdint.h>
+
+#define STATS_MAGIC		0x534d4f43	//"COMS"
+#define STATS_VERSION		1
+#define STATS_MAX_WORKERS	128	//same as MAX_NUM_PROCS
+#define STATS_DEV_NAME_LEN	256
+
+/* Live state of one worker slot (the child currently running in it) */
+struct stats_worker {
+	volatile uint32_t seq;
+	int32_t pid;			//0 while the slot is idle
+	uint64_t start_ns;		//when the current child started (CLOCK_MONOTONIC)
+	uint64_t update_ns;
+	uint64_t blocks_read;		//blocks read by the current child
+	uint64_t zero_blocks;
+	uint64_t non_zero_blocks;
+	double bytes_per_sec;		//read rate of the current child
+	uint64_t read_p50_ns;
+	uint64_t read_p99_ns;
+} __attribute__((aligned(64)));
+
+struct stats_segment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t segment_size;		//sizeof(struct stats_segment), checked by readers
+	volatile uint32_t seq;
+	int32_t pid;			//pid of the estimator parent
+	int32_t num_workers;
+	int32_t exhaustive;
+	int32_t finished;
+	char dev_name[STATS_DEV_NAME_LEN];
+	uint64_t dev_size;
+	uint64_t start_ns;		//CLOCK_MONOTONIC
+	uint64_t update_ns;
+
+	/* Totals of the children reaped so far */
+	uint64_t blocks_read;
+	uint64_t zero_blocks;
+	uint64_t non_zero_blocks;
+	uint64_t children_done;
+
+	/* Current estimate and confidence (fractions) */
+	double non_zero_frac;
+	double conf_zeros;
+	double comp_frac;
+	double conf_comp;
+
+	/* pread latency over the children reaped so far */
+	uint64_t read_p50_ns;
+	uint64_t read_p90_ns;
+	uint64_t read_p99_ns;
+
+	struct stats_worker workers[STATS_MAX_WORKERS];
+};
+
+static inline void stats_write_begin(volatile uint32_t *seq)
+{
+	(*seq)++;
+	__sync_synchronize();
+}
+
+static inline void stats_write_end(volatile uint32_t *seq)
+{
+	__sync_synchronize();
+	(*seq)++;
+}
+
+static inline uint32_t stats_read_begin(volatile uint32_t *seq)
+{
+	uint32_t s = *seq;
+
+	__sync_synchronize();
+	return s;
+}
+
+/* Returns nonzero if the copy taken since stats_read_begin must be retried
+ * (a write was in progress or happened meanwhile) */
+static inline int stats_read_retry(volatile uint32_t *seq, uint32_t start)
+{
+	__sync_synchronize();
+	return (start & 1) || (*seq != start);
+}
+
+#endif
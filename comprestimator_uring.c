@@ -0,0 +1,145 @@
+/* A minimal io_uring, on the raw system calls (no liburing), for the
+ * batches of small requests of directory mode: the statx of the entries of
+ * a directory, and the open, read and close of small files.
+ */
+
+#define _LARGE_FILES
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "comprestimator_int.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* Fails when the kernel has no io_uring, or it is disabled */
+int cpe_uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+
+	memset(r, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+	r->fd = sys_io_uring_setup(entries, &p);
+	if (r->fd == -1)
+		return COMPRESTIMATOR_EIO;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+		close(r->fd);
+		return COMPRESTIMATOR_EINVAL;
+	}
+
+	r->entries = p.sq_entries;
+	/* One mapping holds both rings */
+	r->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (r->ring_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		r->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQ_RING);
+	if (r->ring == (void *)-1) {
+		close(r->fd);
+		return COMPRESTIMATOR_ENOMEM;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = (struct io_uring_sqe *) mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == (void *)-1) {
+		munmap(r->ring, r->ring_size);
+		close(r->fd);
+		return COMPRESTIMATOR_ENOMEM;
+	}
+
+	sq = cq = (unsigned char *) r->ring;
+	r->sq_head = (unsigned *) (sq + p.sq_off.head);
+	r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) (sq + p.sq_off.array);
+	r->cq_head = (unsigned *) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return COMPRESTIMATOR_OK;
+}
+
+void cpe_uring_exit(struct uring *r)
+{
+	if (!r->ring)
+		return;
+	munmap(r->sqes, r->sqes_size);
+	munmap(r->ring, r->ring_size);
+	close(r->fd);
+	memset(r, 0, sizeof(struct uring));
+}
+
+int cpe_uring_register(struct uring *r, unsigned opcode, void *arg, unsigned nr_args)
+{
+	if (syscall(__NR_io_uring_register, r->fd, opcode, arg, nr_args) == -1)
+		return COMPRESTIMATOR_EIO;
+	return COMPRESTIMATOR_OK;
+}
+
+/* The next free submission entry, cleared, or NULL when the queue is full */
+struct io_uring_sqe *cpe_uring_sqe(struct uring *r)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *r->sq_tail + r->queued;
+	struct io_uring_sqe *sqe;
+
+	if (tail - head >= r->entries)
+		return NULL;
+	sqe = &r->sqes[tail & *r->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+	r->queued++;
+	return sqe;
+}
+
+/* Submit the entries taken since the last call, and wait until at least
+ * wait_nr completions are there (or a signal came: callers reap until they
+ * have what they expect, submitting again with no entries to wait) */
+int cpe_uring_submit(struct uring *r, unsigned wait_nr)
+{
+	unsigned submit = r->queued;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, *r->sq_tail + r->queued, __ATOMIC_RELEASE);
+	r->queued = 0;
+	do {
+		ret = sys_io_uring_enter(r->fd, submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+		if (ret >= 0) {
+			submit -= min((unsigned)ret, submit);
+			if (!submit)
+				break;
+		}
+	} while (ret >= 0 || errno == EINTR || errno == EAGAIN || errno == EBUSY);
+	if (ret < 0)
+		return COMPRESTIMATOR_EIO;
+	return COMPRESTIMATOR_OK;
+}
+
+/* Take the next completion: 1 with its user_data and result, 0 if none */
+int cpe_uring_reap(struct uring *r, uint64_t *user_data, int32_t *res)
+{
+	unsigned head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	cqe = &r->cqes[head & *r->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
@@ -0,0 +1,806 @@
+/* comprestimatord -- local estimation daemon
+ *
+ * Listens on a Unix socket for estimation requests and runs all of them on
+ * one shared pool of worker threads, so that concurrent jobs on a host stay
+ * within one CPU and I/O budget instead of each forking its own processes.
+ *
+ * Protocol: the client sends one request line
+ *	estimate [exhaustive=0|1] [seed=<n>] [target_error=<percent>] path=<path>
+ * (path= comes last and takes the rest of the line) and receives JSON lines:
+ * {"type": "progress", ...} while the job runs, then one {"type": "result", ...}
+ * or {"type": "error", ...}, after which the server closes the connection.
+ * The request "status" returns one {"type": "status", ...} line instead.
+ *
+ * Scheduling: a job is one comprestimator context, and a unit of work is one
+ * comprestimator_step() (a batch of samples, or 128 MB in exhaustive mode).
+ * Runnable jobs wait in a FIFO queue; a worker takes the head, steps it once
+ * and puts it back at the tail, so jobs share the pool round robin and a job
+ * never runs on two workers at once. Requests for a source (same device or
+ * inode) with the same options that is already being estimated attach to the
+ * running job instead of starting another one.
+ *
+ * Access: the daemon reads raw devices, so it usually runs as root. Its
+ * socket is created mode 0600, and the path of a request is opened with the
+ * credentials of the user at the other end of the connection (SO_PEERCRED);
+ * the job then reads that descriptor, never the path again.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "comprestimator_int.h"
+
+#define DEFAULT_SOCKET_PATH	"/run/comprestimatord.sock"
+#define MAX_PEER_GROUPS		256	//Groups of a client taken into account when checking its paths
+#define MAX_WORKERS		128	//Maximum number of worker threads
+#define MAX_REQUEST_LEN		4352	//Request line: options plus PATH_MAX
+#define PROGRESS_INTERVAL_NS	500000000ULL	//Time between progress lines of a connection
+#define LISTEN_BACKLOG		64
+
+enum job_state {
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED,
+};
+
+struct job {
+	struct job *next;		//in the job table
+	struct job *next_runnable;	//in the run queue
+	dev_t dev;			//identity of the source (see source_id)
+	ino_t ino;
+	struct comprestimator_options opts;
+	char *path;
+	comprestimator_ctx *ctx;
+	enum job_state state;
+	int status;			//comprestimator status when failed
+	int refs;			//connections waiting for the job
+	int busy;			//being stepped by a worker
+	int queued;			//in the run queue
+	uint64_t generation;		//bumped after every step, wakes the connections
+	pthread_cond_t cond;
+};
+
+struct server_stats {
+	uint64_t jobs_started;
+	uint64_t jobs_shared;		//requests that attached to a running job
+	uint64_t steps;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static struct job *jobs = NULL;
+static struct job *run_head = NULL;
+static struct job *run_tail = NULL;
+static struct server_stats server_stats;
+
+/* I/O budget: bytes per second over all workers, 0 for unlimited. Workers
+ * book their reads on a shared virtual clock and sleep while it is ahead of
+ * real time. */
+static double io_budget = 0;
+static uint64_t io_clock_ns = 0;
+
+static char *socket_path = DEFAULT_SOCKET_PATH;
+static int num_workers = 0;
+
+void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-S <socket> -w <workers> -b <MB/s> -h]\n", prog);
+	fprintf(stderr, "       -S: Unix socket to listen on (default %s)\n", DEFAULT_SOCKET_PATH);
+	fprintf(stderr, "       -w: worker threads shared by all requests (default: number of CPUs)\n");
+	fprintf(stderr, "       -b: read budget in MB/s shared by all requests (default: unlimited)\n");
+	fprintf(stderr, "       -h: print this help and exit\n");
+	exit(1);
+}
+
+/* Identity of a source: the device for block devices, the inode otherwise */
+static int source_id(int fd, dev_t *dev, ino_t *ino)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+	if (S_ISBLK(st.st_mode)) {
+		*dev = st.st_rdev;
+		*ino = 0;
+	} else {
+		*dev = st.st_dev;
+		*ino = st.st_ino;
+	}
+	return 0;
+}
+
+static int same_options(struct comprestimator_options *a, struct comprestimator_options *b)
+{
+	return (a->exhaustive == b->exhaustive) && (a->target_error == b->target_error) && (a->seed == b->seed);
+}
+
+/* Must be called with lock held */
+static void run_queue_push(struct job *job)
+{
+	job->next_runnable = NULL;
+	job->queued = 1;
+	if (run_tail)
+		run_tail->next_runnable = job;
+	else
+		run_head = job;
+	run_tail = job;
+	pthread_cond_signal(&work_cond);
+}
+
+/* Must be called with lock held */
+static struct job *run_queue_pop()
+{
+	struct job *job = run_head;
+
+	if (job) {
+		run_head = job->next_runnable;
+		if (!run_head)
+			run_tail = NULL;
+		job->queued = 0;
+	}
+	return job;
+}
+
+/* Must be called with lock held */
+static void job_unlink(struct job *job)
+{
+	struct job **p;
+
+	for (p = &jobs; *p; p = &(*p)->next) {
+		if (*p == job) {
+			*p = job->next;
+			break;
+		}
+	}
+}
+
+static void job_free(struct job *job)
+{
+	comprestimator_close(job->ctx);
+	pthread_cond_destroy(&job->cond);
+	free(job->path);
+	free(job);
+}
+
+/* Drop a reference. The job is freed once nobody waits for it and no worker
+ * holds it; a job nobody waits for any more is dropped from the queue.
+ * Must be called with lock held. */
+static void job_put(struct job *job)
+{
+	struct job **p;
+
+	job->refs--;
+	if (job->refs)
+		return;
+	if (job->state == JOB_RUNNING)
+		job_unlink(job);
+	if (job->queued) {
+		for (p = &run_head, run_tail = NULL; *p; ) {
+			if (*p == job) {
+				*p = job->next_runnable;
+				continue;
+			}
+			run_tail = *p;
+			p = &(*p)->next_runnable;
+		}
+		job->queued = 0;
+	}
+	if (!job->busy)
+		job_free(job);
+}
+
+/* Must be called with lock held */
+static struct job *job_find(dev_t dev, ino_t ino, struct comprestimator_options *opts)
+{
+	struct job *job;
+
+	for (job = jobs; job; job = job->next)
+		if ((job->dev == dev) && (job->ino == ino) && same_options(&job->opts, opts))
+			return job;
+	return NULL;
+}
+
+/* Find the running job of the same source (open as fd) and options (setting
+ * shared), or start one. The context is opened outside the lock, so a slow
+ * source only holds up its own request; when another request started the
+ * same job meanwhile, the new context is dropped and that job is shared. */
+static struct job *job_get(int fd, const char *path, struct comprestimator_options *opts, int *shared, int *status)
+{
+	struct job *job, *other;
+	dev_t dev;
+	ino_t ino;
+	int ret;
+
+	if (source_id(fd, &dev, &ino) == -1) {
+		*status = COMPRESTIMATOR_EIO;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&lock);
+	job = job_find(dev, ino, opts);
+	if (job) {
+		job->refs++;
+		server_stats.jobs_shared++;
+		*shared = 1;
+		pthread_mutex_unlock(&lock);
+		return job;
+	}
+	pthread_mutex_unlock(&lock);
+
+	job = (struct job *) calloc(1, sizeof(struct job));
+	if (!job || !(job->path = strdup(path))) {
+		free(job);
+		*status = COMPRESTIMATOR_ENOMEM;
+		return NULL;
+	}
+	ret = comprestimator_open_fd(&job->ctx, fd, opts);
+	if (ret) {
+		free(job->path);
+		free(job);
+		*status = ret;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&lock);
+	other = job_find(dev, ino, opts);
+	if (other) {
+		other->refs++;
+		server_stats.jobs_shared++;
+		*shared = 1;
+		pthread_mutex_unlock(&lock);
+		comprestimator_close(job->ctx);
+		free(job->path);
+		free(job);
+		return other;
+	}
+	*shared = 0;
+	job->dev = dev;
+	job->ino = ino;
+	job->opts = *opts;
+	job->refs = 1;
+	job->state = JOB_RUNNING;
+	pthread_cond_init(&job->cond, NULL);
+	job->next = jobs;
+	jobs = job;
+	server_stats.jobs_started++;
+	run_queue_push(job);
+	pthread_mutex_unlock(&lock);
+	return job;
+}
+
+/* Book bytes on the I/O budget and sleep until they are within it */
+static void io_throttle(uint64_t bytes)
+{
+	struct timespec ts;
+	uint64_t now, wake;
+
+	if (io_budget <= 0 || !bytes)
+		return;
+
+	pthread_mutex_lock(&lock);
+	now = cpe_now_ns();
+	if (io_clock_ns < now)
+		io_clock_ns = now;
+	io_clock_ns += (uint64_t)((double)bytes * 1e9 / io_budget);
+	wake = io_clock_ns;
+	pthread_mutex_unlock(&lock);
+
+	if (wake > now) {
+		ts.tv_sec = (wake - now) / 1000000000ULL;
+		ts.tv_nsec = (wake - now) % 1000000000ULL;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			;
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	struct comprestimator_result before, after;
+	struct job *job;
+	int ret;
+
+	while (1) {
+		pthread_mutex_lock(&lock);
+		while (!(job = run_queue_pop()))
+			pthread_cond_wait(&work_cond, &lock);
+		job->busy = 1;
+		pthread_mutex_unlock(&lock);
+
+		comprestimator_snapshot(job->ctx, &before);
+		ret = comprestimator_step(job->ctx);
+		comprestimator_snapshot(job->ctx, &after);
+
+		pthread_mutex_lock(&lock);
+		job->busy = 0;
+		job->generation++;
+		server_stats.steps++;
+		if (ret != COMPRESTIMATOR_OK) {
+			job->state = (ret == COMPRESTIMATOR_DONE) ? JOB_DONE : JOB_FAILED;
+			job->status = ret;
+			job_unlink(job);
+		}
+		pthread_cond_broadcast(&job->cond);
+		if (!job->refs) {
+			job_free(job);
+		} else if (job->state == JOB_RUNNING) {
+			run_queue_push(job);
+		}
+		pthread_mutex_unlock(&lock);
+
+		io_throttle((after.blocks_read - before.blocks_read) * INBLOCK_SIZE);
+	}
+	return NULL;
+}
+
+/* Write all of buf to the client. Returns -1 once the client is gone. */
+static int send_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Has the client closed its end? */
+static int client_gone(int fd)
+{
+	char c;
+	ssize_t ret = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	return (ret == 0) || (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+/* JSON string with the quotes and backslashes of s escaped */
+static void json_escape(char *dst, size_t size, const char *s)
+{
+	size_t i = 0;
+
+	for (; *s && i + 2 < size; s++) {
+		if (*s == '"' || *s == '\\')
+			dst[i++] = '\\';
+		else if ((unsigned char)*s < 0x20)
+			continue;
+		dst[i++] = *s;
+	}
+	dst[i] = '\0';
+}
+
+static int send_estimate(int fd, const char *type, struct job *job, int shared)
+{
+	struct comprestimator_result res;
+	char path[2 * MAX_REQUEST_LEN];
+	char line[3 * MAX_REQUEST_LEN];
+	double dev_size_mb;
+
+	comprestimator_snapshot(job->ctx, &res);
+	dev_size_mb = (double)res.dev_size / 1048576;
+	json_escape(path, sizeof(path), job->path);
+	snprintf(line, sizeof(line), "{\"type\": \"%s\", \"path\": \"%s\", \"shared\": %d, \"dev_size\": %llu, "
+			"\"zero_blocks\": %llu, \"non_zero_blocks\": %llu, \"blocks_read\": %llu, "
+			"\"non_zero_frac\": %.5f, \"conf_zeros\": %.5f, \"comp_frac\": %.5f, \"conf_comp\": %.5f, "
+			"\"variance\": %.6f, \"after_zero_mb\": %.1f, \"after_rtc_mb\": %.1f}\n",
+			type, path, shared, (unsigned long long)res.dev_size, (unsigned long long)res.zero_blocks,
+			(unsigned long long)res.non_zero_blocks, (unsigned long long)res.blocks_read,
+			res.non_zero_frac, res.conf_zeros, res.comp_frac, res.conf_comp, res.variance,
+			dev_size_mb * res.non_zero_frac, dev_size_mb * res.non_zero_frac * res.comp_frac);
+	return send_all(fd, line, strlen(line));
+}
+
+static void send_error(int fd, const char *path, const char *message)
+{
+	char esc_path[2 * MAX_REQUEST_LEN];
+	char esc_message[512];
+	char line[3 * MAX_REQUEST_LEN];
+
+	json_escape(esc_path, sizeof(esc_path), path ? path : "");
+	json_escape(esc_message, sizeof(esc_message), message);
+	snprintf(line, sizeof(line), "{\"type\": \"error\", \"path\": \"%s\", \"message\": \"%s\"}\n",
+			esc_path, esc_message);
+	send_all(fd, line, strlen(line));
+}
+
+/* Parse "estimate [key=value ...] path=<path>" into opts and path */
+static int parse_request(char *line, struct comprestimator_options *opts, char **path)
+{
+	char *tok, *next;
+
+	comprestimator_default_options(opts);
+	*path = NULL;
+
+	if (strncmp(line, "estimate ", 9))
+		return -1;
+	for (tok = line + 9; *tok; tok = next) {
+		while (*tok == ' ')
+			tok++;
+		if (!strncmp(tok, "path=", 5)) {
+			*path = tok + 5;
+			return (**path) ? 0 : -1;
+		}
+		next = strchr(tok, ' ');
+		if (next)
+			*next++ = '\0';
+		else
+			next = tok + strlen(tok);
+		if (!strncmp(tok, "exhaustive=", 11))
+			opts->exhaustive = atoi(tok + 11);
+		else if (!strncmp(tok, "seed=", 5))
+			opts->seed = strtoull(tok + 5, NULL, 10);
+		else if (!strncmp(tok, "target_error=", 13))
+			opts->target_error = atof(tok + 13) / 100;
+		else if (*tok)
+			return -1;
+	}
+	return -1;
+}
+
+static void send_status(int fd)
+{
+	struct job *job;
+	char line[512];
+	int running = 0, queued = 0;
+
+	pthread_mutex_lock(&lock);
+	for (job = jobs; job; job = job->next)
+		running++;
+	for (job = run_head; job; job = job->next_runnable)
+		queued++;
+	snprintf(line, sizeof(line), "{\"type\": \"status\", \"pid\": %d, \"workers\": %d, \"io_budget\": %.0f, "
+			"\"jobs_running\": %d, \"jobs_queued\": %d, \"jobs_started\": %llu, \"jobs_shared\": %llu, "
+			"\"steps\": %llu}\n", getpid(), num_workers, io_budget, running, queued,
+			(unsigned long long)server_stats.jobs_started, (unsigned long long)server_stats.jobs_shared,
+			(unsigned long long)server_stats.steps);
+	pthread_mutex_unlock(&lock);
+	send_all(fd, line, strlen(line));
+}
+
+/* Pass fd (or, when fd is -1, the error err) over the socket sock */
+static int send_fd(int sock, int fd, int err)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { &err, sizeof(err) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd != -1) {
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	return (sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(err)) ? 0 : -1;
+}
+
+/* Receive what send_fd sent: the descriptor, or -1 with errno set */
+static int recv_fd(int sock)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	int err = EACCES, fd = -1;
+	struct iovec iov = { &err, sizeof(err) };
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	do {
+		ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (ret == -1 && errno == EINTR);
+	if (ret != sizeof(err)) {
+		errno = EACCES;
+		return -1;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	if (fd == -1)
+		errno = err ? err : EACCES;
+	return fd;
+}
+
+/* Open path for the client with credentials cred. Root, and the user the
+ * daemon runs as, get what the daemon can open. For other users, a child
+ * process takes their uid, gid and groups, opens path and passes the
+ * descriptor back, so the source estimated is the one the check was made on.
+ * Returns the descriptor, or -1 with errno set. */
+static int peer_open(struct ucred *cred, const char *path)
+{
+	gid_t groups[MAX_PEER_GROUPS];
+	int num_groups = MAX_PEER_GROUPS;
+	struct passwd pw, *pwp = NULL;
+	char buf[4096];
+	int sv[2];
+	int fd, err, status;
+	pid_t pid;
+
+	if (cred->uid == 0 || cred->uid == geteuid())
+		return open(path, O_RDONLY | O_CLOEXEC);
+	if (geteuid() != 0) {
+		errno = EACCES;
+		return -1;
+	}
+	if (getpwuid_r(cred->uid, &pw, buf, sizeof(buf), &pwp) || !pwp ||
+			getgrouplist(pw.pw_name, cred->gid, groups, &num_groups) == -1) {
+		groups[0] = cred->gid;
+		num_groups = 1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+		return -1;
+	pid = fork();
+	if (pid == -1) {
+		err = errno;
+		close(sv[0]);
+		close(sv[1]);
+		errno = err;
+		return -1;
+	}
+	if (!pid) {
+		close(sv[0]);
+		if (setgroups(num_groups, groups) || setgid(cred->gid) || setuid(cred->uid))
+			_exit(send_fd(sv[1], -1, EACCES) ? 1 : 0);
+		fd = open(path, O_RDONLY);
+		_exit(send_fd(sv[1], fd, (fd == -1) ? errno : 0) ? 1 : 0);
+	}
+	close(sv[1]);
+	fd = recv_fd(sv[0]);
+	err = errno;
+	close(sv[0]);
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+	errno = err;
+	return fd;
+}
+
+/* Serve one connection: read its request, attach it to a job and stream the
+ * progress of the job until it ends or the client goes away */
+static void *client_thread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	char line[MAX_REQUEST_LEN];
+	struct comprestimator_options opts;
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	struct job *job;
+	struct timespec deadline;
+	uint64_t seen = 0, last_progress = 0;
+	size_t len = 0;
+	ssize_t ret;
+	char *path;
+	int shared;
+	int status;
+	int src_fd;
+	char *nl = NULL;
+
+	while (!nl && len < sizeof(line) - 1) {
+		ret = recv(fd, line + len, sizeof(line) - 1 - len, 0);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			goto out;
+		len += ret;
+		line[len] = '\0';
+		nl = strchr(line, '\n');
+	}
+	if (!nl) {
+		send_error(fd, NULL, "request too long");
+		goto out;
+	}
+	*nl = '\0';
+	if (nl > line && nl[-1] == '\r')
+		nl[-1] = '\0';
+
+	if (!strcmp(line, "status")) {
+		send_status(fd);
+		goto out;
+	}
+	if (parse_request(line, &opts, &path) || opts.target_error < 0) {
+		send_error(fd, NULL, "bad request");
+		goto out;
+	}
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
+		send_error(fd, path, "permission denied");
+		goto out;
+	}
+	src_fd = peer_open(&cred, path);
+	if (src_fd == -1) {
+		send_error(fd, path, (errno == EACCES || errno == EPERM) ? "permission denied" :
+				comprestimator_strerror(COMPRESTIMATOR_EIO));
+		goto out;
+	}
+
+	job = job_get(src_fd, path, &opts, &shared, &status);
+	close(src_fd);
+	if (!job) {
+		send_error(fd, path, comprestimator_strerror(status));
+		goto out;
+	}
+	pthread_mutex_lock(&lock);
+
+	while (job->state == JOB_RUNNING) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += PROGRESS_INTERVAL_NS;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&job->cond, &lock, &deadline);
+		if (job->state != JOB_RUNNING)
+			break;
+		if (client_gone(fd))
+			break;
+		if (job->generation == seen || cpe_now_ns() - last_progress < PROGRESS_INTERVAL_NS)
+			continue;
+		seen = job->generation;
+		last_progress = cpe_now_ns();
+		pthread_mutex_unlock(&lock);
+		ret = send_estimate(fd, "progress", job, shared);
+		pthread_mutex_lock(&lock);
+		if (ret)
+			break;
+	}
+
+	if (job->state == JOB_DONE) {
+		pthread_mutex_unlock(&lock);
+		send_estimate(fd, "result", job, shared);
+		pthread_mutex_lock(&lock);
+	} else if (job->state == JOB_FAILED) {
+		pthread_mutex_unlock(&lock);
+		send_error(fd, path, comprestimator_strerror(job->status));
+		pthread_mutex_lock(&lock);
+	}
+	job_put(job);
+	pthread_mutex_unlock(&lock);
+
+out:
+	close(fd);
+	return NULL;
+}
+
+static void cleanup_handler(int signum)
+{
+	unlink(socket_path);
+	exit(signum ? 0 : 1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	pthread_attr_t attr;
+	pthread_t thread;
+	struct stat st;
+	mode_t mask;
+	int listen_fd, fd;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "S:w:b:h")) != -1)
+		switch (c)
+		{
+			case 'S':
+				socket_path = optarg;
+				break;
+			case 'w':
+				num_workers = atoi(optarg);
+				break;
+			case 'b':
+				io_budget = atof(optarg) * 1048576;
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+		}
+
+	if (!num_workers)
+		num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if ((num_workers < 1) || (num_workers > MAX_WORKERS)) {
+		fprintf(stderr, "Number of workers should be between 1 and %d.\n", MAX_WORKERS);
+		usage(argv[0]);
+	}
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error: socket path is too long\n");
+		return 1;
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd == -1) {
+		perror("socket");
+		return 1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	/* A socket left behind by a daemon that is still running must not be
+	 * taken over */
+	if (connect(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "Error: comprestimatord is already listening on %s\n", socket_path);
+		return 1;
+	}
+	close(listen_fd);
+	/* Only a stale socket is removed, never another kind of file */
+	if (lstat(socket_path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "Error: %s exists and is not a socket\n", socket_path);
+			return 1;
+		}
+		unlink(socket_path);
+	}
+	/* Created 0600: only root and the daemon's user can connect */
+	mask = umask(0177);
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("bind");
+		return 1;
+	}
+	umask(mask);
+	if (listen(listen_fd, LISTEN_BACKLOG) == -1) {
+		perror("listen");
+		cleanup_handler(0);
+	}
+
+	signal(SIGINT, cleanup_handler);
+	signal(SIGTERM, cleanup_handler);
+	signal(SIGHUP, cleanup_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&thread, &attr, worker_thread, NULL)) {
+			fprintf(stderr, "Error: failed to start worker threads\n");
+			cleanup_handler(0);
+		}
+	}
+
+	fprintf(stderr, "comprestimatord listening on %s with %d workers", socket_path, num_workers);
+	if (io_budget > 0)
+		fprintf(stderr, " and a budget of %.1f MB/s", io_budget / 1048576);
+	fprintf(stderr, "\n");
+
+	while (1) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			cleanup_handler(0);
+		}
+		if (pthread_create(&thread, &attr, client_thread, (void *)(intptr_t)fd)) {
+			send_error(fd, NULL, "server is out of threads");
+			close(fd);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,1586 @@
+/* libcomprestimator -- sampling and compression engine, and the embeddable
+ * estimation API declared in comprestimator.h
+ */
+
+#define _LARGE_FILES
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "zlib.h"
+#include "comprestimator_int.h"
+
+/* Estimation context of the library API: one worker stepping through the
+ * batches chosen by the sampler, merging each into total */
+struct comprestimator_ctx {
+	off_t dev_size;
+	struct sampler sampler;
+	struct comp_worker worker;
+	struct compression_info total;
+	off_t *pattern;
+	int max_blocks;
+	int done;
+};
+
+/* Result of one sampled stream window */
+struct stream_sample {
+	float ratio;			//compressed/original size, < 0 for a zero block
+	uint8_t level;			//sampling level of the window
+};
+
+/* Streaming estimation: a window is sampled when its random level (geometric,
+ * P(level >= l) = 2^-l) reaches the current level of the stream. When the
+ * kept samples fill up the level is raised and the samples below it are
+ * dropped, which leaves a uniform sample of the stream at half the rate. */
+struct comprestimator_stream {
+	struct comp_worker worker;
+	z_stream strm;			//reset for every window instead of reallocated
+	int strm_init;
+	struct compression_info total;	//published after every sampled window
+	struct compression_info cur;	//counters of the kept samples
+	volatile uint64_t bytes;	//bytes pushed so far
+	unsigned char *window;		//copy of the current window when sampled
+	size_t window_fill;		//bytes of the current window seen
+	int window_level;
+	int window_block;		//block of the window to sample (random mode)
+	int level;
+	struct stream_sample *samples;
+	int num_samples;
+	uint64_t zlib_in;		//exhaustive: bytes into and out of zlib
+	uint64_t zlib_out;
+	int exhaustive;
+	int finished;
+};
+
+/* Monotonic time in nanoseconds */
+uint64_t cpe_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void cpe_phase_add(struct phase_stats *ps, uint64_t ns)
+{
+	int bucket = 0;
+
+	while ((bucket < PROFILE_BUCKETS - 1) && (ns >> (bucket + 1)))
+		bucket++;
+	if (!ps->count || ns < ps->min_ns)
+		ps->min_ns = ns;
+	if (ns > ps->max_ns)
+		ps->max_ns = ns;
+	ps->count++;
+	ps->total_ns += ns;
+	ps->hist[bucket]++;
+}
+
+void cpe_profile_merge(struct worker_profile *dst, struct worker_profile *src)
+{
+	int i, b;
+
+	for (i = 0; i < NUM_PHASES; i++) {
+		struct phase_stats *d = &dst->phase[i];
+		struct phase_stats *s = &src->phase[i];
+
+		if (!s->count)
+			continue;
+		if (!d->count || s->min_ns < d->min_ns)
+			d->min_ns = s->min_ns;
+		if (s->max_ns > d->max_ns)
+			d->max_ns = s->max_ns;
+		d->count += s->count;
+		d->total_ns += s->total_ns;
+		for (b = 0; b < PROFILE_BUCKETS; b++)
+			d->hist[b] += s->hist[b];
+	}
+	dst->runs += src->runs;
+	dst->lifetime_ns += src->lifetime_ns;
+}
+
+/* Upper bound of the histogram bucket holding the given percentile */
+uint64_t cpe_phase_percentile(struct phase_stats *ps, double perc)
+{
+	uint64_t target = (uint64_t)ceil(ps->count * perc / 100.0);
+	uint64_t seen = 0;
+	int b;
+
+	for (b = 0; b < PROFILE_BUCKETS; b++) {
+		seen += ps->hist[b];
+		if (seen >= target && seen)
+			return min(2ULL << b, (unsigned long long)ps->max_ns);
+	}
+	return ps->max_ns;
+}
+
+void cpe_moments_add(struct moments *m, double x)
+{
+	double delta = x - m->mean;
+
+	m->n++;
+	m->mean += delta / (double)m->n;
+	m->m2 += delta * (x - m->mean);
+}
+
+void cpe_moments_merge(struct moments *dst, struct moments *src)
+{
+	uint64_t n = dst->n + src->n;
+	double delta = src->mean - dst->mean;
+
+	if (!src->n)
+		return;
+	dst->mean += delta * ((double)src->n / (double)n);
+	dst->m2 += src->m2 + delta * delta * ((double)dst->n * (double)src->n / (double)n);
+	dst->n = n;
+}
+
+/* Population variance */
+double cpe_moments_var(struct moments *m)
+{
+	return m->n ? (m->m2 / (double)m->n) : 0;
+}
+
+/* Copy the counters of src into the shared slot dst */
+void cpe_info_commit(struct compression_info *dst, struct compression_info *src)
+{
+	stats_write_begin(&dst->seq);
+	dst->num_zero_blocks = src->num_zero_blocks;
+	dst->num_non_zero_blocks = src->num_non_zero_blocks;
+	dst->total_blocks_read = src->total_blocks_read;
+	dst->num_repeated_blocks = src->num_repeated_blocks;
+	dst->ratio = src->ratio;
+	dst->cluster = src->cluster;
+	stats_write_end(&dst->seq);
+}
+
+/* Take a consistent copy of a slot that may be written concurrently */
+void cpe_info_snapshot(struct compression_info *src, struct compression_info *dst)
+{
+	uint32_t s;
+
+	do {
+		s = stats_read_begin(&src->seq);
+		dst->num_zero_blocks = src->num_zero_blocks;
+		dst->num_non_zero_blocks = src->num_non_zero_blocks;
+		dst->total_blocks_read = src->total_blocks_read;
+		dst->num_repeated_blocks = src->num_repeated_blocks;
+		dst->ratio = src->ratio;
+		dst->cluster = src->cluster;
+	} while (stats_read_retry(&src->seq, s));
+	dst->seq = 0;
+}
+
+/* Merge the counters of src into dst (under dst's seq) */
+void cpe_info_merge(struct compression_info *dst, struct compression_info *src)
+{
+	stats_write_begin(&dst->seq);
+	dst->num_zero_blocks += src->num_zero_blocks;
+	dst->num_non_zero_blocks += src->num_non_zero_blocks;
+	dst->total_blocks_read += src->total_blocks_read;
+	dst->num_repeated_blocks += src->num_repeated_blocks;
+	cpe_moments_merge(&dst->ratio, &src->ratio);
+	dst->cluster.clusters += src->cluster.clusters;
+	dst->cluster.n += src->cluster.n;
+	dst->cluster.n2 += src->cluster.n2;
+	dst->cluster.a += src->cluster.a;
+	dst->cluster.a2 += src->cluster.a2;
+	dst->cluster.an += src->cluster.an;
+	dst->cluster.s += src->cluster.s;
+	dst->cluster.s2 += src->cluster.s2;
+	dst->cluster.sa += src->cluster.sa;
+	stats_write_end(&dst->seq);
+}
+
+/* Hoeffding bound for the mean of n samples in [0,1] */
+double cpe_hoeffding_bound(double n)
+{
+	return sqrt(16.82/(2*n));
+}
+
+/* Empirical Bernstein bound (Maurer & Pontil) for the mean of n samples in
+ * [0,1] with unbiased sample variance var:
+	err <= sqrt(2*var*ln(4/\delta)/n) + 7*ln(4/\delta)/(3*(n-1))
+	If \delta= 10^{-7} then ln(4/\delta) <= 17.51
+ * It only needs a fraction of the Hoeffding sample size when the variance is
+ * low. */
+double cpe_bernstein_bound(double var, double n)
+{
+	if (n < 2)
+		return 1.0;
+	return sqrt(2*var*17.51/n) + (7*17.51)/(3*(n-1));
+}
+
+/* Design effect of cluster sampling: the variance of the estimates between
+ * clusters (taken as ratio estimators) over the variance that as many
+ * independent samples would have. Samples in a cluster resemble each other,
+ * so they are worth fewer independent ones: n / deff. 1 without clusters,
+ * and never below 1. */
+void cpe_cluster_design_effect(struct compression_info *info, double *deff_zeros, double *deff_comp)
+{
+	struct cluster_sums *c = &info->cluster;
+	double k, p, r, var_clusters, var_samples;
+
+	*deff_zeros = 1;
+	*deff_comp = 1;
+	if (c->clusters < 2 || !c->n)
+		return;
+	k = (double)c->clusters / (double)(c->clusters - 1);
+
+	p = c->a / c->n;
+	var_clusters = k * (c->a2 - 2 * p * c->an + p * p * c->n2) / (c->n * c->n);
+	var_samples = p * (1 - p) / c->n;
+	if (var_samples > 0 && var_clusters > var_samples)
+		*deff_zeros = var_clusters / var_samples;
+
+	if (c->a && info->ratio.n > 1) {
+		r = c->s / c->a;
+		var_clusters = k * (c->s2 - 2 * r * c->sa + r * r * c->a2) / (c->a * c->a);
+		var_samples = info->ratio.m2 / (double)(info->ratio.n - 1) / c->a;
+		if (var_samples > 0 && var_clusters > var_samples)
+			*deff_comp = var_clusters / var_samples;
+	}
+}
+
+/* Confidence bounds of the aggregated statistics */
+void cpe_confidence_bounds(struct compression_info *info, double *conf_zeros, double *conf_comp)
+{
+	int total_samples = info->num_zero_blocks + info->num_non_zero_blocks;
+	double non_zero_frac = (double)info->num_non_zero_blocks / total_samples;
+	double var_zeros = 0, var_comp = 0;
+	double deff_zeros, deff_comp, n_zeros, n_comp;
+
+	/* A sniffed file weighs as many samples as it stands for, but is one
+	 * observation: its repeats do not narrow the bounds */
+	cpe_cluster_design_effect(info, &deff_zeros, &deff_comp);
+	n_zeros = (total_samples - info->num_repeated_blocks) / deff_zeros;
+	n_comp = (info->num_non_zero_blocks - info->num_repeated_blocks) / deff_comp;
+
+	/* Basic confidence from a strightforward Hoeffding bound:
+	The bond is err <= sqrt(ln(2/\delta)/ (2*sample_size))
+	If \delta= 10^{-7} then ln(2/\delta) <= 16.82
+	If \delta= 10^{-6} then ln(2/\delta) <= 14.51
+	*/
+    *conf_zeros = cpe_hoeffding_bound(n_zeros);
+    *conf_comp = cpe_hoeffding_bound(n_comp);
+
+	/* Take into account the estimated variance: use the empirical Bernstein
+	 * bound where it is tighter. Zero blocks are Bernoulli samples. */
+	if (total_samples > 1)
+		var_zeros = non_zero_frac * (1 - non_zero_frac) * total_samples / (total_samples - 1);
+	if (info->ratio.n > 1)
+		var_comp = info->ratio.m2 / (double)(info->ratio.n - 1);
+	*conf_zeros = min(*conf_zeros, cpe_bernstein_bound(var_zeros, n_zeros));
+	*conf_comp = min(*conf_comp, cpe_bernstein_bound(var_comp, n_comp));
+}
+
+/* Get the size of the device in bytes (-1 with errno set on failure) */
+off_t cpe_get_dev_size(const char *path)
+{
+	int fd;
+	off_t size;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	size = cpe_get_fd_size(fd);
+	close(fd);
+	return size;
+}
+
+/* The same for a source open as fd */
+off_t cpe_get_fd_size(int fd)
+{
+	return lseek(fd, -1, SEEK_END);
+}
+
+/* Is the block all zeroes? */
+int cpe_is_zero_block(char *buf) {
+	/* I assume memcmp is optimized, so use it by checking if first byte is
+	 * zero, and every byte is the same as the previous */
+	return ((buf[0] == 0) && (!memcmp(buf, buf + 1, INBLOCK_SIZE - 1)));
+}
+
+
+static inline void worker_progress(struct comp_worker *w, int zero_blocks, int non_zero_blocks, int blocks_read)
+{
+	if (w->progress)
+		w->progress(w, zero_blocks, non_zero_blocks, blocks_read);
+}
+
+/* Buffer pool of a worker (see struct buf_pool) */
+#define POOL_ALIGN	64
+
+void cpe_pool_init(struct buf_pool *p)
+{
+	unsigned char *m;
+	size_t skew;
+
+	memset(p, 0, sizeof(struct buf_pool));
+	p->size = POOL_SIZE;
+#ifdef MAP_HUGETLB
+	m = (unsigned char *) mmap(NULL, POOL_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (m != MAP_FAILED) {
+		p->base = m;
+		p->huge = 1;
+		return;
+	}
+#endif
+	/* No huge pages reserved: take an aligned stretch of normal pages
+	 * that khugepaged can back with one */
+	m = (unsigned char *) mmap(NULL, 2 * POOL_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == MAP_FAILED)
+		return;
+	skew = (POOL_SIZE - (uintptr_t)m % POOL_SIZE) % POOL_SIZE;
+	if (skew)
+		munmap(m, skew);
+	munmap(m + skew + POOL_SIZE, POOL_SIZE - skew);
+	p->base = m + skew;
+#ifdef MADV_HUGEPAGE
+	if (madvise(p->base, POOL_SIZE, MADV_HUGEPAGE) == 0)
+		p->huge = 2;
+#endif
+}
+
+static void *pool_carve(struct buf_pool *p, size_t size)
+{
+	void *ptr;
+
+	size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	if (!p->base || p->used + size > p->size)
+		return NULL;
+	ptr = p->base + p->used;
+	p->used += size;
+	return ptr;
+}
+
+/* A buffer kept until cpe_pool_destroy */
+void *cpe_pool_alloc(struct buf_pool *p, size_t size)
+{
+	void *ptr;
+
+	if (p->live)
+		return malloc(size);
+	ptr = pool_carve(p, size);
+	if (!ptr)
+		return malloc(size);
+	p->reserved = p->used;
+	return ptr;
+}
+
+void cpe_pool_free(struct buf_pool *p, void *ptr)
+{
+	if (ptr && (!p->base || (unsigned char *)ptr < p->base || (unsigned char *)ptr >= p->base + p->size))
+		free(ptr);
+}
+
+void cpe_pool_destroy(struct buf_pool *p)
+{
+	if (p->base)
+		munmap(p->base, p->size);
+	memset(p, 0, sizeof(struct buf_pool));
+}
+
+static voidpf pool_zalloc(voidpf opaque, uInt items, uInt size)
+{
+	struct buf_pool *p = (struct buf_pool *) opaque;
+	void *ptr = pool_carve(p, (size_t)items * size);
+
+	if (!ptr)
+		return malloc((size_t)items * size);
+	p->live++;
+	return ptr;
+}
+
+static void pool_zfree(voidpf opaque, voidpf ptr)
+{
+	struct buf_pool *p = (struct buf_pool *) opaque;
+
+	if (!p->base || (unsigned char *)ptr < p->base || (unsigned char *)ptr >= p->base + p->size) {
+		free(ptr);
+		return;
+	}
+	if (!--p->live)
+		p->used = p->reserved;
+}
+
+void cpe_pool_zstream(struct buf_pool *p, z_stream *strm)
+{
+	strm->zalloc = pool_zalloc;
+	strm->zfree = pool_zfree;
+	strm->opaque = p;
+}
+
+/* The deflate state of w at level 1, reset. It is set up once and kept for
+ * all the samples of the worker: setting it up costs more than compressing
+ * a small file. */
+static z_stream *worker_zstream(struct comp_worker *w)
+{
+	z_stream *strm = (z_stream *) w->zstream;
+
+	if (strm)
+		return (deflateReset(strm) == Z_OK) ? strm : NULL;
+	strm = (z_stream *) cpe_pool_alloc(&w->pool, sizeof(z_stream));
+	if (!strm)
+		return NULL;
+	memset(strm, 0, sizeof(z_stream));
+	cpe_pool_zstream(&w->pool, strm);
+	if (deflateInit(strm, 1) != Z_OK) {
+		cpe_pool_free(&w->pool, strm);
+		return NULL;
+	}
+	w->zstream = strm;
+	return strm;
+}
+
+/* Allocate the buffers of a worker (the source is opened by cpe_worker_open) */
+int cpe_worker_init(struct comp_worker *w, uint64_t seed)
+{
+	memset(w, 0, sizeof(struct comp_worker));
+	w->fd = -1;
+	w->rng = seed;
+
+	cpe_pool_init(&w->pool);
+	w->inbuf = (unsigned char *) cpe_pool_alloc(&w->pool, INBLOCK_SIZE);
+	w->outbuf = (unsigned char *) cpe_pool_alloc(&w->pool, OUTBLOCK_SIZE);
+	if (!w->inbuf || !w->outbuf) {
+		cpe_worker_destroy(w);
+		return COMPRESTIMATOR_ENOMEM;
+	}
+	return COMPRESTIMATOR_OK;
+}
+
+/* pread from the source of w, or from its data in memory */
+ssize_t cpe_worker_pread(struct comp_worker *w, void *buf, size_t len, off_t off)
+{
+	if (!w->mem)
+		return pread(w->fd, buf, len, off);
+	if ((size_t)off >= w->mem_size)
+		return 0;
+	len = min(len, w->mem_size - off);
+	memcpy(buf, w->mem + off, len);
+	return len;
+}
+
+int cpe_worker_open(struct comp_worker *w, const char *path)
+{
+	uint64_t t0;
+
+	t0 = profile_start(w->profile);
+	w->fd = open(path, O_RDONLY);
+	profile_end(w->profile, PHASE_OPEN, t0);
+	if (w->fd == -1)
+		return COMPRESTIMATOR_EIO;
+	return COMPRESTIMATOR_OK;
+}
+
+void cpe_worker_destroy(struct comp_worker *w)
+{
+	if (w->fd != -1)
+		close(w->fd);
+	w->fd = -1;
+	if (w->zstream) {
+		deflateEnd((z_stream *) w->zstream);
+		cpe_pool_free(&w->pool, w->zstream);
+		w->zstream = NULL;
+	}
+	cpe_pool_free(&w->pool, w->inbuf);
+	cpe_pool_free(&w->pool, w->outbuf);
+	w->inbuf = NULL;
+	w->outbuf = NULL;
+	cpe_pool_destroy(&w->pool);
+}
+
+/* 64-bit hash of buf, chained through seed */
+uint64_t cpe_hash64(const void *buf, size_t len, uint64_t seed)
+{
+	const unsigned char *p = (const unsigned char *) buf;
+	uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+	uint64_t v;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, 8);
+		h = (h ^ (v * 0xbf58476d1ce4e5b9ULL)) * 0x94d049bb133111ebULL;
+		h ^= h >> 29;
+	}
+	for (; len; len--, p++)
+		h = (h ^ *p) * 0x100000001b3ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+void cpe_hll_add(struct hll *h, uint64_t hash)
+{
+	uint64_t rest;
+	uint8_t rank;
+
+	/* cpe_hash64 mixes well within a chunk but its top bits pick the register
+	 * here, so finish it like splitmix64 */
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	hash ^= hash >> 31;
+
+	rest = (hash << HLL_BITS) | (1ULL << (HLL_BITS - 1));
+	rank = __builtin_clzll(rest) + 1;
+	if (rank > h->reg[hash >> (64 - HLL_BITS)])
+		h->reg[hash >> (64 - HLL_BITS)] = rank;
+	h->chunks++;
+}
+
+void cpe_hll_merge(struct hll *dst, struct hll *src)
+{
+	int i;
+
+	for (i = 0; i < (1 << HLL_BITS); i++)
+		if (src->reg[i] > dst->reg[i])
+			dst->reg[i] = src->reg[i];
+	dst->chunks += src->chunks;
+}
+
+/* Estimated number of distinct chunks (Flajolet et al., with linear counting
+ * while registers are still empty) */
+double cpe_hll_count(struct hll *h)
+{
+	double m = 1 << HLL_BITS;
+	double sum = 0, est;
+	int i, zeros = 0;
+
+	for (i = 0; i < (1 << HLL_BITS); i++) {
+		sum += ldexp(1.0, -h->reg[i]);
+		if (!h->reg[i])
+			zeros++;
+	}
+	est = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+	if (est <= 2.5 * m && zeros)
+		est = m * log(m / zeros);
+	return min(est, (double)h->chunks);
+}
+
+/* Add a block read by the exhaustive pass at off to the current dedup chunk,
+ * adding the chunk to the sketch once complete */
+static void dedup_block(struct comp_worker *w, off_t off, int zero)
+{
+	struct dedup_chunk *dc = &w->dedup;
+
+	if (off % dc->size == 0 || !dc->pending) {
+		dc->pending = 1;
+		dc->zero = 1;
+		dc->hash = 0;
+	}
+	dc->hash = cpe_hash64(w->inbuf, INBLOCK_SIZE, dc->hash);
+	dc->zero &= zero;
+	if ((off + INBLOCK_SIZE) % dc->size == 0) {
+		if (!dc->zero)
+			cpe_hll_add(dc->hll, dc->hash);
+		dc->pending = 0;
+	}
+}
+
+/* Sample one block: compress from start (random if < 0) in it, continuing
+ * into the following non-zero blocks, until one output block is filled. With
+ * fp, also record the sample and the hash of the blocks it read there. */
+static int compress_sample(struct comp_worker *w, off_t read_location, long start, struct sample_fingerprint *fp)
+{
+	unsigned char *inbuf = w->inbuf;
+	unsigned char *outbuf = w->outbuf;
+	struct compression_info *info = &w->info;
+	int ret;
+	ssize_t bytes_read;		//return value of pread
+	off_t end_of_comp_stream;	//end of compression stream
+	size_t zlib_input_bytes = 0;	//total bytes passed into zlib
+	size_t zlib_output_bytes = 0;	//total bytes output from zlib
+	int buffer_size;
+	z_stream *strm;
+	long int random_num;
+	unsigned char *bufptr;
+	size_t ti,saved_ti;
+	uint64_t hash = 0;
+	uint32_t blocks = 1;
+
+	uint64_t t0;
+
+	t0 = profile_start(w->profile);
+	bytes_read = cpe_worker_pread(w, inbuf, INBLOCK_SIZE, read_location);
+	profile_end(w->profile, PHASE_READ, t0);
+	if (bytes_read == -1)
+		return COMPRESTIMATOR_EIO;
+	if (bytes_read == 0)
+		return COMPRESTIMATOR_OK;
+	/* A short block at the end of a file only counts what was read */
+	if (bytes_read < INBLOCK_SIZE)
+		memset(inbuf + bytes_read, 0, INBLOCK_SIZE - bytes_read);
+	info->total_blocks_read++;
+	if (fp)
+		hash = cpe_hash64(inbuf, INBLOCK_SIZE, 0);
+
+	t0 = profile_start(w->profile);
+	ret = cpe_is_zero_block((char *) inbuf);
+	profile_end(w->profile, PHASE_ZERO_CHECK, t0);
+	if (ret) {
+		info->num_zero_blocks++;
+		if (fp) {
+			fp->hash = hash;
+			fp->blocks = 1;
+			fp->start = 0;
+			fp->ratio = -1;
+		}
+		worker_progress(w, info->num_zero_blocks, info->num_non_zero_blocks, info->total_blocks_read);
+		return COMPRESTIMATOR_OK;
+	}
+
+	info->num_non_zero_blocks++;
+
+	random_num = (start >= 0 && start < bytes_read) ? start : (long)(rand_next(&w->rng) % bytes_read);
+	buffer_size = bytes_read - random_num;
+	end_of_comp_stream = read_location + COMP_UNIT_SIZE + COMP_UNIT_SIZE; //+1 ?????
+
+	strm = worker_zstream(w);
+	if (!strm)
+		return COMPRESTIMATOR_EZLIB;
+
+	strm->next_out = outbuf;
+	strm->avail_out = OUTBLOCK_SIZE;
+	strm->next_in = inbuf + random_num;
+	bufptr = inbuf + random_num;
+	strm->avail_in = min((int)buffer_size, ZLIB_BLOCK_SIZE);
+
+	do {
+		saved_ti = strm->total_in;
+
+		t0 = profile_start(w->profile);
+		ret = deflate_cont(strm, Z_SYNC_FLUSH);
+		profile_end(w->profile, PHASE_DEFLATE, t0);
+		if (ret != Z_OK)
+			return COMPRESTIMATOR_EZLIB;
+
+		ti = strm->total_in;
+		
+		buffer_size -= (ti-saved_ti);
+        bufptr += (ti-saved_ti);
+		
+		/* If we already filled the output buffer, we can stop */
+		if (strm->avail_out == 0)
+			goto done;
+
+		if (buffer_size <= 0) {
+			do {
+				read_location += INBLOCK_SIZE;
+				t0 = profile_start(w->profile);
+				bytes_read = cpe_worker_pread(w, inbuf, INBLOCK_SIZE, read_location);
+				profile_end(w->profile, PHASE_READ, t0);
+				if (bytes_read == -1)
+					return COMPRESTIMATOR_EIO;
+				/* The stream ends with the source */
+				if (bytes_read == 0)
+					goto done;
+				if (bytes_read < INBLOCK_SIZE)
+					memset(inbuf + bytes_read, 0, INBLOCK_SIZE - bytes_read);
+				bufptr = inbuf;
+				info->total_blocks_read++;
+				blocks++;
+				if (fp)
+					hash = cpe_hash64(inbuf, INBLOCK_SIZE, hash);
+				t0 = profile_start(w->profile);
+				ret = cpe_is_zero_block((char *) inbuf);
+				profile_end(w->profile, PHASE_ZERO_CHECK, t0);
+			} while (ret && (read_location < end_of_comp_stream));
+
+			if (read_location >= end_of_comp_stream) {
+				goto done;
+			}
+
+			buffer_size = bytes_read;
+		}
+
+		strm->next_in = bufptr;
+		strm->avail_in = min(buffer_size, ZLIB_BLOCK_SIZE);
+	} while (strm->avail_out);
+
+done:
+
+	zlib_input_bytes = strm->total_in;
+	zlib_output_bytes = strm->total_out;
+	cpe_moments_add(&info->ratio, (double)zlib_output_bytes/(double)zlib_input_bytes);
+	if (fp) {
+		fp->hash = hash;
+		fp->blocks = blocks;
+		fp->start = random_num;
+		fp->ratio = (double)zlib_output_bytes/(double)zlib_input_bytes;
+	}
+	worker_progress(w, info->num_zero_blocks, info->num_non_zero_blocks, info->total_blocks_read);
+	return COMPRESTIMATOR_OK;
+}
+
+/* Cluster sampling: read the blocks contiguous blocks at loc at once and
+ * take every one of them as a sample. A zero block counts as such. A
+ * non-zero block is compressed as by compress_sample, from a random start
+ * in it through the next non-zero blocks of the cluster until an output
+ * block is full. The sums of the cluster go to w->info.cluster too. buf
+ * holds blocks blocks. */
+int cpe_compress_cluster(struct comp_worker *w, off_t loc, unsigned char *buf, uint32_t blocks)
+{
+	struct compression_info *info = &w->info;
+	struct cluster_sums *c = &info->cluster;
+	size_t size = (size_t)blocks * INBLOCK_SIZE;
+	size_t got = 0, buffer_size, consumed;
+	unsigned char *bufptr, *zero;
+	uint32_t b, nb, num_zero = 0, non_zero = 0;
+	double ratio, ratio_sum = 0, n, a;
+	ssize_t bytes_read;
+	z_stream *strm;
+	uint64_t t0;
+	int ret = COMPRESTIMATOR_OK;
+
+	t0 = profile_start(w->profile);
+	while (got < size) {
+		bytes_read = pread(w->fd, buf + got, size - got, loc + got);
+		if (bytes_read == -1) {
+			if (errno == EINTR)
+				continue;
+			return COMPRESTIMATOR_EIO;
+		}
+		if (!bytes_read)
+			break;
+		got += bytes_read;
+	}
+	profile_end(w->profile, PHASE_READ, t0);
+	blocks = (got + INBLOCK_SIZE - 1) / INBLOCK_SIZE;
+	if (got < (size_t)blocks * INBLOCK_SIZE)
+		memset(buf + got, 0, (size_t)blocks * INBLOCK_SIZE - got);
+
+	/* One zero check per block, kept in the pool */
+	zero = (unsigned char *) cpe_pool_alloc(&w->pool, blocks);
+	if (!zero)
+		return COMPRESTIMATOR_ENOMEM;
+	t0 = profile_start(w->profile);
+	for (b = 0; b < blocks; b++)
+		zero[b] = cpe_is_zero_block((char *) buf + (size_t)b * INBLOCK_SIZE);
+	profile_end(w->profile, PHASE_ZERO_CHECK, t0);
+
+	strm = worker_zstream(w);
+	if (!strm) {
+		cpe_pool_free(&w->pool, zero);
+		return COMPRESTIMATOR_EZLIB;
+	}
+
+	t0 = profile_start(w->profile);
+	for (b = 0; b < blocks && !ret; b++) {
+		if (zero[b]) {
+			num_zero++;
+			continue;
+		}
+
+		deflateReset(strm);
+		strm->next_out = w->outbuf;
+		strm->avail_out = OUTBLOCK_SIZE;
+		buffer_size = INBLOCK_SIZE - rand_next(&w->rng) % INBLOCK_SIZE;
+		bufptr = buf + (size_t)(b + 1) * INBLOCK_SIZE - buffer_size;
+		nb = b;
+		for (;;) {
+			while (buffer_size && strm->avail_out) {
+				strm->next_in = bufptr;
+				strm->avail_in = min(buffer_size, (size_t)ZLIB_BLOCK_SIZE);
+				if (deflate_cont(strm, Z_SYNC_FLUSH) != Z_OK) {
+					ret = COMPRESTIMATOR_EZLIB;
+					break;
+				}
+				consumed = strm->next_in - bufptr;
+				bufptr += consumed;
+				buffer_size -= consumed;
+			}
+			if (!strm->avail_out || ret)
+				break;
+			/* The stream skips zero blocks and ends with the cluster */
+			while (++nb < blocks && zero[nb])
+				;
+			if (nb == blocks)
+				break;
+			bufptr = buf + (size_t)nb * INBLOCK_SIZE;
+			buffer_size = INBLOCK_SIZE;
+		}
+		ratio = (double)strm->total_out / (double)strm->total_in;
+		non_zero++;
+		ratio_sum += ratio;
+		cpe_moments_add(&info->ratio, ratio);
+	}
+	profile_end(w->profile, PHASE_DEFLATE, t0);
+	cpe_pool_free(&w->pool, zero);
+	if (ret)
+		return ret;
+
+	info->num_zero_blocks += num_zero;
+	info->num_non_zero_blocks += non_zero;
+	info->total_blocks_read += blocks;
+	n = num_zero + non_zero;
+	a = non_zero;
+	c->clusters++;
+	c->n += n;
+	c->n2 += n * n;
+	c->a += a;
+	c->a2 += a * a;
+	c->an += a * n;
+	c->s += ratio_sum;
+	c->s2 += ratio_sum * ratio_sum;
+	c->sa += ratio_sum * a;
+	worker_progress(w, info->num_zero_blocks, info->num_non_zero_blocks, info->total_blocks_read);
+	return COMPRESTIMATOR_OK;
+}
+
+int cpe_compress_chunk_random(struct comp_worker *w, off_t read_location)
+{
+	return compress_sample(w, read_location, -1, NULL);
+}
+
+/* Compress the non-zero blocks of a captured sample from start in the first
+ * one, fed to zlib block by block like compress_sample does, until one output
+ * block is filled. strm is initialized by the caller (at the level to
+ * evaluate) and reset here. Sets ratio to compressed/original size. */
+int cpe_compress_blocks_mem(z_stream *strm, unsigned char *outbuf, const unsigned char *data, uint32_t blocks,
+		uint32_t start, double *ratio)
+{
+	const unsigned char *bufptr = data + start;
+	size_t buffer_size = INBLOCK_SIZE - start;
+	uint32_t b = 0;
+	size_t consumed;
+
+	if (deflateReset(strm) != Z_OK)
+		return COMPRESTIMATOR_EZLIB;
+	strm->next_out = outbuf;
+	strm->avail_out = OUTBLOCK_SIZE;
+
+	while (strm->avail_out) {
+		if (!buffer_size) {
+			if (++b == blocks)
+				break;
+			bufptr = data + (size_t)b * INBLOCK_SIZE;
+			buffer_size = INBLOCK_SIZE;
+		}
+		strm->next_in = (unsigned char *) bufptr;
+		strm->avail_in = min(buffer_size, (size_t)ZLIB_BLOCK_SIZE);
+		if (deflate_cont(strm, Z_SYNC_FLUSH) != Z_OK)
+			return COMPRESTIMATOR_EZLIB;
+		consumed = strm->next_in - bufptr;
+		bufptr += consumed;
+		buffer_size -= consumed;
+	}
+
+	*ratio = strm->total_in ? (double)strm->total_out / (double)strm->total_in : 0;
+	return COMPRESTIMATOR_OK;
+}
+
+/* Take the sample fp: if the blocks it read last time still hash the same,
+ * count its recorded result without compressing, otherwise compress it
+ * again (from the same start) and record the new result. A record of 0
+ * blocks is a fresh sample. */
+int cpe_compress_chunk_fingerprint(struct comp_worker *w, struct sample_fingerprint *fp)
+{
+	struct compression_info *info = &w->info;
+	ssize_t bytes_read;
+	uint64_t hash = 0;
+	uint64_t t0;
+	uint32_t b;
+
+	fp->flags &= ~FP_REUSED;
+	if (!fp->blocks)
+		return compress_sample(w, fp->offset, -1, fp);
+
+	for (b = 0; b < fp->blocks; b++) {
+		t0 = profile_start(w->profile);
+		bytes_read = pread(w->fd, w->inbuf, INBLOCK_SIZE, fp->offset + (off_t)b * INBLOCK_SIZE);
+		profile_end(w->profile, PHASE_READ, t0);
+		if (bytes_read == -1)
+			return COMPRESTIMATOR_EIO;
+		if (bytes_read == 0)
+			break;
+		if (bytes_read < INBLOCK_SIZE)
+			memset(w->inbuf + bytes_read, 0, INBLOCK_SIZE - bytes_read);
+		hash = cpe_hash64(w->inbuf, INBLOCK_SIZE, hash);
+	}
+	if (b < fp->blocks || hash != fp->hash)
+		return compress_sample(w, fp->offset, fp->start, fp);
+
+	info->total_blocks_read += fp->blocks;
+	if (fp->ratio < 0) {
+		info->num_zero_blocks++;
+	} else {
+		info->num_non_zero_blocks++;
+		cpe_moments_add(&info->ratio, fp->ratio);
+	}
+	fp->flags |= FP_REUSED;
+	worker_progress(w, info->num_zero_blocks, info->num_non_zero_blocks, info->total_blocks_read);
+	return COMPRESTIMATOR_OK;
+}
+
+/* Compress the blocks of the pattern as one stream, skipping zero blocks, and
+ * set the statistics of w to the result */
+int cpe_compress_chunks_sequential(struct comp_worker *w, off_t *pattern, int pattern_size)
+{
+	unsigned char *inbuf = w->inbuf;
+	unsigned char *outbuf = w->outbuf;
+	struct compression_info *info = &w->info;
+	int ret;
+	int index = 0;
+	unsigned char *bufptr;
+	ssize_t bytes_read;		//return value of pread
+	size_t zlib_input_bytes = 0;	//total bytes passed into zlib
+	size_t zlib_output_bytes = 0;	//total bytes output from zlib
+	int buffer_size = 0;		//how much space we have in inbuf
+	z_stream *strm;
+	int zero_blocks = 0;
+	int non_zero_blocks = 0;
+	int saved_ai, ti,saved_ti;
+	uint64_t t0;
+	
+	strm = worker_zstream(w);
+	if (!strm)
+		return COMPRESTIMATOR_EZLIB;
+
+	strm->next_out = outbuf;
+	strm->avail_out = OUTBLOCK_SIZE;
+
+	while(1) {
+		/* get more data into inbuf */
+		if (buffer_size <= 0) {
+			while (1) {
+				if (index == pattern_size)
+					goto done;
+
+				t0 = profile_start(w->profile);
+				bytes_read = cpe_worker_pread(w, inbuf, INBLOCK_SIZE, pattern[index]);
+				profile_end(w->profile, PHASE_READ, t0);
+				if (bytes_read == -1)
+					return COMPRESTIMATOR_EIO;
+				if (bytes_read < INBLOCK_SIZE)
+					memset(inbuf + bytes_read, 0, INBLOCK_SIZE - bytes_read);
+				index++;
+				if (!(index % STATS_PUBLISH_BLOCKS))
+					worker_progress(w, zero_blocks, non_zero_blocks, index);
+
+				t0 = profile_start(w->profile);
+				ret = cpe_is_zero_block((char *) inbuf);
+				profile_end(w->profile, PHASE_ZERO_CHECK, t0);
+				if (w->dedup.hll)
+					dedup_block(w, pattern[index - 1], ret);
+				if (ret) {
+					zero_blocks++;
+				} else {
+					break;
+				}
+			}
+
+			non_zero_blocks++;
+
+			buffer_size = bytes_read;
+			strm->next_in = inbuf;
+			bufptr = inbuf;
+			strm->avail_in = min(buffer_size, ZLIB_BLOCK_SIZE);
+		}
+
+		saved_ai = strm->avail_in;
+		saved_ti = strm->total_in;
+
+		t0 = profile_start(w->profile);
+		ret = deflate_cont(strm, Z_SYNC_FLUSH);
+		profile_end(w->profile, PHASE_DEFLATE, t0);
+		if (ret != Z_OK)
+			return COMPRESTIMATOR_EZLIB;
+		ti = strm->total_in;
+
+		/* deflate took more than it was given */
+		if ((ti-saved_ti) > saved_ai)
+			return COMPRESTIMATOR_EZLIB;
+		buffer_size -= (ti-saved_ti);
+		bufptr += (ti-saved_ti);
+		strm->next_in = bufptr;
+
+		if (strm->avail_in <= 0) {
+			strm->avail_in = min((int)buffer_size, ZLIB_BLOCK_SIZE);
+		}
+
+		if (strm->avail_out <= 0) {
+			zlib_input_bytes += strm->total_in;
+			zlib_output_bytes += strm->total_out;
+			deflateReset(strm);
+			strm->next_out = outbuf;
+			strm->next_in = bufptr;
+			strm->avail_out = OUTBLOCK_SIZE;
+			strm->avail_in = min((int)buffer_size, ZLIB_BLOCK_SIZE);
+		}
+	}
+
+done:
+	/* A chunk cut short by the end of the source */
+	if (w->dedup.hll && w->dedup.pending) {
+		if (!w->dedup.zero)
+			cpe_hll_add(w->dedup.hll, w->dedup.hash);
+		w->dedup.pending = 0;
+	}
+
+	if (zlib_input_bytes) {
+		/* One ratio for the whole pass, weighted as non_zero_blocks samples */
+		info->ratio.n = non_zero_blocks;
+		info->ratio.mean = (double)zlib_output_bytes/(double)zlib_input_bytes;
+		info->ratio.m2 = 0;
+	}
+	info->num_non_zero_blocks = non_zero_blocks;		
+	info->num_zero_blocks = zero_blocks;
+	info->total_blocks_read = (zero_blocks + non_zero_blocks);
+	return COMPRESTIMATOR_OK;
+}
+
+void cpe_sampler_init(struct sampler *s, off_t dev_size, int exhaustive, uint64_t seed, double target_error)
+{
+	memset(s, 0, sizeof(struct sampler));
+	s->exhaustive = exhaustive;
+	s->num_chunks = dev_size / INBLOCK_SIZE;
+	s->rng = seed;
+	s->target_error = target_error ? target_error : cpe_hoeffding_bound(MAX_NUM_SAMPLE);
+	s->max_samples = MAX_NUM_SAMPLE;
+}
+
+/* Fill pattern with up to max_blocks blocks to read next. Returns the number
+ * of blocks, or 0 when the sampling is done given the statistics in info. */
+int cpe_sampler_next(struct sampler *s, off_t *pattern, int max_blocks, struct compression_info *info)
+{
+	int i = 0;
+	double conf_zeros, conf_comp;
+	double deff_zeros, deff_comp;
+
+	//Each process gets a consecutive chunk, which may cause seeks - optimize
+	//later so that processes read more in parallel.
+	if (s->exhaustive) {
+		while ((i < max_blocks) && (s->cur_chunk < s->num_chunks)) {
+			pattern[i] = s->cur_chunk * INBLOCK_SIZE;
+			s->cur_chunk++;
+			i++;
+		}
+	} else if (s->fixed_samples) {
+		/* The samples of a shard are not cut short by what they find, so
+		 * that the shards all sample at the same rate */
+		if (s->drawn >= s->fixed_samples)
+			return 0;
+		max_blocks = min(max_blocks, s->fixed_samples - s->drawn);
+	} else if (s->cluster_blocks && (off_t)s->drawn * s->cluster_blocks >= s->num_chunks - s->first_chunk) {
+		/* Clusters so alike that as much as the source was read */
+		return 0;
+	} else if (!s->cluster_blocks || info->cluster.clusters >= MIN_NUM_CLUSTERS) {
+		/* Clustered samples count for what they are worth */
+		cpe_cluster_design_effect(info, &deff_zeros, &deff_comp);
+		if ((info->num_non_zero_blocks / deff_comp >= s->max_samples) ||
+				(info->num_zero_blocks / deff_zeros >= ((double)s->max_samples * ZERO_BLOCK_FACTOR)))
+			return 0;
+		/* Stop early once the variance aware bounds reach the target */
+		if (info->num_non_zero_blocks >= MIN_NUM_SAMPLE) {
+			cpe_confidence_bounds(info, &conf_zeros, &conf_comp);
+			if ((conf_zeros <= s->target_error) && (conf_comp <= s->target_error))
+				return 0;
+		}
+	}
+
+	if (!s->exhaustive && s->cluster_blocks) {
+		off_t num_clusters = (s->num_chunks - s->first_chunk) / s->cluster_blocks;
+
+		while (i < max_blocks) {
+			pattern[i] = (s->first_chunk + (off_t)(rand_next(&s->rng) % num_clusters) * s->cluster_blocks) * INBLOCK_SIZE;
+			i++;
+		}
+		s->drawn += i;
+	} else if (!s->exhaustive) {
+		while (i < max_blocks) {
+			pattern[i] = (s->first_chunk + (off_t)(rand_next(&s->rng) % (s->num_chunks - s->first_chunk))) * INBLOCK_SIZE;
+			i++;
+		}
+		s->drawn += i;
+	}
+
+	return i;
+}
+
+EXPORT void comprestimator_default_options(struct comprestimator_options *opts)
+{
+	memset(opts, 0, sizeof(struct comprestimator_options));
+}
+
+EXPORT int comprestimator_open(comprestimator_ctx **ctxp, const char *path, const struct comprestimator_options *opts)
+{
+	int fd, ret;
+
+	if (!ctxp || !path)
+		return COMPRESTIMATOR_EINVAL;
+	*ctxp = NULL;
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return COMPRESTIMATOR_EIO;
+	ret = comprestimator_open_fd(ctxp, fd, opts);
+	close(fd);
+	return ret;
+}
+
+EXPORT int comprestimator_open_fd(comprestimator_ctx **ctxp, int fd, const struct comprestimator_options *opts)
+{
+	struct comprestimator_options defaults;
+	comprestimator_ctx *ctx;
+	uint64_t seed;
+	int ret;
+
+	if (!ctxp || fd < 0)
+		return COMPRESTIMATOR_EINVAL;
+	*ctxp = NULL;
+	if (!opts) {
+		comprestimator_default_options(&defaults);
+		opts = &defaults;
+	}
+	if (opts->target_error < 0)
+		return COMPRESTIMATOR_EINVAL;
+
+	ctx = (comprestimator_ctx *) calloc(1, sizeof(comprestimator_ctx));
+	if (!ctx)
+		return COMPRESTIMATOR_ENOMEM;
+	ctx->worker.fd = -1;
+
+	ctx->dev_size = cpe_get_fd_size(fd);
+	if (ctx->dev_size == -1) {
+		ret = COMPRESTIMATOR_EIO;
+		goto err;
+	}
+	if (ctx->dev_size / INBLOCK_SIZE < 1) {
+		ret = COMPRESTIMATOR_ETOOSMALL;
+		goto err;
+	}
+
+	seed = opts->seed ? opts->seed : ((uint64_t)time(NULL) ^ cpe_now_ns());
+	cpe_sampler_init(&ctx->sampler, ctx->dev_size, opts->exhaustive, seed, opts->target_error);
+
+	ret = cpe_worker_init(&ctx->worker, rand_next(&ctx->sampler.rng));
+	if (ret)
+		goto err;
+	ctx->worker.fd = dup(fd);
+	if (ctx->worker.fd == -1) {
+		ret = COMPRESTIMATOR_EIO;
+		goto err;
+	}
+
+	ctx->max_blocks = opts->exhaustive ? (COMP_UNIT_SIZE / INBLOCK_SIZE) : BLOCKS_PER_PROC;
+	ctx->pattern = (off_t *) malloc(sizeof(off_t) * ctx->max_blocks);
+	if (!ctx->pattern) {
+		ret = COMPRESTIMATOR_ENOMEM;
+		goto err;
+	}
+
+	*ctxp = ctx;
+	return COMPRESTIMATOR_OK;
+
+err:
+	comprestimator_close(ctx);
+	return ret;
+}
+
+EXPORT int comprestimator_step(comprestimator_ctx *ctx)
+{
+	struct compression_info agg;
+	int pattern_size;
+	int i;
+	int ret = COMPRESTIMATOR_OK;
+
+	if (!ctx)
+		return COMPRESTIMATOR_EINVAL;
+	if (ctx->done)
+		return COMPRESTIMATOR_DONE;
+
+	cpe_info_snapshot(&ctx->total, &agg);
+	pattern_size = cpe_sampler_next(&ctx->sampler, ctx->pattern, ctx->max_blocks, &agg);
+	if (!pattern_size) {
+		ctx->done = 1;
+		return COMPRESTIMATOR_DONE;
+	}
+
+	memset(&ctx->worker.info, 0, sizeof(struct compression_info));
+	if (ctx->sampler.exhaustive) {
+		ret = cpe_compress_chunks_sequential(&ctx->worker, ctx->pattern, pattern_size);
+	} else {
+		for (i = 0; i < pattern_size && !ret; i++)
+			ret = cpe_compress_chunk_random(&ctx->worker, ctx->pattern[i]);
+	}
+	if (ret)
+		return ret;
+
+	cpe_info_merge(&ctx->total, &ctx->worker.info);
+	return COMPRESTIMATOR_OK;
+}
+
+EXPORT int comprestimator_run(comprestimator_ctx *ctx)
+{
+	int ret;
+
+	while ((ret = comprestimator_step(ctx)) == COMPRESTIMATOR_OK)
+		;
+	return (ret == COMPRESTIMATOR_DONE) ? COMPRESTIMATOR_OK : ret;
+}
+
+EXPORT int comprestimator_snapshot(comprestimator_ctx *ctx, struct comprestimator_result *res)
+{
+	struct compression_info info;
+	int total_samples;
+
+	if (!ctx || !res)
+		return COMPRESTIMATOR_EINVAL;
+
+	cpe_info_snapshot(&ctx->total, &info);
+	total_samples = info.num_zero_blocks + info.num_non_zero_blocks;
+
+	memset(res, 0, sizeof(struct comprestimator_result));
+	res->dev_size = ctx->dev_size;
+	res->zero_blocks = info.num_zero_blocks;
+	res->non_zero_blocks = info.num_non_zero_blocks;
+	res->blocks_read = info.total_blocks_read;
+	res->comp_frac = info.ratio.mean;
+	res->variance = (info.ratio.n > 1) ? info.ratio.m2 / (double)(info.ratio.n - 1) : 0;
+	res->done = ctx->done;
+	if (total_samples) {
+		res->non_zero_frac = (double)info.num_non_zero_blocks / total_samples;
+		cpe_confidence_bounds(&info, &res->conf_zeros, &res->conf_comp);
+	}
+	return COMPRESTIMATOR_OK;
+}
+
+EXPORT void comprestimator_close(comprestimator_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	cpe_worker_destroy(&ctx->worker);
+	free(ctx->pattern);
+	free(ctx);
+}
+
+/* Compress the non-zero blocks of buf from offset start as one stream, on the
+ * initialized strm. With single set, stop once one output block is full (like
+ * cpe_compress_chunk_random); otherwise compress all of it, restarting the stream
+ * at every full output block (like cpe_compress_chunks_sequential). */
+static int compress_buffer(struct comp_worker *w, z_stream *strm, unsigned char *buf, size_t len, size_t start,
+		int single, uint64_t *in_bytes, uint64_t *out_bytes)
+{
+	size_t block, pos, end;
+	uLong saved_ti;
+	int ret;
+	uint64_t t0;
+
+	deflateReset(strm);
+	strm->next_out = w->outbuf;
+	strm->avail_out = OUTBLOCK_SIZE;
+	*in_bytes = 0;
+	*out_bytes = 0;
+
+	for (block = start - start % INBLOCK_SIZE; block + INBLOCK_SIZE <= len; block += INBLOCK_SIZE) {
+		t0 = profile_start(w->profile);
+		ret = cpe_is_zero_block((char *) buf + block);
+		profile_end(w->profile, PHASE_ZERO_CHECK, t0);
+		if (ret)
+			continue;
+
+		pos = (block < start) ? start : block;
+		end = block + INBLOCK_SIZE;
+		while (pos < end) {
+			strm->next_in = buf + pos;
+			strm->avail_in = end - pos;
+			saved_ti = strm->total_in;
+			t0 = profile_start(w->profile);
+			ret = deflate_cont(strm, Z_SYNC_FLUSH);
+			profile_end(w->profile, PHASE_DEFLATE, t0);
+			if (ret != Z_OK)
+				return COMPRESTIMATOR_EZLIB;
+			pos += strm->total_in - saved_ti;
+			if (strm->avail_out)
+				continue;
+			if (single)
+				goto done;
+			*in_bytes += strm->total_in;
+			*out_bytes += strm->total_out;
+			deflateReset(strm);
+			strm->next_out = w->outbuf;
+			strm->avail_out = OUTBLOCK_SIZE;
+		}
+	}
+
+done:
+	*in_bytes += strm->total_in;
+	*out_bytes += strm->total_out;
+	return COMPRESTIMATOR_OK;
+}
+
+/* Raise the sampling level until the kept samples fit again, and recount
+ * the statistics of those that remain */
+static void stream_thin(comprestimator_stream *st)
+{
+	int i, kept;
+
+	while (st->num_samples >= STREAM_MAX_SAMPLES) {
+		st->level++;
+		for (i = 0, kept = 0; i < st->num_samples; i++)
+			if (st->samples[i].level >= st->level)
+				st->samples[kept++] = st->samples[i];
+		st->num_samples = kept;
+	}
+
+	st->cur.num_zero_blocks = 0;
+	st->cur.num_non_zero_blocks = 0;
+	memset(&st->cur.ratio, 0, sizeof(struct moments));
+	for (i = 0; i < st->num_samples; i++) {
+		if (st->samples[i].ratio < 0) {
+			st->cur.num_zero_blocks++;
+		} else {
+			st->cur.num_non_zero_blocks++;
+			cpe_moments_add(&st->cur.ratio, st->samples[i].ratio);
+		}
+	}
+}
+
+/* Sample the current window, of which len bytes are in st->window */
+static int stream_sample_window(comprestimator_stream *st, size_t len)
+{
+	struct comp_worker *w = &st->worker;
+	struct stream_sample *sample;
+	uint64_t in_bytes, out_bytes;
+	size_t blocks = len / INBLOCK_SIZE;
+	size_t start;
+	size_t i;
+	int ret;
+	uint64_t t0;
+
+	if (!blocks)
+		return COMPRESTIMATOR_OK;
+
+	if (st->exhaustive) {
+		for (i = 0; i < blocks; i++) {
+			if (cpe_is_zero_block((char *) st->window + i * INBLOCK_SIZE))
+				st->cur.num_zero_blocks++;
+			else
+				st->cur.num_non_zero_blocks++;
+		}
+		st->cur.total_blocks_read += blocks;
+		ret = compress_buffer(w, &st->strm, st->window, blocks * INBLOCK_SIZE, 0, 0, &in_bytes, &out_bytes);
+		if (ret)
+			return ret;
+		st->zlib_in += in_bytes;
+		st->zlib_out += out_bytes;
+		if (st->zlib_in) {
+			/* One ratio for the whole stream, as in an exhaustive device pass */
+			st->cur.ratio.n = st->cur.num_non_zero_blocks;
+			st->cur.ratio.mean = (double)st->zlib_out / (double)st->zlib_in;
+			st->cur.ratio.m2 = 0;
+		}
+	} else {
+		start = (st->window_block % blocks) * INBLOCK_SIZE;
+		sample = &st->samples[st->num_samples++];
+		sample->level = st->window_level;
+
+		t0 = profile_start(w->profile);
+		ret = cpe_is_zero_block((char *) st->window + start);
+		profile_end(w->profile, PHASE_ZERO_CHECK, t0);
+		if (ret) {
+			st->cur.total_blocks_read++;
+			sample->ratio = -1;
+		} else {
+			start += rand_next(&w->rng) % INBLOCK_SIZE;
+			ret = compress_buffer(w, &st->strm, st->window, blocks * INBLOCK_SIZE, start, 1, &in_bytes, &out_bytes);
+			if (ret) {
+				st->num_samples--;
+				return ret;
+			}
+			st->cur.total_blocks_read += (in_bytes + INBLOCK_SIZE - 1) / INBLOCK_SIZE;
+			sample->ratio = in_bytes ? (double)out_bytes / (double)in_bytes : 1;
+		}
+
+		if (st->num_samples >= STREAM_MAX_SAMPLES) {
+			stream_thin(st);
+		} else if (sample->ratio < 0) {
+			st->cur.num_zero_blocks++;
+		} else {
+			st->cur.num_non_zero_blocks++;
+			cpe_moments_add(&st->cur.ratio, sample->ratio);
+		}
+	}
+
+	cpe_info_commit(&st->total, &st->cur);
+	worker_progress(w, st->cur.num_zero_blocks, st->cur.num_non_zero_blocks, st->cur.total_blocks_read);
+	return COMPRESTIMATOR_OK;
+}
+
+/* Draw the level of the next window and the block that would be sampled */
+static void stream_start_window(comprestimator_stream *st)
+{
+	uint64_t r = rand_next(&st->worker.rng);
+
+	st->window_level = __builtin_ctzll(r | (1ULL << 63));
+	st->window_block = rand_next(&st->worker.rng) % (STREAM_WINDOW_SIZE / INBLOCK_SIZE);
+}
+
+EXPORT int comprestimator_stream_open(comprestimator_stream **stp, const struct comprestimator_options *opts)
+{
+	struct comprestimator_options defaults;
+	comprestimator_stream *st;
+	int ret;
+
+	if (!stp)
+		return COMPRESTIMATOR_EINVAL;
+	*stp = NULL;
+	if (!opts) {
+		comprestimator_default_options(&defaults);
+		opts = &defaults;
+	}
+
+	st = (comprestimator_stream *) calloc(1, sizeof(comprestimator_stream));
+	if (!st)
+		return COMPRESTIMATOR_ENOMEM;
+	ret = cpe_worker_init(&st->worker, opts->seed ? opts->seed : ((uint64_t)time(NULL) ^ cpe_now_ns()));
+	if (ret) {
+		free(st);
+		return ret;
+	}
+	st->exhaustive = opts->exhaustive;
+	st->window = (unsigned char *) malloc(STREAM_WINDOW_SIZE);
+	if (!st->exhaustive)
+		st->samples = (struct stream_sample *) malloc(sizeof(struct stream_sample) * STREAM_MAX_SAMPLES);
+	if (!st->window || (!st->exhaustive && !st->samples)) {
+		comprestimator_stream_close(st);
+		return COMPRESTIMATOR_ENOMEM;
+	}
+	cpe_pool_zstream(&st->worker.pool, &st->strm);
+	ret = deflateInit(&st->strm, 1);
+	if (ret != Z_OK) {
+		comprestimator_stream_close(st);
+		return COMPRESTIMATOR_EZLIB;
+	}
+	st->strm_init = 1;
+	stream_start_window(st);
+
+	*stp = st;
+	return COMPRESTIMATOR_OK;
+}
+
+EXPORT int comprestimator_stream_push(comprestimator_stream *st, const void *buf, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) buf;
+	size_t n;
+	int sampled;
+	int ret;
+
+	if (!st || (!buf && len) || st->finished)
+		return COMPRESTIMATOR_EINVAL;
+
+	while (len) {
+		n = min(len, (size_t)(STREAM_WINDOW_SIZE - st->window_fill));
+		sampled = (st->window_level >= st->level);
+		if (sampled)
+			memcpy(st->window + st->window_fill, p, n);
+		st->window_fill += n;
+		st->bytes += n;
+		p += n;
+		len -= n;
+
+		if (st->window_fill == STREAM_WINDOW_SIZE) {
+			if (sampled) {
+				ret = stream_sample_window(st, STREAM_WINDOW_SIZE);
+				if (ret)
+					return ret;
+			}
+			st->window_fill = 0;
+			stream_start_window(st);
+		}
+	}
+	return COMPRESTIMATOR_OK;
+}
+
+EXPORT int comprestimator_stream_finish(comprestimator_stream *st)
+{
+	int ret = COMPRESTIMATOR_OK;
+
+	if (!st)
+		return COMPRESTIMATOR_EINVAL;
+	if (st->finished)
+		return COMPRESTIMATOR_OK;
+	if (st->window_fill && st->window_level >= st->level)
+		ret = stream_sample_window(st, st->window_fill);
+	st->window_fill = 0;
+	st->finished = 1;
+	return ret;
+}
+
+EXPORT int comprestimator_stream_snapshot(comprestimator_stream *st, struct comprestimator_result *res)
+{
+	struct compression_info info;
+	int total_samples;
+
+	if (!st || !res)
+		return COMPRESTIMATOR_EINVAL;
+
+	cpe_info_snapshot(&st->total, &info);
+	total_samples = info.num_zero_blocks + info.num_non_zero_blocks;
+
+	memset(res, 0, sizeof(struct comprestimator_result));
+	res->dev_size = st->bytes;
+	res->zero_blocks = info.num_zero_blocks;
+	res->non_zero_blocks = info.num_non_zero_blocks;
+	res->blocks_read = info.total_blocks_read;
+	res->comp_frac = info.ratio.mean;
+	res->variance = (info.ratio.n > 1) ? info.ratio.m2 / (double)(info.ratio.n - 1) : 0;
+	res->done = st->finished;
+	if (total_samples) {
+		res->non_zero_frac = (double)info.num_non_zero_blocks / total_samples;
+		cpe_confidence_bounds(&info, &res->conf_zeros, &res->conf_comp);
+	}
+	return COMPRESTIMATOR_OK;
+}
+
+EXPORT void comprestimator_stream_close(comprestimator_stream *st)
+{
+	if (!st)
+		return;
+	if (st->strm_init)
+		deflateEnd(&st->strm);
+	cpe_worker_destroy(&st->worker);
+	free(st->window);
+	free(st->samples);
+	free(st);
+}
+
+void cpe_stream_info(comprestimator_stream *st, struct compression_info *info)
+{
+	cpe_info_snapshot(&st->total, info);
+}
+
+struct comp_worker *cpe_stream_worker(comprestimator_stream *st)
+{
+	return &st->worker;
+}
+
+EXPORT const char *comprestimator_strerror(int status)
+{
+	switch (status) {
+		case COMPRESTIMATOR_OK:
+			return "success";
+		case COMPRESTIMATOR_DONE:
+			return "estimation finished";
+		case COMPRESTIMATOR_EINVAL:
+			return "invalid argument";
+		case COMPRESTIMATOR_ENOMEM:
+			return "out of memory";
+		case COMPRESTIMATOR_EIO:
+			return "I/O error on the source";
+		case COMPRESTIMATOR_EZLIB:
+			return "compressor failure";
+		case COMPRESTIMATOR_ETOOSMALL:
+			return "source is smaller than one block";
+		default:
+			return "unknown error";
+	}
+}
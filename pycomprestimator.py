@@ -0,0 +1,229 @@
+"""
+Python binding of libcomprestimator.
+
+estimate() runs the estimation engine in-process through ctypes and returns an
+Estimate. ctypes releases the GIL for the duration of every library call, so
+several paths can be estimated concurrently from Python threads. When
+libcomprestimator.so is not available (it needs a PIC build of the bundled
+zlib, see README) the comprestimator binary is run instead, writing to a
+private results file per call.
+"""
+import csv
+import ctypes
+import ctypes.util
+import math
+import os
+import subprocess
+import tempfile
+from dataclasses import dataclass, asdict
+from typing import Callable, Optional
+
+LIBRARY_NAME = "libcomprestimator.so"
+COMPRESTIMATOR_PATH = "./comprestimator"
+
+# Status codes of comprestimator.h
+COMPRESTIMATOR_OK = 0
+COMPRESTIMATOR_DONE = 1
+
+# Column indices of a comprestimator -r results line (binary fallback only)
+RES_DEV_SIZE_MB = 11
+RES_ZERO_BLOCKS = 6
+RES_NON_ZERO_BLOCKS = 7
+RES_TOTAL_BLOCKS_READ = 8
+RES_CONF_COMP = 10
+RES_AFTER_ZERO_PERC = 13
+RES_CONF_ZEROS = 14
+RES_AFTER_RTC_PERC = 16
+
+
+class ComprestimatorError(Exception):
+    def __init__(self, status: int, message: str):
+        super().__init__(message)
+        self.status = status
+
+
+@dataclass
+class Estimate:
+    path: str
+    dev_size: int               # bytes
+    zero_blocks: int
+    non_zero_blocks: int
+    blocks_read: int
+    non_zero_frac: float        # fraction of non-zero blocks
+    conf_zeros: float           # +- bound on non_zero_frac
+    comp_frac: float            # compressed/original size of the non-zero data
+    conf_comp: float            # +- bound on comp_frac
+    variance: float             # sample variance of the compression ratio (nan from the binary)
+    done: bool
+
+    @property
+    def size_after_zero_mb(self) -> float:
+        """Volume after migration without compression (MB)"""
+        return self.dev_size / 1048576 * self.non_zero_frac
+
+    @property
+    def size_after_rtc_mb(self) -> float:
+        """Volume after migration with compression (MB)"""
+        return self.size_after_zero_mb * self.comp_frac
+
+    @property
+    def compression_ratio(self) -> float:
+        return 1 / self.comp_frac if self.comp_frac else math.inf
+
+    def to_dict(self) -> dict:
+        return asdict(self)
+
+
+class _Options(ctypes.Structure):
+    _fields_ = [
+        ("seed", ctypes.c_uint64),
+        ("exhaustive", ctypes.c_int),
+        ("target_error", ctypes.c_double),
+    ]
+
+
+class _Result(ctypes.Structure):
+    _fields_ = [
+        ("dev_size", ctypes.c_uint64),
+        ("zero_blocks", ctypes.c_uint64),
+        ("non_zero_blocks", ctypes.c_uint64),
+        ("blocks_read", ctypes.c_uint64),
+        ("non_zero_frac", ctypes.c_double),
+        ("conf_zeros", ctypes.c_double),
+        ("comp_frac", ctypes.c_double),
+        ("conf_comp", ctypes.c_double),
+        ("variance", ctypes.c_double),
+        ("done", ctypes.c_int),
+    ]
+
+
+_lib = None
+_lib_loaded = False
+
+
+def _load_library():
+    global _lib, _lib_loaded
+    if _lib_loaded:
+        return _lib
+    _lib_loaded = True
+
+    candidates = [os.environ.get("COMPRESTIMATOR_LIB"),
+                  os.path.join(os.path.dirname(os.path.abspath(__file__)), LIBRARY_NAME),
+                  ctypes.util.find_library("comprestimator")]
+    for candidate in candidates:
+        if not candidate:
+            continue
+        try:
+            lib = ctypes.CDLL(candidate)
+        except OSError:
+            continue
+        ctx_p = ctypes.c_void_p
+        lib.comprestimator_default_options.argtypes = [ctypes.POINTER(_Options)]
+        lib.comprestimator_default_options.restype = None
+        lib.comprestimator_open.argtypes = [ctypes.POINTER(ctx_p), ctypes.c_char_p, ctypes.POINTER(_Options)]
+        lib.comprestimator_open.restype = ctypes.c_int
+        lib.comprestimator_step.argtypes = [ctx_p]
+        lib.comprestimator_step.restype = ctypes.c_int
+        lib.comprestimator_snapshot.argtypes = [ctx_p, ctypes.POINTER(_Result)]
+        lib.comprestimator_snapshot.restype = ctypes.c_int
+        lib.comprestimator_close.argtypes = [ctx_p]
+        lib.comprestimator_close.restype = None
+        lib.comprestimator_strerror.argtypes = [ctypes.c_int]
+        lib.comprestimator_strerror.restype = ctypes.c_char_p
+        _lib = lib
+        break
+    return _lib
+
+
+def have_library() -> bool:
+    """True when estimates run in-process rather than through the binary"""
+    return _load_library() is not None
+
+
+def _check(lib, status: int, path: str):
+    if status < 0:
+        message = lib.comprestimator_strerror(status).decode()
+        raise ComprestimatorError(status, f"{path}: {message}")
+
+
+def _estimate_library(lib, path: str, seed: int, exhaustive: bool, target_error: float,
+                      progress: Optional[Callable[[Estimate], None]]) -> Estimate:
+    opts = _Options()
+    lib.comprestimator_default_options(ctypes.byref(opts))
+    opts.seed = seed
+    opts.exhaustive = int(exhaustive)
+    opts.target_error = target_error
+
+    ctx = ctypes.c_void_p()
+    _check(lib, lib.comprestimator_open(ctypes.byref(ctx), os.fsencode(path), ctypes.byref(opts)), path)
+    try:
+        res = _Result()
+        while True:
+            status = lib.comprestimator_step(ctx)
+            _check(lib, status, path)
+            if progress is not None or status == COMPRESTIMATOR_DONE:
+                _check(lib, lib.comprestimator_snapshot(ctx, ctypes.byref(res)), path)
+                result = Estimate(path, *[getattr(res, name) for name, _ in _Result._fields_])
+                result.done = bool(result.done)
+                if progress is not None:
+                    progress(result)
+            if status == COMPRESTIMATOR_DONE:
+                return result
+    finally:
+        lib.comprestimator_close(ctx)
+
+
+def _estimate_binary(path: str, seed: int, exhaustive: bool, target_error: float) -> Estimate:
+    comprestimator = os.environ.get("COMPRESTIMATOR", COMPRESTIMATOR_PATH)
+    if not os.path.isfile(comprestimator):
+        raise FileNotFoundError(f"""Comprestimator executable not found at {comprestimator}.
+                                    Build it with 'make' and run from its directory, or set COMPRESTIMATOR""")
+
+    res_file = tempfile.NamedTemporaryFile(mode="r", prefix="comprestimator_", suffix=".csv", delete=False)
+    try:
+        cmd = [comprestimator, "-d", path, "-r", res_file.name]
+        if seed:
+            cmd += ["-s", str(seed)]
+        if exhaustive:
+            cmd.append("-e")
+        if target_error:
+            cmd += ["--target-error", str(target_error * 100)]
+        subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        rows = [row for row in csv.reader(res_file) if row]
+    finally:
+        res_file.close()
+        os.unlink(res_file.name)
+
+    if not rows:
+        raise ComprestimatorError(-1, f"{path}: comprestimator wrote no results")
+    row = [field.strip() for field in rows[-1]]
+    return Estimate(path=path,
+                    dev_size=int(float(row[RES_DEV_SIZE_MB]) * 1048576),
+                    zero_blocks=int(row[RES_ZERO_BLOCKS]),
+                    non_zero_blocks=int(row[RES_NON_ZERO_BLOCKS]),
+                    blocks_read=int(row[RES_TOTAL_BLOCKS_READ]),
+                    non_zero_frac=float(row[RES_AFTER_ZERO_PERC]) / 100,
+                    conf_zeros=float(row[RES_CONF_ZEROS]),
+                    comp_frac=float(row[RES_AFTER_RTC_PERC]) / 100,
+                    conf_comp=float(row[RES_CONF_COMP]),
+                    variance=math.nan,
+                    done=True)
+
+
+def estimate(path: str, seed: int = 0, exhaustive: bool = False, target_error: float = 0,
+             progress: Optional[Callable[[Estimate], None]] = None) -> Estimate:
+    """
+    Estimates the compression of a file or device.
+
+    seed: PRNG seed (0 for a time based seed); exhaustive: compress every block;
+    target_error: stop once both error bounds are within this fraction (0 for the
+    default). progress is called with the current Estimate after every sampled
+    batch (in-process only; the binary fallback reports once at the end).
+    """
+    lib = _load_library()
+    if lib is not None:
+        return _estimate_library(lib, path, seed, exhaustive, target_error, progress)
+    result = _estimate_binary(path, seed, exhaustive, target_error)
+    if progress is not None:
+        progress(result)
+    return result
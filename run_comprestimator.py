@@ -1,19 +1,21 @@
 from enum import Enum
-import subprocess
 import argparse
 import io
+import json
 import os
 import random
+import sys
 import tempfile
 import tarfile
-import csv
+import time
 from fnmatch import fnmatch
 
+import pycomprestimator
+
 DEFAULT_SAMPLE_FILE_SIZE = 10_000_000_000 # If weighted sampling, sets max file size of sample archive
 DEFAULT_SAMPLING_PERCENTAGE = .1
 
-COMPRESTIMATOR_PATH = "./comprestimator"
-COMPRESTIMATOR_RESULTS_PATH = "./results.csv"
+PROGRESS_INTERVAL = 1.0 # Seconds between progress lines
 
 KNOWN_COMPRESSED_FILE_SUFFIXES = [".png", ".jpg", ".jpeg", ".gif", ".mp3", ".mp4", ".docx", ".xlsx", ".zip", ".rar", ".bz", ".gz"]
 
@@ -134,13 +136,27 @@ def percent_type(value):
         raise argparse.ArgumentTypeError("Invalid percentage value")
 
 
-def file_comprestimator(input_path: str):
-    comprestimator_exists = os.path.isfile(COMPRESTIMATOR_PATH)
-    if not comprestimator_exists:
-        raise FileNotFoundError(f"""Comprestimator executable not found  at {COMPRESTIMATOR_PATH}.  
-                                    Make sure you are running this python file from same directory as the comprestimator executable (and that you have compiled the executable with 'make')""")
-    _ = subprocess.run(["./comprestimator", "-d", input_path, "-r", COMPRESTIMATOR_RESULTS_PATH], check=True)
-    print(f"Comprestimator ran successfully, wrote results to {COMPRESTIMATOR_RESULTS_PATH}")
+class ProgressPrinter():
+    """
+    Progress callback that prints the current estimate at most every PROGRESS_INTERVAL seconds
+    """
+    def __init__(self):
+        self.last = 0.0
+
+    def __call__(self, estimate: pycomprestimator.Estimate):
+        now = time.monotonic()
+        if now - self.last < PROGRESS_INTERVAL and not estimate.done:
+            return
+        self.last = now
+        print(f"Based on {estimate.zero_blocks + estimate.non_zero_blocks} samples: "
+              f"{estimate.non_zero_frac*100:.2f}% non-zero (+- {estimate.conf_zeros*100:.2f}%), "
+              f"{estimate.comp_frac*100:.2f}% compression rate (+- {estimate.conf_comp*100:.2f}%)", file=sys.stderr)
+
+
+def file_comprestimator(input_path: str) -> pycomprestimator.Estimate:
+    estimate = pycomprestimator.estimate(input_path, progress=ProgressPrinter())
+    print("Comprestimator ran successfully")
+    return estimate
 
 
 def check_if_compressed(file: str, found_compressed_types: set):
@@ -186,9 +202,10 @@ def get_partial_file(file_entry):
 
     return tarinfo, data_buffer
 
-def directory_comprestimator(src_dir: str, sampling_strategy=SamplingStrategy.AUTO, sampling_percentage=None, skip_nested_directories=False, excluded_patterns=[], skip_hidden=False) -> str:
+def directory_comprestimator(src_dir: str, sampling_strategy=SamplingStrategy.AUTO, sampling_percentage=None, skip_nested_directories=False, excluded_patterns=[], skip_hidden=False) -> tuple[pycomprestimator.Estimate, list[str]]:
     """
-    Given a directory path, randomly samples files and creates a tar archive from them, and then runs comprestimator on the archive
+    Given a directory path, randomly samples files and creates a tar archive from them, and then runs comprestimator on the archive.
+    Returns the estimate of the archive and notes about its accuracy
     """
     files_with_sizes: list[tuple[str, int]] = []
     total_size = 0
@@ -258,7 +275,7 @@ def directory_comprestimator(src_dir: str, sampling_strategy=SamplingStrategy.AU
 
         # close archive and run comprestimator on it
         temp_file.close()
-        file_comprestimator(temp_file.name)        
+        estimate = file_comprestimator(temp_file.name)
 
         print("Comprestimator finished!")
     finally: 
@@ -275,7 +292,7 @@ def directory_comprestimator(src_dir: str, sampling_strategy=SamplingStrategy.AU
     if files_added < 0.05 * len(files_with_sizes):
         messages.append("Note: < 5%% of files in the directory were sampled due to a low sampling percentage. Consider running the tool with a greater --sampling-percentage for more accurate results.")
 
-    return messages
+    return estimate, messages
 
 
 def main():
@@ -295,6 +312,7 @@ def main():
     )
     parser.add_argument('--skip-nested-directories', action="store_true", help="Will not sample directories nested within target directory, only files")
     parser.add_argument('--skip-hidden', action="store_true", help="Will not sample hidden directories and files within the target directory")
+    parser.add_argument('--results-file', type=str, default=None, help="Also write the estimate as JSON to this file")
     args = parser.parse_args()
     input_path = args.path
 
@@ -320,25 +338,21 @@ def main():
     if path_is_a_directory:
         # If input is a directory, convert it to a file and run comprestimator on that
         print(f"'{input_path}' is a directory, sampling to create an input file for comprestimator. This may take a while for deeply nested directories...")
-        messages = directory_comprestimator(input_path, sampling_strategy, \
+        estimate, messages = directory_comprestimator(input_path, sampling_strategy, \
                                   sampling_percentage, skip_nested_directories, \
                                     excluded_patterns, skip_hidden)
     else:
         # If input is a file, just run comprestimator on it directly
         print(f"'{input_path}' is a file, sampling directly with comprestimator...")
-        file_comprestimator(input_path)
-
-    # Extract results from comprestimator results file and print them
-    with open(COMPRESTIMATOR_RESULTS_PATH, 'r') as file:
-        reader = csv.reader(file)
-        data = list(reader)
-        if not data:
-            raise Exception("Comprestimator results file empty!")
-        
-        most_recent_results = data[-1]
-        initial_size = float(most_recent_results[12])
-        compressed_size = float(most_recent_results[15])
-        
+        estimate = file_comprestimator(input_path)
+
+    if args.results_file:
+        with open(args.results_file, 'w') as file:
+            json.dump(estimate.to_dict(), file, indent=2)
+
+    initial_size = estimate.size_after_zero_mb
+    compressed_size = estimate.size_after_rtc_mb
+
     # Print final results
     print()
     print("*" * 20)